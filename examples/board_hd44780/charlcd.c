@@ -65,6 +65,23 @@ avr_run_thread(
 	return NULL;
 }
 
+// the trace belongs to the simulation thread, keyCB() posts these
+static void
+vcd_start_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_start(&vcd_file);
+}
+
+static void
+vcd_stop_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_stop(&vcd_file);
+}
+
 void keyCB(
 		unsigned char key, int x, int y)	/* called on key press */
 {
@@ -75,11 +92,11 @@ void keyCB(
 			break;
 		case 'r':
 			printf("Starting VCD trace; press 's' to stop\n");
-			avr_vcd_start(&vcd_file);
+			avr_async_call(avr, vcd_start_async, NULL);
 			break;
 		case 's':
 			printf("Stopping VCD trace\n");
-			avr_vcd_stop(&vcd_file);
+			avr_async_call(avr, vcd_stop_async, NULL);
 			break;
 	}
 }
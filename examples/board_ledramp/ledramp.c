@@ -38,7 +38,6 @@
 #include "button.h"
 
 button_t button;
-int do_button_press = 0;
 avr_t * avr = NULL;
 avr_vcd_t vcd_file;
 uint8_t	pin_state = 0;	// current port B
@@ -86,6 +85,35 @@ void displayCB(void)		/* function called whenever redisplay needed */
     //glFlush();				/* Complete any pending operations */
 }
 
+/*
+ * Key presses come from the GLUT thread, they are posted to the simulation
+ * thread, which owns the button timer and the trace
+ */
+static void
+vcd_start_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_start(&vcd_file);
+}
+
+static void
+vcd_stop_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_stop(&vcd_file);
+}
+
+static void
+button_press_async(
+		struct avr_t * avr,
+		void * param)
+{
+	printf("Button pressed\n");
+	button_press(&button, 1000000);
+}
+
 void keyCB(unsigned char key, int x, int y)	/* called on key press */
 {
 	if (key == 'q')
@@ -97,15 +125,15 @@ void keyCB(unsigned char key, int x, int y)	/* called on key press */
 			exit(0);
 			break;
 		case ' ':
-			do_button_press++; // pass the message to the AVR thread
+			avr_async_call(avr, button_press_async, NULL);
 			break;
 		case 'r':
 			printf("Starting VCD trace\n");
-			avr_vcd_start(&vcd_file);
+			avr_async_call(avr, vcd_start_async, NULL);
 			break;
 		case 's':
 			printf("Stopping VCD trace\n");
-			avr_vcd_stop(&vcd_file);
+			avr_async_call(avr, vcd_stop_async, NULL);
 			break;
 	}
 }
@@ -125,15 +153,8 @@ void timerCB(int i)
 
 static void * avr_run_thread(void * oaram)
 {
-	int b_press = do_button_press;
-	
 	while (1) {
 		avr_run(avr);
-		if (do_button_press != b_press) {
-			b_press = do_button_press;
-			printf("Button pressed\n");
-			button_press(&button, 1000000);
-		}
 	}
 	return NULL;
 }
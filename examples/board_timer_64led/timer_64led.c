@@ -45,7 +45,6 @@ enum {
 	B_MAX
 };
 button_t button[B_MAX]; // Start/Stop/Reset
-volatile int do_button_press[B_MAX] = {0};
 avr_t * avr = NULL;
 avr_vcd_t vcd_file;
 hc595_t shifter;
@@ -152,6 +151,31 @@ void displayCB(void)		/* function called whenever redisplay needed */
     //glFlush();				/* Complete any pending operations */
 }
 
+// run by the AVR thread, on behalf of keyCB()
+static void
+vcd_start_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_start(&vcd_file);
+}
+
+static void
+vcd_stop_async(
+		struct avr_t * avr,
+		void * param)
+{
+	avr_vcd_stop(&vcd_file);
+}
+
+static void
+button_press_async(
+		struct avr_t * avr,
+		void * param)
+{
+	button_press((button_t *)param, 100000);
+}
+
 void keyCB(unsigned char key, int x, int y)	/* called on key press */
 {
 	if (key == 'q')
@@ -164,15 +188,15 @@ void keyCB(unsigned char key, int x, int y)	/* called on key press */
 			break;
 		case '1' ... '3':
 			printf("Press %d\n", key-'1');
-			do_button_press[key-'1']++; // pass the message to the AVR thread
+			avr_async_call(avr, button_press_async, &button[key-'1']);
 			break;
 		case 'r':
 			printf("Starting VCD trace\n");
-			avr_vcd_start(&vcd_file);
+			avr_async_call(avr, vcd_start_async, NULL);
 			break;
 		case 's':
 			printf("Stopping VCD trace\n");
-			avr_vcd_stop(&vcd_file);
+			avr_async_call(avr, vcd_stop_async, NULL);
 			break;
 	}
 }
@@ -192,18 +216,8 @@ void timerCB(int i)
 
 static void * avr_run_thread(void * ignore)
 {
-	int b_press[3] = {0};
-	
 	while (1) {
 		avr_run(avr);
-
-		for (int i = 0; i < 3; i++) {
-			if (do_button_press[i] != b_press[i]) {
-				b_press[i] = do_button_press[i];
-				printf("Button pressed %d\n", i);
-				button_press(&button[i], 100000);
-			}
-		}
 	}
 	return NULL;
 }
@@ -54,8 +54,8 @@ void avr_special_init( avr_t* avr, void *data)
 {
 	struct avr_flash *flash_data = (struct avr_flash *)data;
 	//puts(" --=== INIT CALLED ===--");
-	// release flash memory if allocated
-	if(avr->flash) free(avr->flash);
+	// release the flash simavr allocated, this one replaces it
+	avr_release_flash(avr);
 	// open the file
 	flash_data->avr_flash_fd = open(flash_data->avr_flash_path,
             O_RDWR|O_CREAT, 0644);
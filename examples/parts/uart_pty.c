@@ -97,17 +97,19 @@ uart_pty_flush_incoming(
 	}
 }
 
-avr_cycle_count_t
-uart_pty_flush_timer(
+/*
+ * Posted by the pty thread via the async queue when it has queued new
+ * bytes; this runs on the simulation thread.
+ */
+static void
+uart_pty_flush_async(
 		struct avr_t * avr,
-		avr_cycle_count_t when,
 		void * param)
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 
+	__atomic_store_n(&p->flush_posted, 0, __ATOMIC_RELEASE);
 	uart_pty_flush_incoming(p);
-	/* always return a cycle NUMBER not a cycle count */
-	return p->xon ? when + avr_hz_to_cycles(p->avr, 1000) : 0;
 }
 
 /*
@@ -125,11 +127,6 @@ uart_pty_xon_hook(
 	p->xon = 1;
 
 	uart_pty_flush_incoming(p);
-
-	// if the buffer is not flushed, try to do it later
-	if (p->xon)
-			avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 1000),
-						uart_pty_flush_timer, param);
 }
 
 /*
@@ -144,7 +141,6 @@ uart_pty_xoff_hook(
 	uart_pty_t * p = (uart_pty_t*)param;
 	TRACE(if (p->xon) printf("uart_pty_xoff_hook\n");)
 	p->xon = 0;
-	avr_cycle_timer_cancel(p->avr, uart_pty_flush_timer, param);
 }
 
 static void *
@@ -175,10 +171,9 @@ uart_pty_thread(
 		struct timeval timo = { 0, 500 };
 		int ret = select(max+1, &read_set, &write_set, NULL, &timo);
 
-		if (!ret)
-			continue;
 		if (ret < 0)
 			break;
+		// on a timeout the sets are empty, but the flush is still posted
 
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
 			if (FD_ISSET(p->port[ti].s, &read_set)) {
@@ -216,10 +211,16 @@ uart_pty_thread(
 				TRACE(if (!p->port[ti].tap) hdump("pty send", buffer, r);)
 			}
 		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
+		/* DO NOT call uart_pty_flush_incoming() here, this create a
+		 * concurency issue with the FIFO; ask the simulation thread
+		 * to do it instead. If the queue is full, we'll retry on the
+		 * next loop */
+		if ((!uart_pty_fifo_isempty(&p->pty.out) ||
+				!uart_pty_fifo_isempty(&p->tap.out)) &&
+				!__atomic_exchange_n(&p->flush_posted, 1, __ATOMIC_ACQ_REL)) {
+			if (avr_async_call(p->avr, uart_pty_flush_async, p))
+				__atomic_store_n(&p->flush_posted, 0, __ATOMIC_RELEASE);
+		}
 	}
 	return NULL;
 }
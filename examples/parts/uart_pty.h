@@ -51,6 +51,7 @@ typedef struct uart_pty_t {
 
 	pthread_t	thread;
 	int			xon;
+	int			flush_posted;	// a flush is pending in the async queue
 
 	union {
 		struct {
@@ -27,6 +27,7 @@
 
 #include "uart_udp.h"
 #include "avr_uart.h"
+#include "sim_avr.h"
 #include "sim_hex.h"
 
 DEFINE_FIFO(uint8_t,uart_udp_fifo);
@@ -41,6 +42,29 @@ static void uart_udp_in_hook(struct avr_irq_t * irq, uint32_t value, void * para
 	uart_udp_fifo_write(&p->in, value);
 }
 
+static void uart_udp_flush_incoming(uart_udp_t * p)
+{
+	// try to empty our fifo, the uart_udp_xoff_hook() will be called when
+	// other side is full
+	while (p->xon && !uart_udp_fifo_isempty(&p->out)) {
+		uint8_t byte = uart_udp_fifo_read(&p->out);
+	//	printf("uart_udp_xon_hook send %02x\n", byte);
+		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, byte);
+	}
+}
+
+/*
+ * Posted by the socket thread when new bytes are in the fifo, runs
+ * on the simulation thread
+ */
+static void uart_udp_flush_async(struct avr_t * avr, void * param)
+{
+	uart_udp_t * p = (uart_udp_t*)param;
+
+	__atomic_store_n(&p->flush_posted, 0, __ATOMIC_RELEASE);
+	uart_udp_flush_incoming(p);
+}
+
 /*
  * Called when the uart has room in it's input buffer. This is called repeateadly
  * if necessary, while the xoff is called only when the uart fifo is FULL
@@ -51,13 +75,7 @@ static void uart_udp_xon_hook(struct avr_irq_t * irq, uint32_t value, void * par
 //	if (!p->xon)
 //		printf("uart_udp_xon_hook\n");
 	p->xon = 1;
-	// try to empty our fifo, the uart_udp_xoff_hook() will be called when
-	// other side is full
-	while (p->xon && !uart_udp_fifo_isempty(&p->out)) {
-		uint8_t byte = uart_udp_fifo_read(&p->out);
-	//	printf("uart_udp_xon_hook send %02x\n", byte);
-		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, byte);
-	}
+	uart_udp_flush_incoming(p);
 }
 
 /*
@@ -88,8 +106,12 @@ static void * uart_udp_thread(void * param)
 		struct timeval timo = { 0, 500 };	// short, but not too short interval
 		int ret = select(max, &read_set, &write_set, NULL, &timo);
 
-		if (!ret)
-			continue;
+		// on errors the sets aren't updated, ignore them like on a timeout
+		if (ret < 0) {
+			FD_ZERO(&read_set);
+			FD_ZERO(&write_set);
+		}
+		// on a timeout the sets are empty, but the flush is still posted
 
 		if (FD_ISSET(p->s, &read_set)) {
 			uint8_t buffer[512];
@@ -106,6 +128,11 @@ static void * uart_udp_thread(void * param)
 			if (r > 0)
 				printf("UDP dropped %zu bytes\n", r);
 		}
+		if (!uart_udp_fifo_isempty(&p->out) &&
+				!__atomic_exchange_n(&p->flush_posted, 1, __ATOMIC_ACQ_REL)) {
+			if (avr_async_call(p->avr, uart_udp_flush_async, p))
+				__atomic_store_n(&p->flush_posted, 0, __ATOMIC_RELEASE);
+		}
 		if (FD_ISSET(p->s, &write_set)) {
 			uint8_t buffer[512];
 			// write them in fifo
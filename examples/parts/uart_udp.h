@@ -44,6 +44,7 @@ typedef struct uart_udp_t {
 	struct sockaddr_in peer;
 
 	int			xon;
+	int			flush_posted;	// a flush is pending in the async queue
 	uart_udp_fifo_t in;
 	uart_udp_fifo_t out;
 } uart_udp_t;
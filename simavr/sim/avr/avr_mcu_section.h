@@ -63,6 +63,7 @@ enum {
 	AVR_MMCU_TAG_VCD_PORTPIN,
 	AVR_MMCU_TAG_VCD_IRQ,
 	AVR_MMCU_TAG_PORT_EXTERNAL_PULL,
+	AVR_MMCU_TAG_REGION_NAME,
 };
 
 enum {
@@ -70,6 +71,12 @@ enum {
 	SIMAVR_CMD_VCD_START_TRACE,
 	SIMAVR_CMD_VCD_STOP_TRACE,
 	SIMAVR_CMD_UART_LOOPBACK,
+	// start/stop the binary instruction trace, see sim_itrace.h
+	SIMAVR_CMD_ITRACE_START,
+	SIMAVR_CMD_ITRACE_STOP,
+	// open/close a measurement region, followed by its number, see sim_regions.h
+	SIMAVR_CMD_REGION_START,
+	SIMAVR_CMD_REGION_STOP,
 };
 
 #if __AVR__
@@ -107,6 +114,13 @@ struct avr_mmcu_vcd_trace_t {
 	char name[32];
 } __attribute__((__packed__));
 
+struct avr_mmcu_region_t {
+	uint8_t tag;
+	uint8_t len;
+	uint8_t id;
+	char name[32];
+} __attribute__((__packed__));
+
 #define AVR_MCU_STRING(_tag, _str) \
 	const struct avr_mmcu_string_t _##_tag _MMCU_ = {\
 		.tag = _tag,\
@@ -152,7 +166,9 @@ struct avr_mmcu_vcd_trace_t {
 /*!
  * Specifies the name and wanted period (in usec) for a VCD file
  * this is not mandatory for the VCD output to work, if this tag
- * is not used, a VCD file will still be created with default values
+ * is not used, a VCD file will still be created with default values.
+ * If the name ends in ".fst", the trace is written in GTKWave's
+ * compressed FST format instead.
  */
 #define AVR_MCU_VCD_FILE(_name, _period) \
 	AVR_MCU_STRING(AVR_MMCU_TAG_VCD_FILENAME, _name);\
@@ -235,6 +251,20 @@ struct avr_mmcu_vcd_trace_t {
 #define AVR_MCU_VCD_ALL_IRQ_PENDING() \
 	AVR_MCU_VCD_IRQ_TRACE(0xff, 0, "IRQ_PENDING")
 
+/*!
+ * Names a measurement region, for the report simavr prints at exit.
+ * Regions are opened and closed by the firmware with SIMAVR_REGION_START()
+ * and SIMAVR_REGION_STOP(), through the command register.
+ * AVR_MCU_REGION_NAME(3, "crc16");
+ */
+#define AVR_MCU_REGION_NAME(_id, _name) \
+	const struct avr_mmcu_region_t DO_CONCAT(_region_, __LINE__) _MMCU_ = {\
+		.tag = AVR_MMCU_TAG_REGION_NAME, \
+		.len = sizeof(struct avr_mmcu_region_t) - 2,\
+		.id = _id, \
+		.name = _name, \
+	}
+
 /*!
  * This tag allows you to specify the voltages used by your board
  * It is optional in most cases, but you will need it if you use
@@ -323,6 +353,12 @@ struct avr_mmcu_vcd_trace_t {
 		_MAP_1(_SEND_SIMAVR_CMD_BYTE, reg, __VA_ARGS__) \
 	} while(0)
 
+// Opens and closes measurement region '_id', see AVR_MCU_REGION_NAME()
+#define SIMAVR_REGION_START(reg, _id) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_REGION_START, _id)
+#define SIMAVR_REGION_STOP(reg, _id) \
+	SEND_SIMAVR_CMD(reg, SIMAVR_CMD_REGION_STOP, _id)
+
 #endif /* __AVR__ */
 
 #ifdef __cplusplus
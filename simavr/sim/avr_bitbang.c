@@ -99,7 +99,7 @@ static void avr_bitbang_write_bit(avr_bitbang_t *p)
 
 	// output to HW pin
 	if ( p->p_out.port ) {
-		avr_raise_irq(avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_out.port ), p->p_out.pin), bit);
+		avr_raise_irq(p->irq_out, bit);
 	}
 
 	// module callback
@@ -130,7 +130,7 @@ static void avr_bitbang_clk_edge(avr_bitbang_t *p)
 
 	// generate clock output on HW pin
 	if ( p->clk_generate && p->p_clk.port ) {
-		avr_raise_irq(avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_clk.port ), p->p_clk.pin), clk);
+		avr_raise_irq(p->irq_clk, clk);
 	}
 
 	if ( phase ) {
@@ -194,6 +194,11 @@ void avr_bitbang_reset(avr_t *avr, avr_bitbang_t * p)
 		abort();
 	}
 
+	// resolve the pin IRQs once, they are used for every clock edge
+	p->irq_clk = p->p_clk.port ?
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_clk.port ), p->p_clk.pin) : NULL;
+	p->irq_out = p->p_out.port ?
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_out.port ), p->p_out.pin) : NULL;
 }
 
 /**
@@ -220,7 +225,7 @@ void avr_bitbang_start(avr_bitbang_t * p)
 	} else {
 		// slave mode -> attach clock function to clock pin
 		///@todo test
-		avr_irq_register_notify( avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_clk.port ), p->p_clk.pin), avr_bitbang_clk_hook, p);
+		avr_irq_register_notify( p->irq_clk, avr_bitbang_clk_hook, p);
 	}
 
 }
@@ -238,7 +243,8 @@ void avr_bitbang_stop(avr_bitbang_t * p)
 
 	p->enabled = 0;
 	avr_cycle_timer_cancel(p->avr, avr_bitbang_clk_timer, p);
-	avr_irq_unregister_notify( avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ( p->p_clk.port ), p->p_clk.pin), avr_bitbang_clk_hook, p);
+	if ( p->irq_clk )
+		avr_irq_unregister_notify( p->irq_clk, avr_bitbang_clk_hook, p);
 }
 
 #ifdef __cplusplus
@@ -82,6 +82,8 @@ typedef struct avr_bitbang_t {
 							///		- latest received bit the is lowest / most right one, bit number: 0
 							///		- next bit to be written is the highest one, bit number: (buffer_size-1)
 	int8_t		clk_count;	///< internal clock edge count
+	avr_irq_t *	irq_clk;	///< clock pin IRQ, looked up at reset
+	avr_irq_t *	irq_out;	///< data out pin IRQ, looked up at reset
 } avr_bitbang_t;
 
 /**
@@ -917,7 +917,17 @@ avr_timer_init(
 
 	// this assumes all the "pending" interrupt bits are in the same
 	// register. Might not be true on all devices ?
-	avr_register_io_write(avr, p->overflow.raised.reg, avr_timer_write_pending, p);
+	// Other timers often share that register (tiny85 TIFR), so only claim
+	// our own flag bits.
+	uint8_t pending = p->overflow.raised.mask << p->overflow.raised.bit;
+	if (p->icr.raised.reg == p->overflow.raised.reg)
+		pending |= p->icr.raised.mask << p->icr.raised.bit;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		if (p->comp[compi].interrupt.raised.reg == p->overflow.raised.reg)
+			pending |= p->comp[compi].interrupt.raised.mask <<
+					p->comp[compi].interrupt.raised.bit;
+	avr_register_io_write_masked(avr, p->overflow.raised.reg,
+			avr_timer_write_pending, p, pending);
 
 	/*
 	 * Even if the timer is 16 bits, we don't care to have watches on the
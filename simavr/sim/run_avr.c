@@ -24,12 +24,20 @@
 #include <libgen.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
 #include "sim_hex.h"
+#include "sim_image.h"
 #include "sim_vcd_file.h"
+#include "sim_int_stats.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+#include "sim_timeline.h"
+#include "sim_log_async.h"
+#include "sim_console.h"
 
 #include "sim_core_decl.h"
 
@@ -48,10 +56,29 @@ display_usage(
 			"       [-ff <.hex file>]   Load next .hex file as flash\n"
 			"       [-ee <.hex file>]   Load next .hex file as eeprom\n"
 			"       [--input|-i <file>] A .vcd file to use as input signals\n"
+			"       [--input-loop]      Replay the input file in a loop\n"
+			"       [--int-stats]       Print interrupt statistics on exit\n"
+			"       [--int-stats-csv <file>] Write interrupt statistics as CSV on exit\n"
+			"       [--itrace <file>]   Write a binary instruction trace, see trace_avr\n"
+			"       [--itrace-ring <n>] Only keep the last <n> instructions in the trace\n"
+			"       [--itrace-off]      Don't start the trace, firmware or gdb will\n"
+			"       [--profile <file>]  Profile cycles, write a callgrind file on exit\n"
+			"       [--profile-top <n>] Profile cycles, print the top <n> functions on exit\n"
+			"       [--timeline <file>] Write interrupts, sleep and peripheral events\n"
+			"                           as a Chrome/Perfetto trace\n"
 			"       [-v]                Raise verbosity level\n"
 			"                           (can be passed more than once)\n"
-			"       <firmware>          A .hex or an ELF file. ELF files are\n"
-			"                           prefered, and can include debugging syms\n");
+			"       [--log-async]       Format and print log messages in a\n"
+			"                           background thread\n"
+			"       [--console <file>]  Stream the firmware console register to\n"
+			"                           <file> ('-' for stdout), not the log\n"
+			"       [--write-image <file>] Save the loaded firmware as a simavr\n"
+			"                           image, for fast loading, and exit\n"
+			"       <firmware>          A .hex, a simavr .img or an ELF file. ELF\n"
+			"                           files are prefered, and can include\n"
+			"                           debugging syms\n"
+			"Sending SIGHUP reloads <firmware> and resets the core, without\n"
+			"restarting simavr\n");
 	exit(1);
 }
 
@@ -69,12 +96,160 @@ list_cores()
 }
 
 static avr_t * avr = NULL;
+static avr_int_stats_t * int_stats = NULL;
+static int int_stats_report = 0;
+static const char * int_stats_csv = NULL;
+static const char * profile_file = NULL;
+static int profile_top = 0;
+
+static void
+int_stats_dump()
+{
+	if (!int_stats)
+		return;
+	if (int_stats_report)
+		avr_int_stats_report(int_stats, stdout);
+	if (int_stats_csv)
+		avr_int_stats_write_csv(int_stats, int_stats_csv);
+}
+
+static void
+profile_dump()
+{
+	if (!avr || !avr->profile)
+		return;
+	if (profile_top)
+		avr_profile_report(avr, stdout, profile_top);
+	if (profile_file)
+		avr_profile_write_callgrind(avr, profile_file);
+}
+
+// the .hex files, each with the -ff/-ee base it was given; they are
+// loaded once the core exists, and again on reload
+#define HEX_FILES_MAX	8
+static struct {
+	const char *	file;
+	uint32_t		base;
+} hex_files[HEX_FILES_MAX];
+static int hex_count = 0;
+
+/*
+ * Loads all the .hex files in the core, in the order they were given.
+ * 'flashbase' gets the lowest flash address of the files that had flash
+ * data. Returns -1 if one couldn't be loaded.
+ */
+static int
+load_hex_files(
+		uint32_t * flashbase)
+{
+	for (int i = 0; i < hex_count; i++) {
+		uint32_t base = 0;
+		int cnt = avr_load_ihex(avr, hex_files[i].file, hex_files[i].base, &base);
+		if (cnt < 0) {
+			fprintf(stderr, "Unable to load IHEX file %s\n", hex_files[i].file);
+			return -1;
+		}
+		printf("Loaded %d bytes of ihex from %s\n", cnt, hex_files[i].file);
+		if (base && (!*flashbase || base < *flashbase))
+			*flashbase = base;
+	}
+	return 0;
+}
+
+static volatile sig_atomic_t reload = 0;
+// the firmware the core runs; if it came from a .img, the image is
+// released when it is replaced
+static elf_firmware_t loaded = {{0}};
+
+// symbols read from an ELF file; image ones go with avr_image_release()
+static void
+free_symbols(
+		elf_firmware_t * f)
+{
+#if ELF_SYMBOLS
+	for (uint32_t i = 0; i < f->symbolcount; i++)
+		free(f->symbol[i]);
+	free(f->symbol);
+	f->symbol = NULL;
+	f->symbolcount = 0;
+#endif
+}
+
+static void
+sig_hup(
+		int sign)
+{
+	reload = 1;
+}
+
+/*
+ * Reads 'filename' (an ELF or an image, if any) and the .hex files again,
+ * and swaps them in the running core. If the firmware file can't be read,
+ * or is for another core, the current firmware keeps running.
+ */
+static void
+reload_firmware(
+		const char * filename,
+		const char * name,
+		uint32_t f_cpu)
+{
+	elf_firmware_t f = {{0}};
+	char * suffix = filename ? strrchr(filename, '.') : NULL;
+	int elf = filename && !(suffix && !strcasecmp(suffix, ".img"));
+
+	if (filename && (elf ? elf_read_firmware(filename, &f) :
+			avr_image_read(filename, &f)) == -1) {
+		fprintf(stderr, "Unable to reload %s, firmware unchanged\n", filename);
+		return;
+	}
+	// as on startup, -mcu overrides what the firmware says
+	if (name[0])
+		strcpy(f.mmcu, name);
+	if (filename && strcmp(f.mmcu, loaded.mmcu) && strcmp(f.mmcu, avr->mmcu)) {
+		fprintf(stderr, "%s is for '%s', not '%s', firmware unchanged\n",
+				filename, f.mmcu, avr->mmcu);
+		if (elf) {
+			free(f.flash);
+			free(f.eeprom);
+			free(f.fuse);
+			free(f.lockbits);
+		}
+		avr_image_release(&f);
+		free_symbols(&f);
+		return;
+	}
+	if (f_cpu)
+		f.frequency = f_cpu;
+	avr_reload_firmware(avr, &f);
+	// the profiler uses the new symbols now, nothing points to the previous
+	// image or symbols anymore
+	avr_image_release(&loaded);
+	free_symbols(&loaded);
+	loaded = f;
+	if (hex_count) {
+		f.flashbase = 0;
+		load_hex_files(&f.flashbase);
+		if (f.flashbase)
+			avr->pc = f.flashbase;
+	}
+	if (elf) {
+		// copied in the core by now; symbols stay, the profiler uses them
+		free(f.flash);
+		free(f.eeprom);
+		free(f.fuse);
+		free(f.lockbits);
+	}
+	if (filename)
+		printf("Reloaded %s\n", filename);
+}
 
 static void
 sig_int(
 		int sign)
 {
 	printf("signal caught, simavr terminating\n");
+	int_stats_dump();
+	profile_dump();
 	if (avr)
 		avr_terminate(avr);
 	exit(0);
@@ -95,6 +270,15 @@ main(
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
 	const char *vcd_input = NULL;
+	int vcd_input_loop = 0;
+	const char *itrace = NULL;
+	const char *timeline = NULL;
+	int log_async = 0;
+	const char *console = NULL;
+	const char *write_image = NULL;
+	const char *firmware_file = NULL;
+	uint32_t itrace_ring = 0;
+	int itrace_on = 1;
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
@@ -119,6 +303,42 @@ main(
 				vcd_input = argv[++pi];
 			else
 				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--input-loop")) {
+			vcd_input_loop = 1;
+		} else if (!strcmp(argv[pi], "--int-stats")) {
+			int_stats_report++;
+		} else if (!strcmp(argv[pi], "--int-stats-csv")) {
+			if (pi < argc-1)
+				int_stats_csv = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace")) {
+			if (pi < argc-1)
+				itrace = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace-ring")) {
+			if (pi < argc-1)
+				itrace_ring = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace-off")) {
+			itrace_on = 0;
+		} else if (!strcmp(argv[pi], "--timeline")) {
+			if (pi < argc-1)
+				timeline = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile")) {
+			if (pi < argc-1)
+				profile_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile-top")) {
+			if (pi < argc-1)
+				profile_top = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-t") || !strcmp(argv[pi], "--trace")) {
 			trace++;
 		} else if (!strcmp(argv[pi], "-ti")) {
@@ -128,6 +348,18 @@ main(
 			gdb++;
 		} else if (!strcmp(argv[pi], "-v")) {
 			log++;
+		} else if (!strcmp(argv[pi], "--log-async")) {
+			log_async++;
+		} else if (!strcmp(argv[pi], "--write-image")) {
+			if (pi < argc-1)
+				write_image = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--console")) {
+			if (pi < argc-1)
+				console = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-ee")) {
 			loadBase = AVR_SEGMENT_OFFSET_EEPROM;
 		} else if (!strcmp(argv[pi], "-ff")) {
@@ -140,27 +372,23 @@ main(
 					fprintf(stderr, "%s: -mcu and -freq are mandatory to load .hex files\n", argv[0]);
 					exit(1);
 				}
-				ihex_chunk_p chunk = NULL;
-				int cnt = read_ihex_chunks(filename, &chunk);
-				if (cnt <= 0) {
-					fprintf(stderr, "%s: Unable to load IHEX file %s\n",
-						argv[0], argv[pi]);
+				if (hex_count == HEX_FILES_MAX) {
+					fprintf(stderr, "%s: Too many .hex files, %d at most\n",
+							argv[0], HEX_FILES_MAX);
 					exit(1);
 				}
-				printf("Loaded %d section of ihex\n", cnt);
-				for (int ci = 0; ci < cnt; ci++) {
-					if (chunk[ci].baseaddr < (1*1024*1024)) {
-						f.flash = chunk[ci].data;
-						f.flashsize = chunk[ci].size;
-						f.flashbase = chunk[ci].baseaddr;
-						printf("Load HEX flash %08x, %d\n", f.flashbase, f.flashsize);
-					} else if (chunk[ci].baseaddr >= AVR_SEGMENT_OFFSET_EEPROM ||
-							chunk[ci].baseaddr + loadBase >= AVR_SEGMENT_OFFSET_EEPROM) {
-						// eeprom!
-						f.eeprom = chunk[ci].data;
-						f.eesize = chunk[ci].size;
-						printf("Load HEX eeprom %08x, %d\n", chunk[ci].baseaddr, f.eesize);
-					}
+				// loaded once the core exists, straight into it
+				hex_files[hex_count].file = filename;
+				hex_files[hex_count].base = loadBase;
+				hex_count++;
+				continue;
+			}
+			firmware_file = filename;
+			if (suffix && !strcasecmp(suffix, ".img")) {
+				if (avr_image_read(filename, &f) == -1) {
+					fprintf(stderr, "%s: Unable to load image from file %s\n",
+							argv[0], filename);
+					exit(1);
 				}
 			} else {
 				if (elf_read_firmware(filename, &f) == -1) {
@@ -177,18 +405,43 @@ main(
 	if (f_cpu)
 		f.frequency = f_cpu;
 
+	if (write_image) {
+		if (hex_count) {
+			fprintf(stderr, "%s: Images are made from ELF files\n", argv[0]);
+			exit(1);
+		}
+		if (avr_image_write(write_image, &f)) {
+			fprintf(stderr, "%s: Unable to write image %s\n", argv[0], write_image);
+			exit(1);
+		}
+		exit(0);
+	}
+
 	avr = avr_make_mcu_by_name(f.mmcu);
 	if (!avr) {
 		fprintf(stderr, "%s: AVR '%s' not known\n", argv[0], f.mmcu);
 		exit(1);
 	}
 	avr_init(avr);
+	if (log_async && avr_log_async_init(avr, 0))
+		fprintf(stderr, "%s: Warning: logging stays synchronous\n", argv[0]);
 	avr_load_firmware(avr, &f);
+	loaded = f;
+	if (load_hex_files(&f.flashbase))
+		exit(1);
 	if (f.flashbase) {
 		printf("Attempted to load a bootloader at %04x\n", f.flashbase);
 		avr->pc = f.flashbase;
 	}
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
+	if (console) {
+		int fd = strcmp(console, "-") ?
+				open(console, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+		if (fd == -1 || avr_console_stream(avr, fd, 0)) {
+			fprintf(stderr, "%s: Unable to stream the console to %s\n", argv[0], console);
+			exit(1);
+		}
+	}
 	avr->trace = trace;
 	for (int ti = 0; ti < trace_vectors_count; ti++) {
 		for (int vi = 0; vi < avr->interrupts.vector_count; vi++)
@@ -199,7 +452,30 @@ main(
 		static avr_vcd_t input;
 		if (avr_vcd_init_input(avr, vcd_input, &input)) {
 			fprintf(stderr, "%s: Warning: VCD input file %s failed\n", argv[0], vcd_input);
+		} else
+			input.loop = vcd_input_loop;
+	}
+
+	if (itrace) {
+		if (avr_itrace_init(avr, itrace, itrace_ring, !itrace_ring)) {
+			fprintf(stderr, "%s: Unable to create trace file %s\n", argv[0], itrace);
+			exit(1);
 		}
+		avr_itrace_enable(avr, itrace_on);
+	}
+
+	if (profile_file || profile_top) {
+#if ELF_SYMBOLS
+		avr_profile_init(avr, f.symbol, f.symbolcount);
+#else
+		avr_profile_init(avr, NULL, 0);
+#endif
+	}
+
+	if (int_stats_report || int_stats_csv) {
+		static avr_int_stats_t stats;
+		avr_int_stats_init(avr, &stats);
+		int_stats = &stats;
 	}
 
 	// even if not setup at startup, activate gdb if crashing
@@ -208,15 +484,28 @@ main(
 		avr->state = cpu_Stopped;
 		avr_gdb_init(avr);
 	}
+	// after gdb, as it chains the sleep callback gdb installs
+	if (timeline && avr_timeline_init(avr, timeline)) {
+		fprintf(stderr, "%s: Unable to create timeline file %s\n", argv[0], timeline);
+		exit(1);
+	}
 
 	signal(SIGINT, sig_int);
 	signal(SIGTERM, sig_int);
+	if (firmware_file || hex_count)
+		signal(SIGHUP, sig_hup);
 
 	for (;;) {
 		int state = avr_run(avr);
 		if (state == cpu_Done || state == cpu_Crashed)
 			break;
+		if (reload) {
+			reload = 0;
+			reload_firmware(firmware_file, name, f_cpu);
+		}
 	}
 
+	int_stats_dump();
+	profile_dump();
 	avr_terminate(avr);
 }
@@ -0,0 +1,224 @@
+/*
+	sim_async.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef __MINGW32__
+#include <poll.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "sim_avr.h"
+#include "sim_async.h"
+
+#define QUEUE_MASK	(AVR_ASYNC_QUEUE_SIZE - 1)
+
+void
+avr_async_init(
+		avr_t * avr)
+{
+	avr_async_queue_t * q = &avr->async;
+
+	memset(q, 0, sizeof(*q));
+	q->wakeup[0] = q->wakeup[1] = -1;
+	q->event = malloc(AVR_ASYNC_QUEUE_SIZE * sizeof(q->event[0]));
+	if (!q->event)
+		return;
+	memset(q->event, 0, AVR_ASYNC_QUEUE_SIZE * sizeof(q->event[0]));
+	for (int i = 0; i < AVR_ASYNC_QUEUE_SIZE; i++)
+		q->event[i].seq = i;
+}
+
+void
+avr_async_release(
+		avr_t * avr)
+{
+	avr_async_queue_t * q = &avr->async;
+
+	if (q->wakeup[0] != -1)
+		close(q->wakeup[0]);
+	if (q->wakeup[1] != -1 && q->wakeup[1] != q->wakeup[0])
+		close(q->wakeup[1]);
+	q->wakeup[0] = q->wakeup[1] = -1;
+	if (q->event)
+		free(q->event);
+	q->event = NULL;
+}
+
+/*
+ * Bounded MPSC ring; each slot carries a sequence number that tells the
+ * producers whether the slot is free for 'their' cursor position, and the
+ * consumer whether it has been filled for its own position.
+ */
+static int
+avr_async_post(
+		avr_t * avr,
+		avr_async_event_t * e)
+{
+	avr_async_queue_t * q = &avr->async;
+
+	if (!q->event)
+		return -1;
+
+	avr_async_event_t * slot;
+	uint32_t pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &q->event[pos & QUEUE_MASK];
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->write, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return -1;	// full
+		else
+			pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+	}
+	slot->irq = e->irq;
+	slot->value = e->value;
+	slot->callback = e->callback;
+	slot->param = e->param;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in avr_async_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+		int fd = __atomic_load_n(&q->wakeup[1], __ATOMIC_ACQUIRE);
+		if (fd != -1) {
+			uint64_t one = 1;
+			ssize_t r = write(fd, &one, sizeof(one));
+			(void)r;
+		}
+	}
+	return 0;
+}
+
+int
+avr_async_raise_irq(
+		avr_t * avr,
+		avr_irq_t * irq,
+		uint32_t value)
+{
+	avr_async_event_t e = { .irq = irq, .value = value };
+	return avr_async_post(avr, &e);
+}
+
+int
+avr_async_call(
+		avr_t * avr,
+		avr_async_callback_t callback,
+		void * param)
+{
+	avr_async_event_t e = { .callback = callback, .param = param };
+	return avr_async_post(avr, &e);
+}
+
+void
+avr_async_process(
+		avr_t * avr)
+{
+	avr_async_queue_t * q = &avr->async;
+
+	while (avr_async_pending(q)) {
+		avr_async_event_t * slot = &q->event[q->read & QUEUE_MASK];
+		avr_async_event_t e = *slot;
+		// give the slot back to the producers before calling anything
+		__atomic_store_n(&slot->seq, q->read + AVR_ASYNC_QUEUE_SIZE,
+				__ATOMIC_RELEASE);
+		q->read++;
+
+		if (e.irq)
+			avr_raise_irq(e.irq, e.value);
+		if (e.callback)
+			e.callback(avr, e.param);
+	}
+}
+
+int
+avr_async_wakeup_init(
+		avr_t * avr)
+{
+#ifdef __MINGW32__
+	return -1;
+#else
+	avr_async_queue_t * q = &avr->async;
+
+	if (q->wakeup[0] != -1)
+		return 0;
+#ifdef __linux__
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	q->wakeup[0] = fd;
+	__atomic_store_n(&q->wakeup[1], fd, __ATOMIC_RELEASE);
+#else
+	int fds[2];
+	if (pipe(fds))
+		return -1;
+	for (int i = 0; i < 2; i++)
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+	q->wakeup[0] = fds[0];
+	__atomic_store_n(&q->wakeup[1], fds[1], __ATOMIC_RELEASE);
+#endif
+	return 0;
+#endif
+}
+
+int
+avr_async_wait(
+		avr_t * avr,
+		uint32_t usec)
+{
+#ifdef __MINGW32__
+	return 0;
+#else
+	avr_async_queue_t * q = &avr->async;
+
+	/* short sleeps are not worth the syscalls, let the caller usleep() */
+	if (!q->event || usec < 1000)
+		return 0;
+	/* Nobody ever posted anything, don't bother with a file descriptor */
+	if (q->wakeup[0] == -1) {
+		if (__atomic_load_n(&q->write, __ATOMIC_RELAXED) == 0)
+			return 0;
+		if (avr_async_wakeup_init(avr))
+			return 0;
+	}
+	__atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!avr_async_pending(q)) {
+		struct pollfd pfd = { .fd = q->wakeup[0], .events = POLLIN };
+		if (poll(&pfd, 1, usec / 1000) > 0) {
+			uint8_t drain[64];	// eventfd needs 8 bytes, pipe might have more
+			while (read(q->wakeup[0], drain, sizeof(drain)) > 0)
+				;
+		}
+	}
+	__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+	return 1;
+#endif
+}
@@ -0,0 +1,132 @@
+/*
+	sim_async.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous event queue, allows threads other than the one running the
+ * simulation (pty/socket threads in parts, UI threads of the boards etc)
+ * to post IRQ raises, or callbacks, to an AVR instance.
+ *
+ * The queue is a bounded multiple-producers/single-consumer ring; posting
+ * is lock free and never blocks. The simulation thread drains the queue
+ * at cycle timer boundaries, and if the core is sleeping, it is woken up
+ * when a new event is posted.
+ *
+ * Everything posted is executed on the simulation thread, so callbacks
+ * can freely raise IRQs, register cycle timers and so on.
+ */
+#ifndef __SIM_ASYNC_H__
+#define __SIM_ASYNC_H__
+
+#include "sim_avr_types.h"
+#include "sim_irq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Needs to be a power of two
+#define AVR_ASYNC_QUEUE_SIZE	256
+
+typedef void (*avr_async_callback_t)(
+		struct avr_t * avr,
+		void * param);
+
+typedef struct avr_async_event_t {
+	uint32_t				seq;		// slot sequence, used for synchronization
+	avr_irq_t *				irq;		// IRQ to raise, if any
+	uint32_t				value;		// ... and its value
+	avr_async_callback_t	callback;	// or callback to call
+	void *					param;
+} avr_async_event_t;
+
+typedef struct avr_async_queue_t {
+	avr_async_event_t *	event;		// ring, allocated by avr_async_init()
+	uint32_t			write;		// producers cursor
+	uint32_t			read;		// consumer cursor, simulation thread only
+	uint32_t			sleeping;	// non-zero while the core waits for wakeup
+	int					wakeup[2];	// eventfd (or pipe), created on demand
+} avr_async_queue_t;
+
+/*
+ * Post an IRQ raise to the simulation thread. Can be called from any thread.
+ * Returns zero if the event was queued, -1 if the queue was full.
+ */
+int
+avr_async_raise_irq(
+		struct avr_t * avr,
+		avr_irq_t * irq,
+		uint32_t value);
+/*
+ * Post a callback to be called by the simulation thread. Can be called from
+ * any thread. Returns zero if the event was queued, -1 if the queue was full.
+ */
+int
+avr_async_call(
+		struct avr_t * avr,
+		avr_async_callback_t callback,
+		void * param);
+
+//
+// Private, called from the core
+//
+void
+avr_async_init(
+		struct avr_t * avr);
+void
+avr_async_release(
+		struct avr_t * avr);
+// runs all the events currently queued
+void
+avr_async_process(
+		struct avr_t * avr);
+/*
+ * Creates the wakeup file descriptor now, rather than when the first event
+ * is posted. Returns -1 if not supported on this platform.
+ */
+int
+avr_async_wakeup_init(
+		struct avr_t * avr);
+/*
+ * Waits for 'usec' or until an event is posted, whichever comes first.
+ * Returns zero if the wait was not possible, and the caller should sleep
+ * by other means.
+ */
+int
+avr_async_wait(
+		struct avr_t * avr,
+		uint32_t usec);
+
+// return non-zero if there is something to process in the queue
+static inline int
+avr_async_pending(
+		avr_async_queue_t * q)
+{
+	return q->event &&
+		__atomic_load_n(
+			&q->event[q->read & (AVR_ASYNC_QUEUE_SIZE - 1)].seq,
+			__ATOMIC_ACQUIRE) == q->read + 1;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ASYNC_H__ */
@@ -25,12 +25,24 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
 #include "avr_uart.h"
 #include "sim_vcd_file.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+#include "sim_timeline.h"
+#include "sim_log_async.h"
+#include "sim_regions.h"
+#include "sim_console.h"
+#include "sim_int_stats.h"
 #include "avr/avr_mcu_section.h"
 
 #define AVR_KIND_DECL
@@ -92,16 +104,156 @@ avr_get_time_stamp(
 	return stamp - avr->time_base;
 }
 
-int
-avr_init(
+#if defined(__linux__) && defined(SYS_memfd_create)
+/*
+ * Erased flash is a private mapping of a memory file full of 0xff that all
+ * the instances share; pages are only copied when code is loaded in them.
+ * The file grows to fit the largest flash asked for so far.
+ */
+static pthread_mutex_t _avr_erased_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _avr_erased_fd = -1;
+static size_t _avr_erased_size;
+
+static uint8_t *
+_avr_map_erased(
+		size_t size)
+{
+	uint8_t * res = NULL;
+	pthread_mutex_lock(&_avr_erased_lock);
+	if (_avr_erased_fd == -1)
+		_avr_erased_fd = syscall(SYS_memfd_create, "simavr-flash", 0);
+	if (_avr_erased_fd != -1 && _avr_erased_size < size) {
+		uint8_t ff[4096];
+		memset(ff, 0xff, sizeof(ff));
+		if (ftruncate(_avr_erased_fd, size) == 0) {
+			for (; _avr_erased_size < size; _avr_erased_size += sizeof(ff))
+				if (pwrite(_avr_erased_fd, ff, sizeof(ff),
+						_avr_erased_size) != sizeof(ff))
+					break;
+		}
+	}
+	if (_avr_erased_fd != -1 && _avr_erased_size >= size) {
+		void * m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				_avr_erased_fd, 0);
+		if (m != MAP_FAILED)
+			res = m;
+	}
+	pthread_mutex_unlock(&_avr_erased_lock);
+	return res;
+}
+#endif
+
+// rounded to pages, so the mappings can be sized the same on release
+static size_t
+_avr_mem_size(
+		size_t size)
+{
+#ifdef __linux__
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+#else
+	return size;
+#endif
+}
+
+/*
+ * Allocates flash and data space. Where possible they are mappings, so
+ * creating an instance doesn't touch the memory; data pages are zeroed by
+ * the kernel on first use, flash ones come from the shared erased file.
+ */
+static void
+_avr_mem_alloc(
+		avr_t * avr)
+{
+	size_t fsize = _avr_mem_size(avr->flashend + 4);
+	size_t dsize = _avr_mem_size(avr->ramend + 1);
+
+	avr->mem_mapped = 0;
+#if defined(__linux__) && defined(SYS_memfd_create)
+	avr->flash = _avr_map_erased(fsize);
+	if (avr->flash) {
+		void * m = mmap(NULL, dsize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m != MAP_FAILED) {
+			avr->data = m;
+			avr->mem_mapped = 1;
+		} else
+			munmap(avr->flash, fsize);
+	}
+#endif
+	if (!avr->mem_mapped) {
+		avr->flash = malloc(fsize);
+		avr->data = malloc(dsize);
+		memset(avr->data, 0, avr->ramend + 1);
+	}
+	avr->mem_flash = avr->flash;
+	avr->mem_data = avr->data;
+}
+
+void
+avr_release_flash(
+		avr_t * avr)
+{
+	if (avr->mem_flash) {
+#ifdef __linux__
+		if (avr->mem_mapped)
+			munmap(avr->mem_flash, _avr_mem_size(avr->flashend + 4));
+		else
+#endif
+			free(avr->mem_flash);
+	}
+	if (avr->flash == avr->mem_flash)
+		avr->flash = NULL;
+	avr->mem_flash = NULL;
+}
+
+// only frees what _avr_mem_alloc() allocated, a replaced flash isn't ours
+static void
+_avr_mem_free(
 		avr_t * avr)
 {
-	avr->flash = malloc(avr->flashend + 4);
-	memset(avr->flash, 0xff, avr->flashend + 1);
+	avr_release_flash(avr);
+	if (avr->mem_data) {
+#ifdef __linux__
+		if (avr->mem_mapped)
+			munmap(avr->mem_data, _avr_mem_size(avr->ramend + 1));
+		else
+#endif
+			free(avr->mem_data);
+	}
+	avr->mem_data = NULL;
+	avr->mem_mapped = 0;
+	avr->flash = NULL;
+	avr->data = NULL;
+}
+
+void
+avr_erase_flash(
+		avr_t * avr)
+{
+#ifdef __linux__
+	/*
+	 * Dropping the private copies of a mapping of the erased file makes
+	 * it read back as the file again, without touching the other pages.
+	 */
+	if (!avr->mem_mapped || avr->flash != avr->mem_flash ||
+			madvise(avr->flash, _avr_mem_size(avr->flashend + 4),
+				MADV_DONTNEED))
+#endif
+		memset(avr->flash, 0xff, avr->flashend + 1);
 	*((uint16_t*)&avr->flash[avr->flashend + 1]) = AVR_OVERFLOW_OPCODE;
 	avr->codeend = avr->flashend;
-	avr->data = malloc(avr->ramend + 1);
-	memset(avr->data, 0, avr->ramend + 1);
+}
+
+int
+avr_init(
+		avr_t * avr)
+{
+	_avr_mem_alloc(avr);
+	avr_erase_flash(avr);
+	// IO handlers, at least up to the end of the 64 'classic' IO registers
+	avr->io_count = AVR_DATA_TO_IO((avr->ioend > 0x5f ? avr->ioend : 0x5f) + 1);
+	avr->io = calloc(avr->io_count, sizeof(avr->io[0]));
 #ifdef CONFIG_SIMAVR_TRACE
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
 #endif
@@ -113,6 +265,7 @@ avr_init(
 	avr->frequency = 1000000;	// can be overridden via avr_mcu_section
 	avr_cmd_init(avr);
 	avr_interrupt_init(avr);
+	avr_async_init(avr);
 	if (avr->custom.init)
 		avr->custom.init(avr, avr->custom.data);
 	if (avr->init)
@@ -142,10 +295,19 @@ avr_terminate(
 		avr_vcd_close(avr->vcd);
 		avr->vcd = NULL;
 	}
+	avr_itrace_dispose(avr);
+	avr_profile_dispose(avr);
+	avr_timeline_close(avr);
+	avr_regions_dispose(avr);
+	avr_console_release(avr);
 	avr_deallocate_ios(avr);
+	avr_async_release(avr);
+	avr_log_async_release(avr);
 
-	if (avr->flash) free(avr->flash);
-	if (avr->data) free(avr->data);
+	_avr_mem_free(avr);
+	if (avr->io) free(avr->io);
+	avr->io = NULL;
+	avr->io_count = 0;
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
@@ -162,14 +324,16 @@ avr_reset(
 	AVR_LOG(avr, LOG_TRACE, "%s reset\n", avr->mmcu);
 
 	avr->state = cpu_Running;
-	for(int i = 0x20; i <= avr->ioend; i++)
-		avr->data[i] = 0;
+	if (avr->ioend >= 0x20)
+		memset(avr->data + 0x20, 0, avr->ioend + 1 - 0x20);
 	_avr_sp_set(avr, avr->ramend);
 	avr->pc = avr->reset_pc;	// Likely to be zero
 	for (int i = 0; i < 8; i++)
 		avr->sreg[i] = 0;
 	avr_interrupt_reset(avr);
 	avr_cycle_timer_reset(avr);
+	if (avr->int_stats)
+		avr_int_stats_reset(avr->int_stats);
 	if (avr->reset)
 		avr->reset(avr);
 	avr_io_t * port = avr->io_port;
@@ -211,6 +375,10 @@ _avr_io_console_write(
 		uint8_t v,
 		void * param)
 {
+	if (avr->console) {
+		avr_console_put(avr->console, v);
+		return;
+	}
 	if (v == '\r' && avr->io_console_buffer.buf) {
 		avr->io_console_buffer.buf[avr->io_console_buffer.len] = 0;
 		AVR_LOG(avr, LOG_OUTPUT, "O:" "%s" "" "\n",
@@ -233,6 +401,10 @@ avr_set_console_register(
 		avr_t * avr,
 		avr_io_addr_t addr)
 {
+	if (avr->console_register)
+		avr_unregister_io_write(avr, avr->console_register,
+				_avr_io_console_write, NULL);
+	avr->console_register = addr;
 	if (addr)
 		avr_register_io_write(avr, addr, _avr_io_console_write, NULL);
 }
@@ -281,11 +453,25 @@ avr_callback_sleep_gdb(
 		;
 }
 
+/*
+ * Runs one instruction through the profiler and/or the instruction trace;
+ * the profiler calls the trace itself when both are on.
+ */
+static avr_flashaddr_t
+_avr_run_one_hooked(
+		avr_t * avr)
+{
+	if (avr->profile_on)
+		return avr_profile_run_one(avr);
+	return avr_itrace_run_one(avr);
+}
+
 void
 avr_callback_run_gdb(
 		avr_t * avr)
 {
-	avr_gdb_processor(avr, avr->state == cpu_Stopped);
+	// when stopped, wait (a while) for gdb to tell us what to do
+	avr_gdb_processor(avr, avr->state == cpu_Stopped ? 100000 : 0);
 
 	if (avr->state == cpu_Stopped)
 		return ;
@@ -298,7 +484,10 @@ avr_callback_run_gdb(
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
+		if (unlikely(avr->itrace_on || avr->profile_on))
+			new_pc = _avr_run_one_hooked(avr);
+		else
+			new_pc = avr_run_one(avr);
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
@@ -307,6 +496,9 @@ avr_callback_run_gdb(
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+	// deliver anything other threads might have posted
+	if (avr_async_pending(&avr->async))
+		avr_async_process(avr);
 
 	avr->pc = new_pc;
 
@@ -350,7 +542,9 @@ avr_callback_sleep_raw(
 	if (runtime_ns >= deadline_ns)
 		return;
 	uint64_t sleep_us = (deadline_ns - runtime_ns) / 1000;
-	usleep(sleep_us);
+	// wait on the async queue if it's in use, so other threads can wake us
+	if (!avr_async_wait(avr, sleep_us))
+		usleep(sleep_us);
 	return;
 }
 
@@ -361,7 +555,10 @@ avr_callback_run_raw(
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
+		if (unlikely(avr->itrace_on || avr->profile_on))
+			new_pc = _avr_run_one_hooked(avr);
+		else
+			new_pc = avr_run_one(avr);
 #if CONFIG_SIMAVR_TRACE
 		avr_dump_state(avr);
 #endif
@@ -370,6 +567,9 @@ avr_callback_run_raw(
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+	// deliver anything other threads might have posted
+	if (avr_async_pending(&avr->async))
+		avr_async_process(avr);
 
 	avr->pc = new_pc;
 
@@ -415,18 +615,81 @@ avr_core_allocate(
 	return (avr_t *)b;
 }
 
+/*
+ * Name index for the avr_kind[] table: every alias of every core, in an
+ * open addressed hash table that is built once, on the first lookup.
+ * If the table is ever too small, the remaining aliases are found by
+ * walking avr_kind[] as before.
+ */
+#define AVR_KIND_INDEX_SIZE	1024	// power of two
+
+typedef struct avr_kind_index_t {
+	const char *	name;
+	avr_kind_t *	kind;
+} avr_kind_index_t;
+
+static avr_kind_index_t _avr_kind_index[AVR_KIND_INDEX_SIZE];
+static int _avr_kind_index_full;
+static pthread_once_t _avr_kind_index_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+_avr_kind_hash(
+		const char * name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
+
+static void
+_avr_kind_index_build(void)
+{
+	int count = 0;
+	for (int i = 0; avr_kind[i]; i++)
+		for (int j = 0; j < 4 && avr_kind[i]->names[j]; j++) {
+			const char * n = avr_kind[i]->names[j];
+			uint32_t h = _avr_kind_hash(n);
+			avr_kind_index_t * e;
+			// keep the table at most half full, so misses stay short
+			if (++count > AVR_KIND_INDEX_SIZE / 2) {
+				_avr_kind_index_full = 1;
+				return;
+			}
+			do
+				e = &_avr_kind_index[h++ & (AVR_KIND_INDEX_SIZE - 1)];
+			while (e->name && strcmp(e->name, n));
+			if (!e->name) {	// first alias wins, as in the table
+				e->name = n;
+				e->kind = avr_kind[i];
+			}
+		}
+}
+
+static avr_kind_t *
+_avr_kind_find(
+		const char * name)
+{
+	pthread_once(&_avr_kind_index_once, _avr_kind_index_build);
+	uint32_t h = _avr_kind_hash(name);
+	for (avr_kind_index_t * e;
+			(e = &_avr_kind_index[h++ & (AVR_KIND_INDEX_SIZE - 1)])->name; )
+		if (!strcmp(e->name, name))
+			return e->kind;
+	if (!_avr_kind_index_full)
+		return NULL;
+	for (int i = 0; avr_kind[i]; i++)
+		for (int j = 0; j < 4 && avr_kind[i]->names[j]; j++)
+			if (!strcmp(avr_kind[i]->names[j], name))
+				return avr_kind[i];
+	return NULL;
+}
+
 avr_t *
 avr_make_mcu_by_name(
 		const char *name)
 {
-	avr_kind_t * maker = NULL;
-	for (int i = 0; avr_kind[i] && !maker; i++) {
-		for (int j = 0; avr_kind[i]->names[j]; j++)
-			if (!strcmp(avr_kind[i]->names[j], name)) {
-				maker = avr_kind[i];
-				break;
-			}
-	}
+	avr_kind_t * maker = _avr_kind_find(name);
 	if (!maker) {
 		AVR_LOG(((avr_t*)0), LOG_ERROR, "%s: AVR '%s' not known\n", __FUNCTION__, name);
 		return NULL;
@@ -446,7 +709,10 @@ std_logger(
 		va_list ap)
 {
 	if (!avr || avr->log >= level) {
-		vfprintf((level > LOG_ERROR) ?  stdout : stderr , format, ap);
+		if (avr && avr->log_queue)
+			avr_log_async_post(avr->log_queue, level, format, ap);
+		else
+			vfprintf((level > LOG_ERROR) ?  stdout : stderr , format, ap);
 	}
 }
 
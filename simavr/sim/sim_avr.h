@@ -40,6 +40,7 @@ extern "C" {
 #include "sim_interrupts.h"
 #include "sim_cmds.h"
 #include "sim_cycle_timers.h"
+#include "sim_async.h"
 
 typedef uint32_t avr_flashaddr_t;
 
@@ -64,14 +65,38 @@ enum {
 	R_SPL	= 32+0x3d, R_SPH,
 	// real SREG
 	R_SREG	= 32+0x3f,
-
-	// maximum number of IO registers, on normal AVRs
-	MAX_IOs	= 280,	// Bigger AVRs need more than 256-32 (mega1280)
 };
 
 #define AVR_DATA_TO_IO(v) ((v) - 32)
 #define AVR_IO_TO_DATA(v) ((v) + 32)
 
+/*
+ * One IO register handler slot. Kept small as it's looked up for each
+ * IO access by the core.
+ */
+typedef struct avr_io_slot_t {
+	struct {
+		avr_io_read_t c;
+		void * param;
+	} r;
+	struct {
+		avr_io_write_t c;
+		void * param;
+	} w;
+	struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
+	uint8_t w_mask;			// bits owned by the write callback
+} avr_io_slot_t;
+
+// Write dispatcher for an IO register shared by several modules
+typedef struct avr_io_mux_t {
+	int used, size;
+	struct {
+		avr_io_write_t c;
+		void * param;
+		uint8_t mask;		// bits owned by this callback
+	} * io;
+} avr_io_mux_t;
+
 /**
  * Logging macros and associated log levels.
  * The current log level is kept in avr->log.
@@ -229,7 +254,7 @@ typedef struct avr_t {
 	/*!
 	 * Sleep default behaviour.
 	 * In "raw" mode, it calls usleep, in gdb mode, it waits
-	 * for howLong for gdb command on it's sockets.
+	 * for howLong for gdb commands from the network thread.
 	 */
 	void (*sleep)(struct avr_t * avr, avr_cycle_count_t howLong);
 
@@ -266,24 +291,12 @@ typedef struct avr_t {
 
 	/*
 	 * callback when specific IO registers are read/written.
-	 * There is one drawback here, there is in way of knowing what is the
-	 * "beginning of useful sram" on a core, so there is no way to deduce
-	 * what is the maximum IO register for a core, and thus, we can't
-	 * allocate this table dynamically.
-	 * If you wanted to emulate the BIG AVRs, and XMegas, this would need
-	 * work.
+	 * The table is allocated by avr_init(), with one slot per IO register
+	 * from 0x20 to 'ioend', so small cores don't carry big tables around.
+	 * Use AVR_DATA_TO_IO() to get an index from a data address.
 	 */
-	struct {
-		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
-		struct {
-			void * param;
-			avr_io_read_t c;
-		} r;
-		struct {
-			void * param;
-			avr_io_write_t c;
-		} w;
-	} io[MAX_IOs];
+	avr_io_slot_t *	io;
+	uint16_t		io_count;
 
 	/*
 	 * This block allows sharing of the IO write/read on addresses between
@@ -293,23 +306,27 @@ typedef struct avr_t {
 	 * If this case is detected, a special "dispatch" callback is installed that
 	 * will handle this particular case, without impacting the performance of the
 	 * other, normal cases...
+	 * Each callback comes with the mask of the bits it owns in the register,
+	 * and is only called when one of those is changed, or written to one.
 	 */
 	int				io_shared_io_count;
-	struct {
-		int used;
-		struct {
-			void * param;
-			void * c;
-		} io[4];
-	} io_shared_io[4];
+	struct avr_io_mux_t * io_shared_io;
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *		flash;
 	// this is the general purpose registers, IO registers, and SRAM
 	uint8_t *		data;
+	// flash and data as avr_init() allocated them, and whether they are
+	// mappings rather than malloc()ed; custom.init may replace the flash,
+	// see avr_release_flash()
+	uint8_t *		mem_flash;
+	uint8_t *		mem_data;
+	uint8_t			mem_mapped;
 
 	// queue of io modules
 	struct avr_io_t * io_port;
+	// ioctl/irq lookup index for the io modules, see sim_io.c
+	struct avr_io_index_t * io_index;
 
 	// Builtin and user-defined commands
 	avr_cmd_table_t commands;
@@ -317,13 +334,31 @@ typedef struct avr_t {
 	avr_cycle_timer_pool_t	cycle_timers;
 	// interrupt vectors and delivery fifo
 	avr_int_table_t	interrupts;
+	// events posted by other threads, see sim_async.h
+	avr_async_queue_t	async;
 
 	// DEBUG ONLY -- value ignored if CONFIG_SIMAVR_TRACE = 0
 	uint8_t	trace : 1,
+			itrace_on : 1,	// binary instruction trace is recording
+			profile_on : 1,	// cycle profiler is running
 			log : 4; // log level, default to 1
 
 	// Only used if CONFIG_SIMAVR_TRACE is defined
 	struct avr_trace_data_t *trace_data;
+	// binary instruction trace, see sim_itrace.h
+	struct avr_itrace_t *itrace;
+	// cycle profiler, see sim_profile.h
+	struct avr_profile_t *profile;
+	// Chrome/Perfetto trace events, see sim_timeline.h
+	struct avr_timeline_t *timeline;
+	// firmware measurement regions, see sim_regions.h
+	struct avr_regions_t *regions;
+	// streamed or captured console, see sim_console.h
+	struct avr_console_t *console;
+	// asynchronous backend of the default logger, see sim_log_async.h
+	struct avr_log_queue_t *log_queue;
+	// interrupt statistics, see sim_int_stats.h
+	struct avr_int_stats_t *int_stats;
 
 	// VALUE CHANGE DUMP file (waveforms)
 	// this is the VCD file that gets allocated if the
@@ -334,6 +369,10 @@ typedef struct avr_t {
 
 	// gdb hooking structure. Only present when gdb server is active
 	struct avr_gdb_t * gdb;
+	// one bit per flash word with a gdb breakpoint, see sim_gdb.h
+	uint32_t * gdb_break_map;
+	// AVR_GDB_WATCH_* flags for each data address, NULL if no watchpoints
+	uint8_t * gdb_watch_map;
 
 	// if non-zero, the gdb server will be started when the core
 	// crashed even if not activated at startup
@@ -346,6 +385,7 @@ typedef struct avr_t {
 		uint32_t size;
 		uint32_t len;
 	} io_console_buffer;
+	avr_io_addr_t	console_register;	// see avr_set_console_register()
 } avr_t;
 
 
@@ -388,15 +428,33 @@ void
 avr_terminate(
 		avr_t * avr);
 
+/*
+ * Sets all the flash back to 0xff, as after avr_init(). Where the flash is
+ * a mapping of the erased file, the pages are dropped rather than written.
+ */
+void
+avr_erase_flash(
+		avr_t * avr);
+/*
+ * Releases the flash avr_init() allocated, for a custom.init() hook that
+ * replaces it with its own buffer; that buffer is then the hook's to free,
+ * in custom.deinit().
+ */
+void
+avr_release_flash(
+		avr_t * avr);
+
 // set an IO register to receive commands from the AVR firmware
-// it's optional, and uses the ELF tags
+// it's optional, and uses the ELF tags. It replaces the previous one,
+// if any, zero drops it
 void
 avr_set_command_register(
 		avr_t * avr,
 		avr_io_addr_t addr);
 
 // specify the "console register" -- output sent to this register
-// is printed on the simulator console, without using a UART
+// is printed on the simulator console, without using a UART. Same as
+// above, it replaces the previous one
 void
 avr_set_console_register(
 		avr_t * avr,
@@ -25,6 +25,8 @@
 #include "sim_avr.h"
 #include "sim_cmds.h"
 #include "sim_vcd_file.h"
+#include "sim_itrace.h"
+#include "sim_regions.h"
 #include "avr_uart.h"
 #include "avr/avr_mcu_section.h"
 
@@ -73,6 +75,13 @@ avr_cmd_set_register(
 		avr_t * avr,
 		avr_io_addr_t addr)
 {
+	avr_cmd_table_t * commands = &avr->commands;
+
+	if (commands->addr)
+		avr_unregister_io_write(avr, commands->addr, &_avr_cmd_io_write, NULL);
+	// a half sent command was for the previous register
+	commands->pending = NULL;
+	commands->addr = addr;
 	if (addr)
 		avr_register_io_write(avr, addr, &_avr_cmd_io_write, NULL);
 }
@@ -180,6 +189,17 @@ _simavr_cmd_uart_loopback(
 	return 0;
 }
 
+static int
+_simavr_cmd_itrace(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_itrace_enable(avr, v == SIMAVR_CMD_ITRACE_START);
+
+	return 0;
+}
+
 void
 avr_cmd_init(
 		avr_t * avr)
@@ -190,4 +210,8 @@ avr_cmd_init(
 	avr_cmd_register(avr, SIMAVR_CMD_VCD_START_TRACE, &_simavr_cmd_vcd_start_trace, NULL);
 	avr_cmd_register(avr, SIMAVR_CMD_VCD_STOP_TRACE, &_simavr_cmd_vcd_stop_trace, NULL);
 	avr_cmd_register(avr, SIMAVR_CMD_UART_LOOPBACK, &_simavr_cmd_uart_loopback, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_ITRACE_START, &_simavr_cmd_itrace, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_ITRACE_STOP, &_simavr_cmd_itrace, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_REGION_START, &avr_regions_command, NULL);
+	avr_cmd_register(avr, SIMAVR_CMD_REGION_STOP, &avr_regions_command, NULL);
 }
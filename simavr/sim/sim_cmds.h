@@ -42,6 +42,7 @@ typedef struct avr_cmd_t {
 typedef struct avr_cmd_table_t {
 	avr_cmd_t table[MAX_AVR_COMMANDS];
 	avr_cmd_t * pending;	// Holds a reference to a pending multi-byte command
+	avr_io_addr_t addr;		// IO register the commands are written to, if any
 } avr_cmd_table_t;
 
 // Called by avr_set_command_register()
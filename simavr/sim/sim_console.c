@@ -0,0 +1,231 @@
+/*
+	sim_console.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sim_avr.h"
+#include "sim_console.h"
+
+static void *
+avr_console_thread(
+		void * param)
+{
+	avr_console_t * c = param;
+	uint32_t mask = c->size - 1;
+
+	for (;;) {
+		uint32_t end = __atomic_load_n(&c->write, __ATOMIC_ACQUIRE);
+		while (c->read != end) {
+			// write straight from the ring, up to its end
+			uint32_t start = c->read & mask;
+			uint32_t len = end - c->read;
+			if (len > c->size - start)
+				len = c->size - start;
+			ssize_t r = c->error ? (ssize_t)len :
+					write(c->fd, c->ring + start, len);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				// don't let the simulation wait on a dead fd
+				c->error = errno;
+				r = len;
+			}
+			__atomic_store_n(&c->read, c->read + r, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_lock(&c->lock);
+		__atomic_store_n(&c->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int idle = __atomic_load_n(&c->write, __ATOMIC_ACQUIRE) == c->read;
+		if (idle && __atomic_load_n(&c->quit, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		if (idle)
+			pthread_cond_wait(&c->cond, &c->lock);
+		__atomic_store_n(&c->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&c->lock);
+	}
+	return NULL;
+}
+
+static void
+avr_console_kick(
+		avr_console_t * c)
+{
+	/* pairs with the fence in the writer thread */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&c->sleeping, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&c->lock);
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+avr_console_put(
+		avr_console_t * c,
+		uint8_t v)
+{
+	if (v == '\r')
+		v = '\n';
+	else if (v < ' ')
+		return;
+
+	if (c->fd == -1) {
+		if (c->len + 2 > c->alloc) {
+			size_t alloc = c->alloc ? c->alloc * 2 : 4096;
+			char * buf = realloc(c->buf, alloc);
+			if (!buf)
+				return;
+			c->buf = buf;
+			c->alloc = alloc;
+		}
+		c->buf[c->len++] = v;
+		c->buf[c->len] = 0;
+		return;
+	}
+	// ring is full, the fd can't keep up
+	while (c->write - __atomic_load_n(&c->read, __ATOMIC_ACQUIRE) >= c->size) {
+		avr_console_kick(c);
+		usleep(100);
+	}
+	c->ring[c->write & (c->size - 1)] = v;
+	__atomic_store_n(&c->write, c->write + 1, __ATOMIC_RELEASE);
+	avr_console_kick(c);
+}
+
+static avr_console_t *
+_avr_console_new(
+		avr_t * avr)
+{
+	avr_console_release(avr);
+	avr_console_t * c = calloc(1, sizeof(*c));
+	if (c)
+		c->fd = -1;
+	return c;
+}
+
+int
+avr_console_stream(
+		avr_t * avr,
+		int fd,
+		uint32_t size)
+{
+	if (fd < 0)
+		return -1;
+	avr_console_t * c = _avr_console_new(avr);
+	if (!c)
+		return -1;
+	c->fd = fd;
+	if (!size)
+		size = AVR_CONSOLE_RING_SIZE;
+	for (c->size = 1; c->size < size; c->size <<= 1)
+		;
+	c->ring = malloc(c->size);
+	if (!c->ring)
+		goto error;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (pthread_create(&c->thread, NULL, avr_console_thread, c)) {
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->cond);
+		goto error;
+	}
+	avr->console = c;
+	return 0;
+error:
+	free(c->ring);
+	free(c);
+	return -1;
+}
+
+int
+avr_console_capture(
+		avr_t * avr)
+{
+	avr_console_t * c = _avr_console_new(avr);
+	if (!c)
+		return -1;
+	avr->console = c;
+	return 0;
+}
+
+const char *
+avr_console_captured(
+		avr_t * avr,
+		size_t * len)
+{
+	avr_console_t * c = avr->console;
+	if (len)
+		*len = c ? c->len : 0;
+	return c && c->buf ? c->buf : "";
+}
+
+void
+avr_console_capture_clear(
+		avr_t * avr)
+{
+	avr_console_t * c = avr->console;
+	if (c && c->buf) {
+		c->len = 0;
+		c->buf[0] = 0;
+	}
+}
+
+void
+avr_console_flush(
+		avr_t * avr)
+{
+	avr_console_t * c = avr->console;
+	if (!c || c->fd == -1)
+		return;
+	avr_console_kick(c);
+	while (__atomic_load_n(&c->read, __ATOMIC_ACQUIRE) != c->write)
+		usleep(100);
+}
+
+void
+avr_console_release(
+		avr_t * avr)
+{
+	avr_console_t * c = avr->console;
+	if (!c)
+		return;
+	if (c->fd != -1) {
+		pthread_mutex_lock(&c->lock);
+		__atomic_store_n(&c->quit, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->thread, NULL);
+		if (c->error)
+			AVR_LOG(avr, LOG_ERROR, "%s: write error: %s\n",
+					__func__, strerror(c->error));
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->cond);
+		free(c->ring);
+	}
+	free(c->buf);
+	free(c);
+	avr->console = NULL;
+}
@@ -0,0 +1,111 @@
+/*
+	sim_console.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Alternate outputs for the console register (see AVR_MCU_SIMAVR_CONSOLE).
+ *
+ * By default, the console is line buffered and every line goes through
+ * AVR_LOG(). Instead, the bytes can be:
+ * + streamed to a file descriptor (file, pipe, socket...). They are
+ *   copied in a ring buffer, and a background thread write()s them
+ *   straight from it. If the ring is full, the simulation waits.
+ * + captured in memory, typically for test harnesses to check the output.
+ *
+ * In both cases '\r', the console line terminator, is stored as '\n', and
+ * the other control characters are dropped, as with the default output.
+ */
+#ifndef __SIM_CONSOLE_H__
+#define __SIM_CONSOLE_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "sim_avr_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_CONSOLE_RING_SIZE	(64 * 1024)
+
+typedef struct avr_console_t {
+	int			fd;			// -1 when capturing
+	// stream ring, simulation -> writer thread
+	char *		ring;
+	uint32_t	size;		// power of two
+	uint32_t	write, read;
+	int			error;		// a write() failed, errno
+	int			quit;
+	int			sleeping;	// writer thread waits on 'cond'
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+
+	// capture buffer
+	char *		buf;
+	size_t		len, alloc;
+} avr_console_t;
+
+/*
+ * Streams the console to 'fd', through a ring of 'size' bytes (rounded up
+ * to a power of two, zero means AVR_CONSOLE_RING_SIZE). 'fd' is not closed
+ * by simavr. Returns zero if all is well.
+ */
+int
+avr_console_stream(
+		struct avr_t * avr,
+		int fd,
+		uint32_t size);
+// Captures the console in memory; returns zero if all is well
+int
+avr_console_capture(
+		struct avr_t * avr);
+/*
+ * Returns what was captured so far, zero terminated, and its length in
+ * 'len' if not NULL. The pointer is valid until the next console write.
+ */
+const char *
+avr_console_captured(
+		struct avr_t * avr,
+		size_t * len);
+// Empties the capture buffer
+void
+avr_console_capture_clear(
+		struct avr_t * avr);
+// Waits for the streamed bytes to be written
+void
+avr_console_flush(
+		struct avr_t * avr);
+// Back to the default line output. Called by avr_terminate()
+void
+avr_console_release(
+		struct avr_t * avr);
+
+// private, called by the console register handler
+void
+avr_console_put(
+		avr_console_t * c,
+		uint8_t v);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CONSOLE_H__ */
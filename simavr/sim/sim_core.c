@@ -151,7 +151,7 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	}
 #endif
 
-	if (avr->gdb) {
+	if (avr->gdb_watch_map && (avr->gdb_watch_map[addr] & AVR_GDB_WATCH_WRITE)) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
 
@@ -169,7 +169,7 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 		crash(avr);
 	}
 
-	if (avr->gdb) {
+	if (avr->gdb_watch_map && (avr->gdb_watch_map[addr] & AVR_GDB_WATCH_READ)) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_READ);
 	}
 
@@ -244,7 +244,7 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
  */
 static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
 {
-	if (addr < MAX_IOs + 31)
+	if (addr < AVR_IO_TO_DATA(avr->io_count))
 		_avr_set_r(avr, addr, v);
 	else
 		avr_core_watch_write(avr, addr, v);
@@ -262,7 +262,7 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 		 */
 		READ_SREG_INTO(avr, avr->data[R_SREG]);
 
-	} else if (addr > 31 && addr < 31 + MAX_IOs) {
+	} else if (addr > 31 && addr < AVR_IO_TO_DATA(avr->io_count)) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
 
 		if (avr->io[io].r.c)
@@ -1431,7 +1431,8 @@ run_one_again:
 
 	if ((avr->state == cpu_Running) &&
 		(avr->run_cycle_count > cycle) &&
-		(avr->interrupt_state == 0))
+		(avr->interrupt_state == 0) &&
+		!avr_gdb_break_map_get(avr->gdb_break_map, new_pc))
 	{
 		avr->run_cycle_count -= cycle;
 		avr->pc = new_pc;
@@ -36,13 +36,19 @@
 #include "sim_vcd_file.h"
 #include "avr_eeprom.h"
 #include "avr_ioport.h"
+#include "sim_regions.h"
+#include "sim_profile.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
-void
-avr_load_firmware(
+/*
+ * Everything but the VCD trace: code, eeprom, fuses and the simavr
+ * registers. Shared by the first load and the reloads.
+ */
+static void
+_avr_load_program(
 		avr_t * avr,
 		elf_firmware_t * firmware)
 {
@@ -56,6 +62,7 @@ avr_load_firmware(
 		avr->aref = firmware->aref;
 #if CONFIG_SIMAVR_TRACE && ELF_SYMBOLS
 	int scount = firmware->flashsize >> 1;
+	free(avr->trace_data->codeline);
 	avr->trace_data->codeline = malloc(scount * sizeof(avr_symbol_t*));
 	memset(avr->trace_data->codeline, 0, scount * sizeof(avr_symbol_t*));
 
@@ -73,8 +80,9 @@ avr_load_firmware(
 	}
 #endif
 
-	avr_loadcode(avr, firmware->flash,
-			firmware->flashsize, firmware->flashbase);
+	if (firmware->flash)
+		avr_loadcode(avr, firmware->flash,
+				firmware->flashsize, firmware->flashbase);
 	avr->codeend = firmware->flashsize +
 			firmware->flashbase - firmware->datasize;
 
@@ -101,6 +109,17 @@ avr_load_firmware(
 	}
 	avr_set_command_register(avr, firmware->command_register_addr);
 	avr_set_console_register(avr, firmware->console_register_addr);
+	for (int i = 0; i < firmware->regioncount; i++)
+		avr_regions_set_name(avr, firmware->region[i].id,
+				firmware->region[i].name);
+}
+
+void
+avr_load_firmware(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	_avr_load_program(avr, firmware);
 
 	// rest is initialization of the VCD file
 	if (firmware->tracecount == 0)
@@ -267,6 +286,15 @@ elf_parse_mmcu_section(
 			case AVR_MMCU_TAG_SIMAVR_CONSOLE: {
 				firmware->console_register_addr = src[0] | (src[1] << 8);
 			}	break;
+			case AVR_MMCU_TAG_REGION_NAME: {
+				int ri = firmware->regioncount;
+				if (ri == (int)ARRAY_SIZE(firmware->region))
+					break;
+				firmware->region[ri].id = src[0];
+				strncpy(firmware->region[ri].name, (char*)src + 1,
+					sizeof(firmware->region[ri].name) - 1);
+				firmware->regioncount++;
+			}	break;
 		}
 		size -= next;
 		src += next - 2; // already incremented
@@ -446,3 +474,32 @@ elf_read_firmware(
 	return 0;
 }
 
+void
+avr_reload_firmware(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	int stopped = avr->gdb && avr->state == cpu_Stopped;
+
+	AVR_LOG(avr, LOG_TRACE, "%s: reloading firmware\n", avr->mmcu);
+	// the region ids belong to the old firmware, report them and start over
+	avr_regions_dispose(avr);
+	avr_erase_flash(avr);
+	// as a fresh core; IO registers are cleared by the reset
+	memset(avr->data, 0, avr->ramend + 1);
+	// this also moves the command and console registers, if they changed
+	_avr_load_program(avr, firmware);
+#if ELF_SYMBOLS
+	if (avr->profile) {
+		int on = avr->profile_on;
+		avr_profile_init(avr, firmware->symbol, firmware->symbolcount);
+		avr_profile_enable(avr, on);
+	}
+#endif
+	avr_reset(avr);
+	if (firmware->flashbase)
+		avr->pc = firmware->flashbase;
+	// let the debugger decide when to run the new code
+	if (stopped)
+		avr->state = cpu_Stopped;
+}
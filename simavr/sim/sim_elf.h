@@ -60,6 +60,13 @@ typedef struct elf_firmware_t {
 		uint8_t mask, value;
 	} external_state[8];
 
+	// names of the measurement regions, see sim_regions.h
+	int			regioncount;
+	struct {
+		uint8_t id;
+		char	name[32];
+	} region[32];
+
 	// register to listen to for commands from the firmware
 	uint16_t	command_register_addr;
 	uint16_t	console_register_addr;
@@ -80,6 +87,10 @@ typedef struct elf_firmware_t {
 	avr_symbol_t **  symbol;
 	uint32_t		symbolcount;
 #endif
+	// set by avr_image_read(), for avr_image_release()
+	uint8_t *	image;
+	uint32_t	imagesize;
+	uint8_t		imagemapped;
 } elf_firmware_t ;
 
 int
@@ -91,6 +102,18 @@ void
 avr_load_firmware(
 	avr_t * avr,
 	elf_firmware_t * firmware);
+/*
+ * Replaces the firmware of a running core, and resets it. The IO modules,
+ * their IRQ connections, and anything attached to them (parts, VCD trace,
+ * gdb...) are kept. Flash is erased and the SRAM is cleared, as on a fresh
+ * core; the eeprom is only replaced if 'firmware' has one. The profiler,
+ * if any, restarts with the new symbols.
+ * Must be called from the thread running the core, between avr_run() calls.
+ */
+void
+avr_reload_firmware(
+	avr_t * avr,
+	elf_firmware_t * firmware);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,605 @@
+/*
+	sim_fst_file.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include "sim_avr.h"
+#include "sim_vcd_file.h"
+#include "sim_fst_file.h"
+#include "sim_writer.h"
+
+/*
+ * Block, scope and variable types, as used by GTKWave's fstapi
+ */
+enum {
+	FST_BL_HDR = 0,
+	FST_BL_GEOM = 3,
+	FST_BL_HIER = 4,
+	FST_BL_VCDATA_DYN_ALIAS2 = 8,
+
+	FST_ST_VCD_MODULE = 0,
+	FST_ST_VCD_SCOPE = 254,
+	FST_ST_VCD_UPSCOPE = 255,
+
+	FST_VT_VCD_WIRE = 16,
+	FST_VD_IMPLICIT = 0,
+	FST_FT_VERILOG = 0,
+};
+
+#define FST_HDR_SIZE			329	// not counting the block type
+#define FST_HDR_VERSION_SIZE	128
+#define FST_HDR_DATE_SIZE		119
+#define FST_DOUBLE_ENDTEST		2.7182818284590452354
+
+typedef struct avr_fst_buf_t {
+	uint8_t *	b;
+	uint32_t	len, size;
+} avr_fst_buf_t;
+
+typedef struct avr_fst_signal_t {
+	avr_fst_buf_t	chg;		// changes in the current block
+	uint32_t		last;		// time index of the last change
+	uint32_t		value, start_value;	// current, and at block start
+	uint8_t			floating, start_floating;
+	uint8_t			size;
+} avr_fst_signal_t;
+
+typedef struct avr_fst_t {
+	uint32_t		count;		// number of handles
+	uint32_t *		handle;		// handle index, by vcd signal index
+	avr_fst_signal_t * sig;		// by handle index
+	avr_fst_buf_t	time;		// varint time deltas of the current block
+	uint32_t		time_count;
+	uint64_t		time_last;
+	uint64_t		block_start;
+	uint64_t		first, end;	// whole file
+	uint32_t		data_size;	// change data in the current block
+	uint32_t		blocks;
+	uint32_t		scopes;
+	avr_fst_buf_t	hier;		// uncompressed hierarchy
+} avr_fst_t;
+
+static uint8_t *
+avr_fst_reserve(
+		avr_fst_buf_t * b,
+		uint32_t len)
+{
+	if (b->len + len > b->size) {
+		uint32_t size = b->size ? b->size : 64;
+		while (size < b->len + len)
+			size *= 2;
+		uint8_t * n = realloc(b->b, size);
+		if (!n)
+			return NULL;
+		b->b = n;
+		b->size = size;
+	}
+	return b->b + b->len;
+}
+
+static void
+avr_fst_put(
+		avr_fst_buf_t * b,
+		const void * data,
+		uint32_t len)
+{
+	uint8_t * dst = avr_fst_reserve(b, len);
+	if (!dst)
+		return;
+	memcpy(dst, data, len);
+	b->len += len;
+}
+
+static inline int
+avr_fst_varint_text(
+		uint8_t * dst,
+		uint64_t v)
+{
+	int l = 0;
+	while (v > 0x7f) {
+		dst[l++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	dst[l++] = v;
+	return l;
+}
+
+static void
+avr_fst_varint(
+		avr_fst_buf_t * b,
+		uint64_t v)
+{
+	uint8_t * dst = avr_fst_reserve(b, 10);
+	if (dst)
+		b->len += avr_fst_varint_text(dst, v);
+}
+
+static void
+avr_fst_svarint(
+		avr_fst_buf_t * b,
+		int64_t v)
+{
+	uint8_t * dst = avr_fst_reserve(b, 10);
+	if (!dst)
+		return;
+	int l = 0;
+	for (;;) {
+		uint8_t byte = v & 0x7f;
+		v >>= 7;	// arithmetic shift
+		if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+			dst[l++] = byte;
+			break;
+		}
+		dst[l++] = byte | 0x80;
+	}
+	b->len += l;
+}
+
+// fixed size fields are big endian
+static void
+avr_fst_u64(
+		avr_fst_buf_t * b,
+		uint64_t v)
+{
+	uint8_t d[8];
+	for (int i = 7; i >= 0; i--, v >>= 8)
+		d[i] = v;
+	avr_fst_put(b, d, 8);
+}
+
+static void
+avr_fst_byte(
+		avr_fst_buf_t * b,
+		uint8_t v)
+{
+	avr_fst_put(b, &v, 1);
+}
+
+/*
+ * Compresses 'src' at the end of 'dst', or copies it if it doesn't
+ * shrink; returns the number of bytes added.
+ */
+static uint32_t
+avr_fst_compress(
+		avr_fst_buf_t * dst,
+		const uint8_t * src,
+		uint32_t len,
+		int level)
+{
+	uLongf clen = compressBound(len);
+	uint8_t * out = avr_fst_reserve(dst, clen);
+
+	if (!out)
+		return 0;
+	if (compress2(out, &clen, src, len, level) != Z_OK || clen >= len) {
+		memcpy(out, src, len);
+		clen = len;
+	}
+	dst->len += clen;
+	return clen;
+}
+
+static void
+avr_fst_header(
+		avr_fst_t * f,
+		avr_fst_buf_t * b)
+{
+	double endtest = FST_DOUBLE_ENDTEST;
+	char version[FST_HDR_VERSION_SIZE] = "simavr";
+	char date[FST_HDR_DATE_SIZE] = "";
+	time_t now = time(NULL);
+
+	strncpy(date, ctime(&now), sizeof(date) - 1);
+	avr_fst_byte(b, FST_BL_HDR);
+	avr_fst_u64(b, FST_HDR_SIZE);
+	avr_fst_u64(b, f->first);
+	avr_fst_u64(b, f->end);
+	avr_fst_put(b, &endtest, sizeof(endtest));	// native order, on purpose
+	avr_fst_u64(b, AVR_FST_BLOCK_SIZE);		// writer memory use
+	avr_fst_u64(b, f->scopes);
+	avr_fst_u64(b, f->count);				// variables
+	avr_fst_u64(b, f->count);				// handles, no aliases here
+	avr_fst_u64(b, f->blocks);
+	avr_fst_byte(b, (uint8_t)-8);			// 10ns timescale
+	avr_fst_put(b, version, sizeof(version));
+	avr_fst_put(b, date, sizeof(date));
+	avr_fst_byte(b, FST_FT_VERILOG);
+	avr_fst_u64(b, 0);						// time zero
+}
+
+static void
+avr_fst_scope(
+		avr_fst_t * f,
+		const char * name)
+{
+	avr_fst_byte(&f->hier, FST_ST_VCD_SCOPE);
+	avr_fst_byte(&f->hier, FST_ST_VCD_MODULE);
+	avr_fst_put(&f->hier, name, strlen(name) + 1);
+	avr_fst_byte(&f->hier, 0);	// no component name
+	f->scopes++;
+}
+
+int
+avr_fst_start(
+		avr_vcd_t * vcd,
+		const int * order)
+{
+	avr_fst_t * f = calloc(1, sizeof(*f));
+	if (!f)
+		return -1;
+	f->count = vcd->signal_count;
+	f->handle = calloc(f->count + 1, sizeof(f->handle[0]));
+	f->sig = calloc(f->count + 1, sizeof(f->sig[0]));
+	if (!f->handle || !f->sig) {
+		free(f->handle);
+		free(f->sig);
+		free(f);
+		return -1;
+	}
+	vcd->fst = f;
+
+	/* handles are numbered in the order the variables are declared */
+	const char * scope = NULL;
+	avr_fst_scope(f, "logic");
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[order[i]];
+		if (s->scope != scope && (!s->scope || !scope ||
+				strcmp(s->scope, scope))) {
+			if (scope)
+				avr_fst_byte(&f->hier, FST_ST_VCD_UPSCOPE);
+			if (s->scope)
+				avr_fst_scope(f, s->scope);
+			scope = s->scope;
+		}
+		avr_fst_byte(&f->hier, FST_VT_VCD_WIRE);
+		avr_fst_byte(&f->hier, FST_VD_IMPLICIT);
+		avr_fst_put(&f->hier, s->name, strlen(s->name) + 1);
+		avr_fst_varint(&f->hier, s->size);
+		avr_fst_varint(&f->hier, 0);	// not an alias
+		f->handle[order[i]] = i;
+		f->sig[i].size = s->size;
+		f->sig[i].floating = f->sig[i].start_floating = 1;
+	}
+	if (scope)
+		avr_fst_byte(&f->hier, FST_ST_VCD_UPSCOPE);
+	avr_fst_byte(&f->hier, FST_ST_VCD_UPSCOPE);
+
+	// the initial 'x' values are at time zero, like VCD's $dumpvars
+	avr_fst_varint(&f->time, 0);
+	f->time_count = 1;
+	f->time_last = f->block_start = 0;
+
+	// placeholder, rewritten once the file is complete
+	avr_fst_buf_t hdr = {0};
+	avr_fst_header(f, &hdr);
+	avr_writer_write(vcd->output, hdr.b, hdr.len);
+	free(hdr.b);
+	return 0;
+}
+
+void
+avr_fst_change(
+		avr_vcd_t * vcd,
+		uint64_t when,
+		int sigindex,
+		uint32_t value,
+		int floating)
+{
+	avr_fst_t * f = vcd->fst;
+	avr_fst_signal_t * s = &f->sig[f->handle[sigindex]];
+
+	if (f->time_count && when < f->time_last)
+		when = f->time_last;
+	/* a signal can only change once per time slot, add a new one if needed */
+	if (f->time_count && when == f->time_last &&
+			s->chg.len && s->last == f->time_count - 1)
+		when++;
+	if (!f->time_count || when != f->time_last) {
+		if (!f->time_count)
+			f->block_start = when;
+		avr_fst_varint(&f->time, when - (f->time_count ? f->time_last : 0));
+		f->time_count++;
+		f->time_last = when;
+	}
+	uint32_t index = f->time_count - 1;
+	uint64_t delta = index - s->last;
+	uint32_t old = s->chg.len;
+	s->last = index;
+	s->value = value;
+	s->floating = floating;
+
+	if (s->size == 1) {
+		avr_fst_varint(&s->chg, floating ?
+				(delta << 4) | 1 :				// 'x'
+				(delta << 2) | ((value & 1) << 1));
+	} else if (floating) {
+		avr_fst_varint(&s->chg, (delta << 1) | 1);
+		uint8_t * dst = avr_fst_reserve(&s->chg, s->size);
+		if (dst) {
+			memset(dst, 'x', s->size);
+			s->chg.len += s->size;
+		}
+	} else {
+		// binary values are packed, most significant bit first
+		int bytes = (s->size + 7) / 8;
+		avr_fst_varint(&s->chg, delta << 1);
+		uint8_t * dst = avr_fst_reserve(&s->chg, bytes);
+		if (dst) {
+			memset(dst, 0, bytes);
+			for (int j = 0; j < s->size; j++) {
+				int bit = s->size - 1 - j;
+				if (bit < 32 && (value >> bit) & 1)
+					dst[j >> 3] |= 0x80 >> (j & 7);
+			}
+			s->chg.len += bytes;
+		}
+	}
+	f->data_size += s->chg.len - old;
+}
+
+/*
+ * A block of changes, handed over to the writer thread to be compressed
+ * and written, so the simulation doesn't stall on zlib.
+ */
+typedef struct avr_fst_block_t {
+	uint64_t		start, end;
+	uint32_t		time_count;
+	uint32_t		count;
+	avr_fst_buf_t	frame;		// signal values at the start of the block
+	avr_fst_buf_t	time;
+	avr_fst_buf_t	chg[];		// by handle index
+} avr_fst_block_t;
+
+static void
+avr_fst_block_job(
+		avr_writer_t * w,
+		void * param)
+{
+	avr_fst_block_t * k = param;
+	avr_fst_buf_t b = {0}, vc = {0}, index = {0}, scratch = {0};
+	uint64_t mem = 0;
+
+	/*
+	 * Per signal change data, each prefixed by its uncompressed size, or
+	 * zero if stored as is. Their offsets are relative to the 'pack type'
+	 * byte, and go in the index.
+	 */
+	avr_fst_byte(&vc, 'Z');
+	uint32_t zeroes = 0, prev = 0;
+	for (uint32_t h = 0; h < k->count; h++) {
+		avr_fst_buf_t * chg = &k->chg[h];
+		if (!chg->len) {
+			zeroes++;
+			continue;
+		}
+		uint32_t pos = vc.len;
+		mem += chg->len;
+		scratch.len = 0;
+		uint32_t clen = avr_fst_compress(&scratch, chg->b, chg->len, 4);
+		if (clen < chg->len) {
+			avr_fst_varint(&vc, chg->len);
+			avr_fst_put(&vc, scratch.b, clen);
+		} else {
+			avr_fst_varint(&vc, 0);
+			avr_fst_put(&vc, chg->b, chg->len);
+		}
+		if (zeroes)
+			avr_fst_varint(&index, zeroes << 1);
+		zeroes = 0;
+		avr_fst_svarint(&index, ((int64_t)(pos - prev) << 1) | 1);
+		prev = pos;
+	}
+	if (zeroes)
+		avr_fst_varint(&index, zeroes << 1);
+
+	avr_fst_byte(&b, FST_BL_VCDATA_DYN_ALIAS2);
+	avr_fst_u64(&b, 0);			// section length, patched below
+	avr_fst_u64(&b, k->start);
+	avr_fst_u64(&b, k->end);
+	avr_fst_u64(&b, mem);		// memory needed to decode the changes
+	scratch.len = 0;
+	uint32_t clen = avr_fst_compress(&scratch, k->frame.b, k->frame.len, 4);
+	avr_fst_varint(&b, k->frame.len);
+	avr_fst_varint(&b, clen);
+	avr_fst_varint(&b, k->count);
+	avr_fst_put(&b, scratch.b, clen);
+	avr_fst_varint(&b, k->count);
+	avr_fst_put(&b, vc.b, vc.len);
+	avr_fst_put(&b, index.b, index.len);
+	avr_fst_u64(&b, index.len);
+	clen = avr_fst_compress(&b, k->time.b, k->time.len, 9);
+	avr_fst_u64(&b, k->time.len);
+	avr_fst_u64(&b, clen);
+	avr_fst_u64(&b, k->time_count);
+	if (b.b) {
+		// patch the section length, which doesn't count the block type
+		uint64_t len = b.len - 1;
+		for (int i = 8; i >= 1; i--, len >>= 8)
+			b.b[i] = len;
+		avr_writer_direct(w, b.b, b.len);
+	}
+	for (uint32_t h = 0; h < k->count; h++)
+		free(k->chg[h].b);
+	free(k->frame.b);
+	free(k->time.b);
+	free(k);
+	free(b.b);
+	free(vc.b);
+	free(index.b);
+	free(scratch.b);
+}
+
+static void
+avr_fst_write_block(
+		avr_vcd_t * vcd)
+{
+	avr_fst_t * f = vcd->fst;
+
+	if (!f->time_count)
+		return;
+	avr_fst_block_t * k = calloc(1,
+			sizeof(*k) + f->count * sizeof(k->chg[0]));
+	if (!k)
+		goto done;
+	k->start = f->block_start;
+	k->end = f->time_last;
+	k->time_count = f->time_count;
+	k->count = f->count;
+	for (uint32_t h = 0; h < f->count; h++) {
+		avr_fst_signal_t * s = &f->sig[h];
+		uint8_t * dst = avr_fst_reserve(&k->frame, s->size);
+		if (!dst) {
+			free(k->frame.b);
+			free(k);
+			goto done;
+		}
+		for (int j = 0; j < s->size; j++) {
+			int bit = s->size - 1 - j;
+			dst[j] = s->start_floating ? 'x' :
+					'0' + (bit < 32 && ((s->start_value >> bit) & 1));
+		}
+		k->frame.len += s->size;
+	}
+	// the job owns the change buffers now, the signals start new ones
+	for (uint32_t h = 0; h < f->count; h++) {
+		k->chg[h] = f->sig[h].chg;
+		f->sig[h].chg = (avr_fst_buf_t){0};
+	}
+	k->time = f->time;
+	f->time = (avr_fst_buf_t){0};
+	avr_writer_defer(vcd->output, avr_fst_block_job, k);
+
+	if (!f->blocks++)
+		f->first = f->block_start;
+	f->end = f->time_last;
+done:
+	for (uint32_t h = 0; h < f->count; h++) {
+		avr_fst_signal_t * s = &f->sig[h];
+		s->chg.len = 0;
+		s->last = 0;
+		s->start_value = s->value;
+		s->start_floating = s->floating;
+	}
+	f->time.len = 0;
+	f->time_count = 0;
+	f->data_size = 0;
+}
+
+void
+avr_fst_flush(
+		avr_vcd_t * vcd)
+{
+	if (vcd->fst && vcd->fst->data_size >= AVR_FST_BLOCK_SIZE)
+		avr_fst_write_block(vcd);
+}
+
+static void
+avr_fst_write_trailer(
+		avr_vcd_t * vcd)
+{
+	avr_fst_t * f = vcd->fst;
+	avr_fst_buf_t b = {0}, geom = {0};
+
+	// signal sizes
+	for (uint32_t h = 0; h < f->count; h++)
+		avr_fst_varint(&geom, f->sig[h].size);
+	avr_fst_byte(&b, FST_BL_GEOM);
+	avr_fst_u64(&b, 0);
+	avr_fst_u64(&b, geom.len);
+	avr_fst_u64(&b, f->count);
+	avr_fst_compress(&b, geom.b, geom.len, 9);
+	if (b.b) {
+		uint64_t len = b.len - 1;
+		for (int i = 8; i >= 1; i--, len >>= 8)
+			b.b[i] = len;
+		avr_writer_write(vcd->output, b.b, b.len);
+	}
+	free(geom.b);
+
+	// the hierarchy is a gzip stream
+	b.len = 0;
+	avr_fst_byte(&b, FST_BL_HIER);
+	avr_fst_u64(&b, 0);
+	avr_fst_u64(&b, f->hier.len);
+	z_stream z = {0};
+	if (deflateInit2(&z, 4, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY) == Z_OK) {
+		uint32_t bound = deflateBound(&z, f->hier.len);
+		uint8_t * out = avr_fst_reserve(&b, bound);
+		if (out) {
+			z.next_in = f->hier.b;
+			z.avail_in = f->hier.len;
+			z.next_out = out;
+			z.avail_out = bound;
+			if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+				b.len += bound - z.avail_out;
+				uint64_t len = b.len - 1;
+				for (int i = 8; i >= 1; i--, len >>= 8)
+					b.b[i] = len;
+				avr_writer_write(vcd->output, b.b, b.len);
+			}
+		}
+		deflateEnd(&z);
+	}
+	free(b.b);
+}
+
+void
+avr_fst_stop(
+		avr_vcd_t * vcd)
+{
+	avr_fst_t * f = vcd->fst;
+
+	if (!f)
+		return;
+	avr_fst_write_block(vcd);
+	avr_fst_write_trailer(vcd);
+	avr_writer_close(vcd->output);
+	vcd->output = NULL;
+
+	/* now that everything is known, rewrite the header */
+	avr_fst_buf_t hdr = {0};
+	avr_fst_header(f, &hdr);
+	int fd = open(vcd->filename, O_WRONLY);
+	if (fd == -1 || !hdr.b ||
+			lseek(fd, 0, SEEK_SET) != 0 ||
+			write(fd, hdr.b, hdr.len) != (ssize_t)hdr.len)
+		AVR_LOG(vcd->avr, LOG_ERROR, "%s: %s: %s\n", __func__,
+				vcd->filename, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	free(hdr.b);
+
+	for (uint32_t h = 0; h < f->count; h++)
+		free(f->sig[h].chg.b);
+	free(f->sig);
+	free(f->handle);
+	free(f->time.b);
+	free(f->hier.b);
+	free(f);
+	vcd->fst = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+	sim_fst_file.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * FST output backend for the VCD module. FST is the block compressed
+ * waveform format GTKWave reads natively; value changes are kept as
+ * varint encoded time deltas per signal, and written out as zlib
+ * compressed blocks every AVR_FST_BLOCK_SIZE bytes of changes.
+ *
+ * It is selected by avr_vcd_init() when the filename ends in ".fst", the
+ * rest of the avr_vcd_t API is unchanged. These functions are private to
+ * sim_vcd_file.c.
+ */
+#ifndef __SIM_FST_FILE_H__
+#define __SIM_FST_FILE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// raw value change data accumulated before a block is written
+#define AVR_FST_BLOCK_SIZE	(4 * 1024 * 1024)
+
+struct avr_vcd_t;
+
+/*
+ * Allocates the FST state and writes the file header. 'order' lists the
+ * signal indexes in the order they appear in the hierarchy, grouped by
+ * scope. Returns zero if all is well.
+ */
+int
+avr_fst_start(
+		struct avr_vcd_t * vcd,
+		const int * order);
+// records a value change of signal 'sigindex' at time 'when'
+void
+avr_fst_change(
+		struct avr_vcd_t * vcd,
+		uint64_t when,
+		int sigindex,
+		uint32_t value,
+		int floating);
+// called after each log flush, writes a block if there's enough data
+void
+avr_fst_flush(
+		struct avr_vcd_t * vcd);
+/*
+ * Writes the pending block, the geometry and hierarchy, and closes the
+ * file. Frees the FST state.
+ */
+void
+avr_fst_stop(
+		struct avr_vcd_t * vcd);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FST_FILE_H__ */
@@ -32,10 +32,13 @@
 #include "sim_hex.h"
 #include "avr_eeprom.h"
 #include "sim_gdb.h"
+#include "sim_itrace.h"
 
 #define DBG(w)
 
 #define WATCH_LIMIT (32)
+// largest packet we accept, advertised to gdb in qSupported
+#define GDB_PACKET_SIZE (16 * 1024)
 
 typedef struct {
 	uint32_t len; /**< How many points are taken (points[0] .. points[len - 1]). */
@@ -51,10 +54,35 @@ typedef struct avr_gdb_t {
 	int		listen;	// listen socket
 	int		s;		// current gdb connection
 
+	pthread_t	thread;	// network thread
+	int		quit;	// tells the network thread to exit
+
 	avr_gdb_watchpoints_t breakpoints;
 	avr_gdb_watchpoints_t watchpoints;
 } avr_gdb_t;
 
+/*
+ * A packet received by the network thread, posted to the simulation thread
+ */
+typedef struct gdb_packet_t {
+	avr_gdb_t *	g;
+	int		s;		// socket it was received on
+	int		len;	// binary packets can contain zeroes
+	char	cmd[];
+} gdb_packet_t;
+
+/*
+ * Packet framing state for the network thread; packets can span several
+ * recv() calls, and one recv() can return several packets
+ */
+typedef struct gdb_framer_t {
+	int		in_packet;	// between '$' and '#'
+	int		escape;		// previous byte was the '}' escape
+	int		checksum;	// checksum digits still to skip
+	int		len;
+	uint8_t	buf[GDB_PACKET_SIZE + 1];
+} gdb_framer_t;
+
 
 /**
  * Returns the index of the watchpoint if found, -1 otherwise.
@@ -175,12 +203,74 @@ gdb_watch_clear(
 	w->len = 0;
 }
 
+/*
+ * The core checks breakpoints with a bitmap of the flash (one bit per
+ * instruction word), so it doesn't need to leave its fast loop.
+ */
+static void
+gdb_break_map_update(
+		avr_gdb_t * g,
+		uint32_t addr )
+{
+	uint32_t * map = g->avr->gdb_break_map;
+	if (!map || addr > g->avr->flashend)
+		return;
+	if (gdb_watch_find(&g->breakpoints, addr) != -1)
+		map[addr >> 6] |= 1 << ((addr >> 1) & 31);
+	else
+		map[addr >> 6] &= ~(1 << ((addr >> 1) & 31));
+}
+
+/*
+ * Watchpoints are mirrored in a map with one byte of AVR_GDB_WATCH_* flags
+ * per data address. It only exists while there are watchpoints, so the core
+ * doesn't even look when there are none.
+ */
+static uint8_t
+gdb_watch_kind_flags(
+		uint32_t kind )
+{
+	// access watchpoints are registered as 1 << 4
+	return (kind & AVR_GDB_WATCH_ACCESS) | ((kind & (1 << 4)) ? AVR_GDB_WATCH_ACCESS : 0);
+}
+
+static void
+gdb_watch_map_update(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_watchpoints_t * w = &g->watchpoints;
+
+	if (!w->len) {
+		free(avr->gdb_watch_map);
+		avr->gdb_watch_map = NULL;
+		return;
+	}
+	if (!avr->gdb_watch_map)
+		avr->gdb_watch_map = malloc(avr->ramend + 1);
+	memset(avr->gdb_watch_map, 0, avr->ramend + 1);
+	for (int i = 0; i < w->len; i++) {
+		uint8_t flags = gdb_watch_kind_flags(w->points[i].kind);
+		for (uint32_t a = w->points[i].addr;
+				a < w->points[i].addr + w->points[i].size && a <= avr->ramend; a++)
+			avr->gdb_watch_map[a] |= flags;
+	}
+}
+
+static void
+gdb_break_map_clear(
+		avr_gdb_t * g )
+{
+	if (g->avr->gdb_break_map)
+		memset(g->avr->gdb_break_map, 0, AVR_GDB_BREAK_MAP_SIZE(g->avr));
+}
+
 static void
 gdb_send_reply(
 		avr_gdb_t * g,
 		char * cmd )
 {
-	uint8_t reply[1024];
+	uint8_t reply[strlen(cmd) + 5];
 	uint8_t * dst = reply;
 	uint8_t check = 0;
 	*dst++ = '$';
@@ -278,22 +368,136 @@ gdb_read_register(
 	return strlen(rep);
 }
 
+/*
+ * Write 'len' bytes to gdb's address space; returns 0, or -1 if out of range
+ */
+static int
+gdb_write_memory(
+		avr_gdb_t * g,
+		uint32_t addr,
+		const uint8_t * src,
+		uint32_t len )
+{
+	avr_t * avr = g->avr;
+
+	addr &= 0xffffff;
+	if (addr + len <= avr->flashend + 1) {
+		memcpy(avr->flash + addr, src, len);
+	} else if (addr >= 0x800000 && (addr - 0x800000) + len <= avr->ramend + 1) {
+		memcpy(avr->data + addr - 0x800000, src, len);
+	} else if (addr >= 0x810000 && (addr - 0x810000) + len <= avr->e2end + 1) {
+		avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len,
+				.ee = (uint8_t*)src };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+	} else {
+		AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+gdb_send_memory_map(
+		avr_gdb_t * g,
+		const char * args )
+{
+	char map[512], eeprom[80] = "";
+	unsigned int offset = 0, length = 0;
+
+	// cores without eeprom have e2end at zero
+	if (g->avr->e2end)
+		snprintf(eeprom, sizeof(eeprom),
+				" <memory type='ram' start='0x810000' length='%#x'/>\n",
+				g->avr->e2end + 1);
+	snprintf(map, sizeof(map),
+			"<memory-map>\n"
+			" <memory type='ram' start='0x800000' length='%#x'/>\n"
+			"%s"
+			" <memory type='flash' start='0' length='%#x'>\n"
+			"  <property name='blocksize'>0x80</property>\n"
+			" </memory>\n"
+			"</memory-map>",
+			g->avr->ramend + 1, eeprom, g->avr->flashend + 1);
+	// annex is empty, then offset,length
+	sscanf(args, "::%x,%x", &offset, &length);
+
+	unsigned int total = strlen(map);
+	if (offset >= total) {
+		gdb_send_reply(g, "l");
+		return;
+	}
+	if (length > total - offset)
+		length = total - offset;
+	char rep[length + 2];
+	rep[0] = offset + length < total ? 'm' : 'l';
+	memcpy(rep + 1, map + offset, length);
+	rep[length + 1] = 0;
+	gdb_send_reply(g, rep);
+}
+
+/*
+ * "monitor <command>" from gdb, the reply is text for the gdb console,
+ * hex encoded.
+ */
+static void
+gdb_monitor_command(
+		avr_gdb_t * g,
+		const char * hex )
+{
+	avr_t * avr = g->avr;
+	char cmd[128] = "", out[256];
+	int len = read_hex_string(hex, (uint8_t*)cmd, sizeof(cmd) - 1);
+	cmd[len > 0 ? len : 0] = 0;
+
+	if (!strcmp(cmd, "itrace on") || !strcmp(cmd, "itrace off")) {
+		avr_itrace_enable(avr, !strcmp(cmd, "itrace on"));
+		snprintf(out, sizeof(out), "itrace %s\n",
+				avr->itrace_on ? "on" : "off");
+	} else if (!strcmp(cmd, "itrace save")) {
+		if (avr_itrace_save(avr))
+			snprintf(out, sizeof(out), "itrace: nothing saved\n");
+		else
+			snprintf(out, sizeof(out), "itrace: saved to %s\n",
+					avr->itrace->filename);
+	} else if (!strcmp(cmd, "itrace")) {
+		if (avr->itrace)
+			snprintf(out, sizeof(out), "itrace %s, %s, %llu instructions\n",
+					avr->itrace_on ? "on" : "off", avr->itrace->filename,
+					(unsigned long long)avr->itrace->count);
+		else
+			snprintf(out, sizeof(out), "itrace off\n");
+	} else
+		snprintf(out, sizeof(out),
+				"monitor commands:\n"
+				"  itrace [on|off|save]  binary instruction trace\n");
+
+	char rep[2 * sizeof(out) + 1];
+	for (int i = 0; out[i]; i++)
+		sprintf(rep + 2 * i, "%02x", (uint8_t)out[i]);
+	gdb_send_reply(g, rep);
+}
+
 static void
 gdb_handle_command(
 		avr_gdb_t * g,
-		char * cmd )
+		char * cmd,
+		int cmd_len )
 {
 	avr_t * avr = g->avr;
-	char rep[1024];
+	char rep[GDB_PACKET_SIZE + 64];
 	uint8_t command = *cmd++;
+	cmd_len--;
 	switch (command) {
 		case 'q':
 			if (strncmp(cmd, "Supported", 9) == 0) {
 				/* If GDB asked what features we support, report back
-				 * the features we support, which is just memory layout
-				 * information for now.
+				 * the features we support, the memory layout, and
+				 * how big a packet we can take in one go.
 				 */
-				gdb_send_reply(g, "qXfer:memory-map:read+");
+				snprintf(rep, sizeof(rep),
+						"PacketSize=%x;qXfer:memory-map:read+",
+						GDB_PACKET_SIZE);
+				gdb_send_reply(g, rep);
 				break;
 			} else if (strncmp(cmd, "Attached", 8) == 0) {
 				/* Respond that we are attached to an existing process..
@@ -306,18 +510,12 @@ gdb_handle_command(
 			//	gdb_send_reply(g, "Text=0;Data=800000;Bss=800000");
 			//	break;
 			} else if (strncmp(cmd, "Xfer:memory-map:read", 20) == 0) {
-				snprintf(rep, sizeof(rep),
-						"l<memory-map>\n"
-						" <memory type='ram' start='0x800000' length='%#x'/>\n"
-						" <memory type='flash' start='0' length='%#x'>\n"
-						"  <property name='blocksize'>0x80</property>\n"
-						" </memory>\n"
-						"</memory-map>",
-						g->avr->ramend + 1, g->avr->flashend + 1);
-
-				gdb_send_reply(g, rep);
+				gdb_send_memory_map(g, cmd + 20);
 				break;
-            }
+			} else if (strncmp(cmd, "Rcmd,", 5) == 0) {
+				gdb_monitor_command(g, cmd + 5);
+				break;
+			}
 			gdb_send_reply(g, "");
 			break;
 		case '?':
@@ -359,12 +557,15 @@ gdb_handle_command(
 			uint32_t len;
 			sscanf(cmd, "%x,%x", &addr, &len);
 			uint8_t * src = NULL;
+			uint32_t avail = 0;	// bytes up to the end of the region
 			/* GDB seems to also use 0x1800000 for sram ?!?! */
 			addr &= 0xffffff;
-			if (addr < avr->flashend) {
+			if (addr <= avr->flashend) {
 				src = avr->flash + addr;
+				avail = avr->flashend + 1 - addr;
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
 				src = avr->data + addr - 0x800000;
+				avail = avr->ramend + 1 - (addr - 0x800000);
 			} else if (addr == (0x800000 + avr->ramend + 1) && len == 2) {
 				// Allow GDB to read a value just after end of stack.
 				// This is necessary to make instruction stepping work when stack is empty
@@ -375,9 +576,10 @@ gdb_handle_command(
 			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
 				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000)};
 				avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
-				if (ee.ee)
+				if (ee.ee) {
 					src = ee.ee;
-				else {
+					avail = avr->e2end + 1 - ee.offset;
+				} else {
 					gdb_send_reply(g, "E01");
 					break;
 				}
@@ -388,6 +590,11 @@ gdb_handle_command(
 				gdb_send_reply(g, "E01");
 				break;
 			}
+			if (len > avail)
+				len = avail;
+			// don't overflow our reply
+			if (len > (sizeof(rep) - 1) / 2)
+				len = (sizeof(rep) - 1) / 2;
 			char * dst = rep;
 			while (len--) {
 				sprintf(dst, "%02x", *src++);
@@ -404,21 +611,52 @@ gdb_handle_command(
 				gdb_send_reply(g, "E01");
 				break;
 			}
-			if (addr < 0xffff) {
-				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
+			int cnt = read_hex_string(start + 1, (uint8_t*)rep, sizeof(rep));
+			if (cnt < (int)len || gdb_write_memory(g, addr, (uint8_t*)rep, len))
+				gdb_send_reply(g, "E01");
+			else
 				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
-				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
+		}	break;
+		case 'X': {	// write memory, binary
+			uint32_t addr, len;
+			sscanf(cmd, "%x,%x", &addr, &len);
+			char * start = memchr(cmd, ':', cmd_len);
+			if (!start ||
+					(cmd + cmd_len) - (start + 1) < len ||
+					(len && gdb_write_memory(g, addr, (uint8_t*)start + 1, len)))
+				gdb_send_reply(g, "E01");
+			else
 				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
-				read_hex_string(start + 1, (uint8_t*)rep, strlen(start+1));
-				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = (uint8_t*)rep };
-				avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+		}	break;
+		case 'v': {
+			if (strncmp(cmd, "FlashErase:", 11) == 0) {
+				uint32_t addr, len;
+				sscanf(cmd + 11, "%x,%x", &addr, &len);
+				if (addr > avr->flashend || len > avr->flashend + 1 - addr) {
+					gdb_send_reply(g, "E01");
+					break;
+				}
+				memset(avr->flash + addr, 0xff, len);
 				gdb_send_reply(g, "OK");
-			} else {
-				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
-				gdb_send_reply(g, "E01");
-			}
+			} else if (strncmp(cmd, "FlashWrite:", 11) == 0) {
+				uint32_t addr;
+				sscanf(cmd + 11, "%x", &addr);
+				char * start = memchr(cmd + 11, ':', cmd_len - 11);
+				if (!start) {
+					gdb_send_reply(g, "E01");
+					break;
+				}
+				uint32_t len = (cmd + cmd_len) - (start + 1);
+				if (addr > avr->flashend || len > avr->flashend + 1 - addr) {
+					gdb_send_reply(g, "E01");
+					break;
+				}
+				memcpy(avr->flash + addr, start + 1, len);
+				gdb_send_reply(g, "OK");
+			} else if (strncmp(cmd, "FlashDone", 9) == 0) {
+				gdb_send_reply(g, "OK");
+			} else
+				gdb_send_reply(g, "");
 		}	break;
 		case 'c': {	// continue
 			avr->state = cpu_Running;
@@ -444,6 +682,7 @@ gdb_handle_command(
 						gdb_send_reply(g, "E01");
 						break;
 					}
+					gdb_break_map_update(g, addr);
 
 					gdb_send_reply(g, "OK");
 					break;
@@ -457,6 +696,7 @@ gdb_handle_command(
 						gdb_send_reply(g, "E01");
 						break;
 					}
+					gdb_watch_map_update(g);
 
 					gdb_send_reply(g, "OK");
 					break;
@@ -471,89 +711,190 @@ gdb_handle_command(
 	}
 }
 
-static int
-gdb_network_handler(
-		avr_gdb_t * g,
-		uint32_t dosleep )
+/*
+ * These are posted by the network thread, and run on the simulation thread
+ */
+static void
+gdb_async_connected(
+		avr_t * avr,
+		void * param )
 {
-	fd_set read_set;
-	int max;
-	FD_ZERO(&read_set);
+	avr_gdb_t * g = avr->gdb;
+	g->s = (intptr_t)param;
+	avr->state = cpu_Stopped;
+	printf("%s connection opened\n", __FUNCTION__);
+}
 
-	if (g->s != -1) {
-		FD_SET(g->s, &read_set);
-		max = g->s + 1;
-	} else {
-		FD_SET(g->listen, &read_set);
-		max = g->listen + 1;
-	}
-	struct timeval timo = { dosleep / 1000000, dosleep % 1000000 };
-	int ret = select(max, &read_set, NULL, NULL, &timo);
+static void
+gdb_async_closed(
+		avr_t * avr,
+		void * param )
+{
+	avr_gdb_t * g = avr->gdb;
+	printf("%s connection closed\n", __FUNCTION__);
+	if (g->s == (intptr_t)param)
+		g->s = -1;
+	close((intptr_t)param);
+	gdb_watch_clear(&g->breakpoints);
+	gdb_watch_clear(&g->watchpoints);
+	gdb_break_map_clear(g);
+	gdb_watch_map_update(g);
+	avr->state = cpu_Running;	// resume
+}
 
-	if (ret == 0)
-		return 0;
+static void
+gdb_async_interrupt(
+		avr_t * avr,
+		void * param )
+{
+	avr->state = cpu_StepDone;
+	printf("GDB hit control-c\n");
+}
 
-	if (FD_ISSET(g->listen, &read_set)) {
-		g->s = accept(g->listen, NULL, NULL);
+static void
+gdb_async_command(
+		avr_t * avr,
+		void * param )
+{
+	gdb_packet_t * p = (gdb_packet_t*)param;
+	// drop anything left over from a previous connection
+	if (p->s == p->g->s)
+		gdb_handle_command(p->g, p->cmd, p->len);
+	free(p);
+}
 
-		if (g->s == -1) {
-			perror("gdb_network_handler accept");
-			sleep(5);
-			return 1;
+// post to the simulation thread, retrying if the queue is full
+static void
+gdb_post(
+		avr_gdb_t * g,
+		avr_async_callback_t callback,
+		void * param )
+{
+	while (avr_async_call(g->avr, callback, param) && !g->quit)
+		usleep(1000);
+}
+
+static void
+gdb_network_receive(
+		avr_gdb_t * g,
+		int s,
+		gdb_framer_t * f,
+		const uint8_t * buffer,
+		ssize_t r )
+{
+//	hdump("gdb", buffer, r);
+	for (ssize_t i = 0; i < r; i++) {
+		uint8_t b = buffer[i];
+
+		if (f->checksum) {
+			// we trust TCP to get it right, just skip the checksum
+			if (--f->checksum)
+				continue;
+			f->buf[f->len] = 0;
+			DBG(printf("GDB command = '%s'\n", f->buf);)
+
+			send(s, "+", 1, 0);
+
+			gdb_packet_t * p = malloc(sizeof(*p) + f->len + 1);
+			p->g = g;
+			p->s = s;
+			p->len = f->len;
+			memcpy(p->cmd, f->buf, f->len + 1);
+			gdb_post(g, gdb_async_command, p);
+		} else if (f->in_packet) {
+			if (f->escape) {
+				b ^= 0x20;
+				f->escape = 0;
+			} else if (b == '}') {
+				f->escape = 1;
+				continue;
+			} else if (b == '#') {
+				f->in_packet = 0;
+				f->checksum = 2;
+				continue;
+			}
+			if (f->len < GDB_PACKET_SIZE)
+				f->buf[f->len++] = b;
+		} else if (b == '$') {
+			f->in_packet = 1;
+			f->escape = 0;
+			f->len = 0;
+		} else if (b == 3) {
+			// control C -- lets send the guy a nice status packet
+			gdb_post(g, gdb_async_interrupt, NULL);
 		}
-        int i = 1;
-        setsockopt (g->s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
-		g->avr->state = cpu_Stopped;
-		printf("%s connection opened\n", __FUNCTION__);
+		// anything else, like the '+' and '-' acks, is ignored
 	}
+}
 
-	if (g->s != -1 && FD_ISSET(g->s, &read_set)) {
-		uint8_t buffer[1024];
+/*
+ * The network thread waits for connections and packets, and hands them
+ * over to the simulation thread via the async queue, which also wakes it up
+ * if it's waiting.
+ */
+static void *
+gdb_network_thread(
+		void * param )
+{
+	avr_gdb_t * g = (avr_gdb_t*)param;
+	int s = -1;
+	gdb_framer_t * f = calloc(1, sizeof(*f));
+	uint8_t * buffer = malloc(GDB_PACKET_SIZE);
+
+	while (!g->quit) {
+		fd_set read_set;
+		int max;
+		FD_ZERO(&read_set);
+
+		if (s != -1) {
+			FD_SET(s, &read_set);
+			max = s + 1;
+		} else {
+			FD_SET(g->listen, &read_set);
+			max = g->listen + 1;
+		}
+		// timeout is only there to notice 'quit'
+		struct timeval timo = { 0, 100000 };
+		int ret = select(max, &read_set, NULL, NULL, &timo);
 
-		ssize_t r = recv(g->s, buffer, sizeof(buffer)-1, 0);
+		if (ret <= 0)
+			continue;
 
-		if (r == 0) {
-			printf("%s connection closed\n", __FUNCTION__);
-			close(g->s);
-			gdb_watch_clear(&g->breakpoints);
-			gdb_watch_clear(&g->watchpoints);
-			g->avr->state = cpu_Running;	// resume
-			g->s = -1;
-			return 1;
-		}
-		if (r == -1) {
-			perror("gdb_network_handler recv");
-			sleep(1);
-			return 1;
-		}
-		buffer[r] = 0;
-	//	printf("%s: received %d bytes\n'%s'\n", __FUNCTION__, r, buffer);
-	//	hdump("gdb", buffer, r);
-
-		uint8_t * src = buffer;
-		while (*src == '+' || *src == '-')
-			src++;
-		// control C -- lets send the guy a nice status packet
-		if (*src == 3) {
-			src++;
-			g->avr->state = cpu_StepDone;
-			printf("GDB hit control-c\n");
+		if (s == -1 && FD_ISSET(g->listen, &read_set)) {
+			s = accept(g->listen, NULL, NULL);
+
+			if (s == -1) {
+				perror("gdb_network_thread accept");
+				sleep(5);
+				continue;
+			}
+			int i = 1;
+			setsockopt (s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
+			memset(f, 0, sizeof(*f));
+			gdb_post(g, gdb_async_connected, (void*)(intptr_t)s);
+			continue;
 		}
-		if (*src  == '$') {
-			// strip checksum
-			uint8_t * end = buffer + r - 1;
-			while (end > src && *end != '#')
-				*end-- = 0;
-			*end = 0;
-			src++;
-			DBG(printf("GDB command = '%s'\n", src);)
-
-			send(g->s, "+", 1, 0);
-
-			gdb_handle_command(g, (char*)src);
+
+		if (s != -1 && FD_ISSET(s, &read_set)) {
+			ssize_t r = recv(s, buffer, GDB_PACKET_SIZE, 0);
+
+			if (r == 0) {
+				// the simulation thread closes it, it might still use it
+				gdb_post(g, gdb_async_closed, (void*)(intptr_t)s);
+				s = -1;
+				continue;
+			}
+			if (r == -1) {
+				perror("gdb_network_thread recv");
+				sleep(1);
+				continue;
+			}
+			gdb_network_receive(g, s, f, buffer, r);
 		}
 	}
-	return 1;
+	free(buffer);
+	free(f);
+	return NULL;
 }
 
 /**
@@ -573,7 +914,7 @@ avr_gdb_handle_watchpoints(
 		return;
 	}
 
-	int kind = g->watchpoints.points[i].kind;
+	int kind = gdb_watch_kind_flags(g->watchpoints.points[i].kind);
 	if (kind & type) {
 		/* Send gdb reply (see GDB user manual appendix E.3). */
 		char cmd[78];
@@ -581,7 +922,7 @@ avr_gdb_handle_watchpoints(
 				5, g->avr->data[R_SREG],
 				g->avr->data[R_SPL], g->avr->data[R_SPH],
 				g->avr->pc & 0xff, (g->avr->pc>>8)&0xff, (g->avr->pc>>16)&0xff,
-				kind & AVR_GDB_WATCH_ACCESS ? "awatch" :
+				(kind & AVR_GDB_WATCH_ACCESS) == AVR_GDB_WATCH_ACCESS ? "awatch" :
 					kind & AVR_GDB_WATCH_WRITE ? "watch" : "rwatch",
 				addr | 0x800000);
 		gdb_send_reply(g, cmd);
@@ -600,7 +941,7 @@ avr_gdb_processor(
 	avr_gdb_t * g = avr->gdb;
 
 	if (avr->state == cpu_Running &&
-			gdb_watch_find(&g->breakpoints, avr->pc) != -1) {
+			avr_gdb_break_map_get(avr->gdb_break_map, avr->pc)) {
 		DBG(printf("avr_gdb_processor hit breakpoint at %08x\n", avr->pc);)
 		gdb_send_quick_status(g, 0);
 		avr->state = cpu_Stopped;
@@ -608,8 +949,14 @@ avr_gdb_processor(
 		gdb_send_quick_status(g, 0);
 		avr->state = cpu_Stopped;
 	}
-	// this also sleeps for a bit
-	return gdb_network_handler(g, sleep);
+	// gdb packets arrive via the async queue, this also sleeps for a bit
+	if (sleep && !avr_async_pending(&avr->async) &&
+			!avr_async_wait(avr, sleep))
+		usleep(sleep);
+	if (!avr_async_pending(&avr->async))
+		return 0;
+	avr_async_process(avr);
+	return 1;
 }
 
 
@@ -653,7 +1000,17 @@ avr_gdb_init(
 	printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
 	g->avr = avr;
 	g->s = -1;
+	avr->gdb_break_map = calloc(1, AVR_GDB_BREAK_MAP_SIZE(avr));
 	avr->gdb = g;
+	// so the network thread can wake us up from the start
+	avr_async_wakeup_init(avr);
+	if (pthread_create(&g->thread, NULL, gdb_network_thread, g)) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: Can't start network thread");
+		avr->gdb = NULL;
+		free(avr->gdb_break_map);
+		avr->gdb_break_map = NULL;
+		goto error;
+	}
 	// change default run behaviour to use the slightly slower versions
 	avr->run = avr_callback_run_gdb;
 	avr->sleep = avr_callback_sleep_gdb;
@@ -676,6 +1033,14 @@ avr_deinit_gdb(
 		return;
 	avr->run = avr_callback_run_raw; // restore normal callbacks
 	avr->sleep = avr_callback_sleep_raw;
+	avr->gdb->quit = 1;
+	pthread_join(avr->gdb->thread, NULL);
+	// flush what the network thread might have left for us
+	avr_async_process(avr);
+	free(avr->gdb_break_map);
+	avr->gdb_break_map = NULL;
+	free(avr->gdb_watch_map);
+	avr->gdb_watch_map = NULL;
 	if (avr->gdb->listen != -1)
 		close(avr->gdb->listen);
 	avr->gdb->listen = -1;
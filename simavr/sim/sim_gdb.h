@@ -22,6 +22,8 @@
 #ifndef __SIM_GDB_H__
 #define __SIM_GDB_H__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,6 +39,18 @@ enum avr_gdb_watch_type {
 	AVR_GDB_WATCH_ACCESS = AVR_GDB_WATCH_WRITE | AVR_GDB_WATCH_READ,
 };
 
+// size in bytes of the breakpoint bitmap, one bit per flash word
+#define AVR_GDB_BREAK_MAP_SIZE(_avr) ((((_avr)->flashend >> 6) + 1) * sizeof(uint32_t))
+
+// return non-zero if there is a breakpoint at flash address 'pc'
+static inline int
+avr_gdb_break_map_get(
+		const uint32_t * map,
+		uint32_t pc )
+{
+	return map && ((map[pc >> 6] >> ((pc >> 1) & 31)) & 1);
+}
+
 int avr_gdb_init(avr_t * avr);
 
 void avr_deinit_gdb(avr_t * avr);
@@ -23,6 +23,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sim_hex.h"
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_eeprom.h"
 
 // friendly hex dump
 void hdump(const char *w, uint8_t *b, size_t l)
@@ -85,87 +88,282 @@ free_ihex_chunks(
 			free(chunks[i].data);
 }
 
+/*
+ * Hex digit values, plus one; zero means 'not a hex digit'
+ */
+static const uint8_t _ihex_nibble[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#define _B(_v)	(~0ULL / 255 * (_v))	// '_v' in every byte
+// bytes of 'x' (all < 128) strictly between 'm' and 'n' get their top bit set
+#define _HASBETWEEN(_x, _m, _n) \
+	(((_B(127 + (_n)) - ((_x) & _B(127))) & ~(_x) & \
+		(((_x) & _B(127)) + _B(127 - (_m)))) & _B(128))
+
+/*
+ * Decodes 'count' bytes from 2 * 'count' hex digits in 'src'. Eight digits
+ * at a time are validated and converted in a 64 bits register, the rest
+ * goes through the table. Returns -1 if there was anything but hex digits.
+ */
+static int
+_ihex_decode(
+		const char * src,
+		uint8_t * dst,
+		int count)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; count >= 4; count -= 4, src += 8, dst += 4) {
+		uint64_t x;
+		memcpy(&x, src, sizeof(x));
+		if (x & _B(128))
+			return -1;
+		uint64_t ok = _HASBETWEEN(x, '0' - 1, '9' + 1) |
+				_HASBETWEEN(x | _B(0x20), 'a' - 1, 'f' + 1);
+		if (ok != _B(128))
+			return -1;
+		// letters have bit 6 set, and their low nibble is 9 short
+		uint64_t n = (x & _B(0x0f)) + ((x >> 6) & _B(1)) * 9;
+		// pair the nibbles in 16 bits lanes, then pack the lanes
+		n = ((n & 0x000f000f000f000fULL) << 4) | ((n >> 8) & 0x000f000f000f000fULL);
+		n = (n | (n >> 8)) & 0x0000ffff0000ffffULL;
+		uint32_t v = n | (n >> 16);
+		memcpy(dst, &v, sizeof(v));
+	}
+#endif
+	for (; count; count--, src += 2) {
+		uint8_t h = _ihex_nibble[(uint8_t)src[0]], l = _ihex_nibble[(uint8_t)src[1]];
+		if (!h || !l)
+			return -1;
+		*dst++ = ((h - 1) << 4) | (l - 1);
+	}
+	return 0;
+}
+#undef _HASBETWEEN
+#undef _B
+
 int
-read_ihex_chunks(
+read_ihex_stream(
 		const char * fname,
-		ihex_chunk_p * chunks )
+		ihex_record_t record,
+		void * param)
 {
-	if (!fname || !chunks)
+	if (!fname || !record)
 		return -1;
-	FILE * f = fopen(fname, "r");
+	FILE * f = fopen(fname, "rb");
 	if (!f) {
 		perror(fname);
 		return -1;
 	}
-	uint32_t segment = 0;	// segment address
-	int chunk = 0, max_chunks = 0;
-	*chunks = NULL;
+	// hex files are small enough to be read in one go
+	size_t size = 0, alloc = 0;
+	char * text = NULL;
+	for (;;) {
+		if (size == alloc) {
+			char * n = realloc(text, alloc = alloc ? alloc * 2 : 64 * 1024);
+			if (!n) {
+				free(text);
+				fclose(f);
+				return -1;
+			}
+			text = n;
+		}
+		size_t r = fread(text + size, 1, alloc - size, f);
+		if (!r)
+			break;
+		size += r;
+	}
+	fclose(f);
 
-	while (!feof(f)) {
-		char line[128];
-		if (!fgets(line, sizeof(line)-1, f))
+	uint32_t segment = 0;	// segment address
+	int res = 0;
+	const char * p = text, * end = text + size;
+	while (p < end && res >= 0) {
+		if (*p <= ' ') {	// line endings, trailing blanks
+			p++;
 			continue;
-		if (line[0] != ':') {
+		}
+		const char * line = p;
+		uint8_t bline[5 + 255];
+		// byte count, address and record type come first
+		if (*p++ != ':' || end - p < 10 || _ihex_decode(p, bline, 4)) {
 			fprintf(stderr, "AVR: '%s' invalid ihex format (%.4s)\n", fname, line);
+			res = -1;
 			break;
 		}
-		uint8_t bline[64];
-
-		int len = read_hex_string(line + 1, bline, sizeof(bline));
-		if (len <= 0)
-			continue;
+		int len = 5 + bline[0];
+		if (end - p < 2 * len || _ihex_decode(p + 8, bline + 4, len - 4)) {
+			fprintf(stderr, "AVR: '%s' invalid ihex format (%.4s)\n", fname, line);
+			res = -1;
+			break;
+		}
+		p += 2 * len;
 
 		uint8_t chk = 0;
-		{	// calculate checksum
-			uint8_t * src = bline;
-			int tlen = len-1;
-			while (tlen--)
-				chk += *src++;
-			chk = 0x100 - chk;
-		}
-		if (chk != bline[len-1]) {
-			fprintf(stderr, "%s: %s, invalid checksum %02x/%02x\n", __FUNCTION__, fname, chk, bline[len-1]);
+		for (int i = 0; i < len; i++)
+			chk += bline[i];
+		if (chk) {
+			fprintf(stderr, "%s: %s, invalid checksum %02x/%02x\n", __FUNCTION__,
+					fname, (uint8_t)(bline[len - 1] - chk), bline[len - 1]);
+			res = -1;
 			break;
 		}
-		uint32_t addr = 0;
 		switch (bline[3]) {
 			case 0: // normal data
-				addr = segment | (bline[1] << 8) | bline[2];
+				if (record(param, segment + ((bline[1] << 8) | bline[2]),
+						bline + 4, bline[0]))
+					res = -1;
+				else
+					res += bline[0];
 				break;
 			case 1: // end of file
-				continue;
-			case 2: // extended address 2 bytes
+				p = end;
+				break;
+			case 2: // extended segment address
 				segment = ((bline[4] << 8) | bline[5]) << 4;
-				continue;
-			case 4:
+				break;
+			case 4: // extended linear address
 				segment = ((bline[4] << 8) | bline[5]) << 16;
-				continue;
+				break;
+			case 3: // start addresses, meaningless here
+			case 5:
+				break;
 			default:
 				fprintf(stderr, "%s: %s, unsupported check type %02x\n", __FUNCTION__, fname, bline[3]);
-				continue;
+				break;
 		}
-		if (chunk < max_chunks && addr != ((*chunks)[chunk].baseaddr + (*chunks)[chunk].size)) {
-			if ((*chunks)[chunk].size)
-				chunk++;
+	}
+	free(text);
+	return res;
+}
+
+typedef struct ihex_chunks_t {
+	ihex_chunk_p	chunks;
+	int				chunk, max_chunks;
+} ihex_chunks_t;
+
+static int
+_ihex_chunks_record(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	ihex_chunks_t * c = param;
+	ihex_chunk_p chunks = c->chunks;
+
+	if (c->chunk < c->max_chunks &&
+			addr != chunks[c->chunk].baseaddr + chunks[c->chunk].size) {
+		if (chunks[c->chunk].size)
+			c->chunk++;
+	}
+	if (c->chunk >= c->max_chunks) {
+		c->max_chunks++;
+		/* Here we allocate and zero an extra chunk, to act as terminator */
+		chunks = realloc(chunks, (1 + c->max_chunks) * sizeof(ihex_chunk_t));
+		if (!chunks)
+			return -1;
+		c->chunks = chunks;
+		memset(chunks + c->chunk, 0,
+				(1 + (c->max_chunks - c->chunk)) * sizeof(ihex_chunk_t));
+		chunks[c->chunk].baseaddr = addr;
+	}
+	uint8_t * d = realloc(chunks[c->chunk].data, chunks[c->chunk].size + size);
+	if (!d)
+		return -1;
+	chunks[c->chunk].data = d;
+	memcpy(d + chunks[c->chunk].size, data, size);
+	chunks[c->chunk].size += size;
+	return 0;
+}
+
+int
+read_ihex_chunks(
+		const char * fname,
+		ihex_chunk_p * chunks )
+{
+	if (!fname || !chunks)
+		return -1;
+	ihex_chunks_t c = { 0 };
+	// a broken line used to stop the parsing, but keep what was read
+	read_ihex_stream(fname, _ihex_chunks_record, &c);
+	*chunks = c.chunks;
+	return c.max_chunks;
+}
+
+typedef struct ihex_avr_t {
+	avr_t *		avr;
+	const char * fname;
+	uint32_t	offset;
+	uint32_t	flash_lo, flash_hi;
+	uint32_t	eeprom;
+} ihex_avr_t;
+
+static int
+_ihex_avr_record(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	ihex_avr_t * l = param;
+	avr_t * avr = l->avr;
+
+	addr += l->offset;
+	if (addr >= AVR_SEGMENT_OFFSET_EEPROM && addr < AVR_SEGMENT_OFFSET_EEPROM + 0x10000) {
+		avr_eeprom_desc_t d = {
+			.ee = (uint8_t *)data,
+			.offset = addr - AVR_SEGMENT_OFFSET_EEPROM,
+			.size = size,
+		};
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &d)) {
+			AVR_LOG(avr, LOG_ERROR, "%s: %s: no room for eeprom data at %04x\n",
+					__func__, l->fname, d.offset);
+			return -1;
 		}
-		if (chunk >= max_chunks) {
-			max_chunks++;
-			/* Here we allocate and zero an extra chunk, to act as terminator */
-			*chunks = realloc(*chunks, (1 + max_chunks) * sizeof(ihex_chunk_t));
-			memset(*chunks + chunk, 0,
-					(1 + (max_chunks - chunk)) * sizeof(ihex_chunk_t));
-			(*chunks)[chunk].baseaddr = addr;
+		l->eeprom += size;
+	} else if (addr < (1*1024*1024)) {
+		if (addr + size > avr->flashend + 1) {
+			AVR_LOG(avr, LOG_ERROR, "%s: %s: flash data at %05x is past the end (%05x)\n",
+					__func__, l->fname, addr, avr->flashend);
+			return -1;
 		}
-		(*chunks)[chunk].data = realloc((*chunks)[chunk].data,
-									(*chunks)[chunk].size + bline[0]);
-		memcpy((*chunks)[chunk].data + (*chunks)[chunk].size,
-				bline + 4, bline[0]);
-		(*chunks)[chunk].size += bline[0];
-	}
-	fclose(f);
-	return max_chunks;
+		memcpy(avr->flash + addr, data, size);
+		if (addr < l->flash_lo)
+			l->flash_lo = addr;
+		if (addr + size > l->flash_hi)
+			l->flash_hi = addr + size;
+	} else
+		AVR_LOG(avr, LOG_TRACE, "%s: %s: ignored %d bytes at %08x\n",
+				__func__, l->fname, size, addr);
+	return 0;
 }
 
+int
+avr_load_ihex(
+		avr_t * avr,
+		const char * fname,
+		uint32_t offset,
+		uint32_t * flashbase)
+{
+	ihex_avr_t l = {
+		.avr = avr, .fname = fname, .offset = offset, .flash_lo = ~0,
+	};
+	int res = read_ihex_stream(fname, _ihex_avr_record, &l);
+	if (res < 0)
+		return res;
+	if (l.flash_hi) {
+		avr->codeend = l.flash_hi;
+		AVR_LOG(avr, LOG_TRACE, "%s: %s: flash %05x-%05x, %d bytes of eeprom\n",
+				__func__, fname, l.flash_lo, l.flash_hi, l.eeprom);
+	}
+	if (flashbase)
+		*flashbase = l.flash_hi ? l.flash_lo : 0;
+	return res;
+}
 
 uint8_t *
 read_ihex_file(
@@ -44,6 +44,42 @@ typedef struct ihex_chunk_t {
 	uint32_t size;		// read data size
 } ihex_chunk_t, *ihex_chunk_p;
 
+/*
+ * Called for every data record of a .hex file, with its absolute address
+ * (extended segment and linear addresses applied). Returns non-zero to
+ * stop the parsing.
+ */
+typedef int (*ihex_record_t)(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size);
+/*
+ * Reads a .hex file, and calls 'record' for each data record, in file
+ * order. Returns the number of data bytes, or -1 if an error occurs.
+ */
+int
+read_ihex_stream(
+		const char * fname,
+		ihex_record_t record,
+		void * param);
+
+struct avr_t;
+/*
+ * Loads a .hex file straight into the flash and eeprom of 'avr'. 'offset'
+ * is added to the addresses; the records that end up at
+ * AVR_SEGMENT_OFFSET_EEPROM and above go to the eeprom, the ones below 1MB
+ * go to the flash. The lowest flash address loaded is returned in
+ * 'flashbase', if not NULL.
+ * Returns the number of data bytes, or -1 if an error occurs.
+ */
+int
+avr_load_ihex(
+		struct avr_t * avr,
+		const char * fname,
+		uint32_t offset,
+		uint32_t * flashbase);
+
 /*
  * Read a .hex file, detects the various different chunks in it from their starting
  * addresses and allocate an array of ihex_chunk_t returned in 'chunks'.
@@ -0,0 +1,297 @@
+/*
+	sim_image.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include "sim_image.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define ALIGN(_v, _a)	(((_v) + (_a) - 1) & ~((_a) - 1))
+
+// appends 'size' bytes to the image, 8 bytes aligned
+static void
+_avr_image_add(
+		uint8_t ** image,
+		uint32_t * size,
+		avr_image_section_t * s,
+		const void * data,
+		uint32_t len)
+{
+	s->offset = len ? ALIGN(*size, 8) : 0;
+	s->size = len;
+	if (!len)
+		return;
+	uint8_t * n = realloc(*image, s->offset + len);
+	if (!n) {
+		free(*image);
+		*image = NULL;
+		return;
+	}
+	memset(n + *size, 0, s->offset - *size);
+	if (data)
+		memcpy(n + s->offset, data, len);
+	*image = n;
+	*size = s->offset + len;
+}
+
+int
+avr_image_write(
+		const char * filename,
+		elf_firmware_t * firmware)
+{
+	avr_image_header_t h = {
+		.magic = AVR_IMAGE_MAGIC,
+		.version = AVR_IMAGE_VERSION,
+		.endian = 0x01020304,
+		.firmware_size = sizeof(elf_firmware_t),
+	};
+	uint32_t size = sizeof(h);
+	uint8_t * image = calloc(1, size);
+
+	// the pointers are meaningless in a file, and rebuilt by the reader
+	elf_firmware_t f = *firmware;
+	f.flash = f.eeprom = f.fuse = f.lockbits = f.image = NULL;
+	f.imagesize = f.imagemapped = 0;
+#if ELF_SYMBOLS
+	f.symbol = NULL;
+#endif
+	if (image)
+		_avr_image_add(&image, &size, &h.firmware, &f, sizeof(f));
+	if (image)
+		_avr_image_add(&image, &size, &h.flash,
+				firmware->flash, firmware->flash ? firmware->flashsize : 0);
+	if (image)
+		_avr_image_add(&image, &size, &h.eeprom,
+				firmware->eeprom, firmware->eeprom ? firmware->eesize : 0);
+	if (image)
+		_avr_image_add(&image, &size, &h.fuse,
+				firmware->fuse, firmware->fuse ? firmware->fusesize : 0);
+	if (image)
+		_avr_image_add(&image, &size, &h.lockbits,
+				firmware->lockbits, firmware->lockbits ? 1 : 0);
+#if ELF_SYMBOLS
+	uint32_t slen = 0;
+	for (int i = 0; i < (int)firmware->symbolcount; i++)
+		slen += ALIGN(sizeof(avr_symbol_t) +
+				strlen(firmware->symbol[i]->symbol) + 1, 4);
+	if (image)
+		_avr_image_add(&image, &size, &h.symbols, NULL, slen);
+	if (image) {
+		uint8_t * d = image + h.symbols.offset;
+		for (int i = 0; i < (int)firmware->symbolcount; i++) {
+			avr_symbol_t * s = firmware->symbol[i];
+			uint32_t l = sizeof(*s) + strlen(s->symbol) + 1;
+			memset(d, 0, ALIGN(l, 4));
+			memcpy(d, s, l);
+			d += ALIGN(l, 4);
+		}
+		h.symbolcount = firmware->symbolcount;
+	}
+#endif
+	if (!image)
+		return -1;
+	memcpy(image, &h, sizeof(h));
+
+	// write a temporary, and rename it over the target
+	char * tmp = malloc(strlen(filename) + 16);
+	if (!tmp) {
+		free(image);
+		return -1;
+	}
+	sprintf(tmp, "%s.%d", filename, (int)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	int res = fd == -1 ? -1 : 0;
+	for (uint32_t done = 0; !res && done < size; ) {
+		ssize_t r = write(fd, image + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			res = -1;
+		else
+			done += r;
+	}
+	if (fd != -1 && close(fd))
+		res = -1;
+	if (!res && rename(tmp, filename))
+		res = -1;
+	if (res && fd != -1)
+		unlink(tmp);
+	free(tmp);
+	free(image);
+	return res;
+}
+
+static int
+_avr_image_check(
+		avr_image_section_t * s,
+		size_t size)
+{
+	return s->offset <= size && s->size <= size - s->offset;
+}
+
+static void
+_avr_image_free(
+		uint8_t * image,
+		size_t size,
+		int mapped)
+{
+#ifndef __MINGW32__
+	if (mapped) {
+		munmap(image, size);
+		return;
+	}
+#endif
+	free(image);
+}
+
+int
+avr_image_read(
+		const char * filename,
+		elf_firmware_t * firmware)
+{
+	int fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return -1;
+	struct stat st = { 0 };
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(avr_image_header_t)) {
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	uint8_t * image = NULL;
+	int mapped = 0;
+#ifndef __MINGW32__
+	void * m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m != MAP_FAILED) {
+		image = m;
+		mapped = 1;
+	}
+#endif
+	if (!image) {	// no mmap, read it all
+		size_t got = 0;
+		image = malloc(size);
+		while (image && got < size) {
+			ssize_t r = read(fd, image + got, size - got);
+			if (r <= 0)
+				break;
+			got += r;
+		}
+		if (image && got != size) {
+			free(image);
+			image = NULL;
+		}
+	}
+	close(fd);
+	if (!image)
+		return -1;
+
+	avr_image_header_t * h = (avr_image_header_t *)image;
+	if (memcmp(h->magic, AVR_IMAGE_MAGIC, sizeof(h->magic)) ||
+			h->version != AVR_IMAGE_VERSION || h->endian != 0x01020304 ||
+			h->firmware_size != sizeof(elf_firmware_t) ||
+			h->firmware.size != sizeof(elf_firmware_t) ||
+			!_avr_image_check(&h->firmware, size) ||
+			!_avr_image_check(&h->flash, size) ||
+			!_avr_image_check(&h->eeprom, size) ||
+			!_avr_image_check(&h->fuse, size) ||
+			!_avr_image_check(&h->lockbits, size) ||
+			!_avr_image_check(&h->symbols, size)) {
+		AVR_LOG(NULL, LOG_ERROR, "%s: %s: not an image for this simavr\n",
+				__func__, filename);
+		goto error;
+	}
+	elf_firmware_t f;
+	memcpy(&f, image + h->firmware.offset, sizeof(f));
+	// the loader trusts these sizes, they must match what is in the file
+	if ((h->flash.size && f.flashsize != h->flash.size) ||
+			(h->eeprom.size && f.eesize != h->eeprom.size) ||
+			(h->fuse.size && f.fusesize != h->fuse.size)) {
+		AVR_LOG(NULL, LOG_ERROR, "%s: %s: corrupted section sizes\n",
+				__func__, filename);
+		goto error;
+	}
+	f.flash = h->flash.size ? image + h->flash.offset : NULL;
+	f.eeprom = h->eeprom.size ? image + h->eeprom.offset : NULL;
+	f.fuse = h->fuse.size ? image + h->fuse.offset : NULL;
+	f.lockbits = h->lockbits.size ? image + h->lockbits.offset : NULL;
+#if ELF_SYMBOLS
+	f.symbol = NULL;
+	f.symbolcount = 0;
+	if (h->symbolcount) {
+		f.symbol = malloc(h->symbolcount * sizeof(f.symbol[0]));
+		if (!f.symbol)
+			goto error;
+		uint8_t * d = image + h->symbols.offset;
+		uint8_t * end = d + h->symbols.size;
+		for (uint32_t i = 0; i < h->symbolcount; i++) {
+			avr_symbol_t * s = (avr_symbol_t *)d;
+			size_t room = d < end ? end - d : 0;
+			if (room <= sizeof(*s) ||
+					!memchr(s->symbol, 0, room - sizeof(*s))) {
+				AVR_LOG(NULL, LOG_ERROR, "%s: %s: corrupted symbols\n",
+						__func__, filename);
+				free(f.symbol);
+				goto error;
+			}
+			f.symbol[i] = s;
+			d += ALIGN(sizeof(*s) + strlen(s->symbol) + 1, 4);
+		}
+		f.symbolcount = h->symbolcount;
+	}
+#endif
+	f.image = image;
+	f.imagesize = size;
+	f.imagemapped = mapped;
+	*firmware = f;
+	return 0;
+error:
+	_avr_image_free(image, size, mapped);
+	return -1;
+}
+
+void
+avr_image_release(
+		elf_firmware_t * firmware)
+{
+	if (!firmware->image)
+		return;
+#if ELF_SYMBOLS
+	free(firmware->symbol);
+	firmware->symbol = NULL;
+	firmware->symbolcount = 0;
+#endif
+	_avr_image_free(firmware->image, firmware->imagesize,
+			firmware->imagemapped);
+	firmware->flash = firmware->eeprom = NULL;
+	firmware->fuse = firmware->lockbits = NULL;
+	firmware->image = NULL;
+}
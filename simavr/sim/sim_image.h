@@ -0,0 +1,92 @@
+/*
+	sim_image.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "simavr image" files: an elf_firmware_t, as elf_read_firmware() leaves
+ * it, saved in a form that can be mapped back in memory and used as is.
+ *
+ * The image holds the flash, eeprom, fuses and lock bits, everything that
+ * was parsed from the .mmcu section, and the symbols, already sorted.
+ * Loading one is a mmap() and a pass over the symbols to index them, no
+ * parsing or copying is involved.
+ *
+ * Images are a cache for a given simavr build, not an exchange format:
+ * they are in host byte order, and are rejected if elf_firmware_t changed.
+ */
+#ifndef __SIM_IMAGE_H__
+#define __SIM_IMAGE_H__
+
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_IMAGE_MAGIC		"SIMAVRIM"
+#define AVR_IMAGE_VERSION	1
+
+typedef struct avr_image_section_t {
+	uint32_t	offset;		// from the start of the file
+	uint32_t	size;
+} avr_image_section_t;
+
+typedef struct avr_image_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	endian;			// 0x01020304, as written by the host
+	uint32_t	firmware_size;	// sizeof(elf_firmware_t)
+	uint32_t	symbolcount;
+	avr_image_section_t	firmware;	// the elf_firmware_t, pointers cleared
+	avr_image_section_t	flash, eeprom, fuse, lockbits;
+	avr_image_section_t	symbols;	// avr_symbol_t, 4 bytes aligned
+} avr_image_header_t;
+
+/*
+ * Writes 'firmware' to 'filename'. The file is replaced atomically, so
+ * running simulations never see a partial image. Returns zero if all is
+ * well.
+ */
+int
+avr_image_write(
+		const char * filename,
+		elf_firmware_t * firmware);
+/*
+ * Maps 'filename' and fills 'firmware' from it. The flash, eeprom and
+ * symbols point to the mapping, which stays until avr_image_release().
+ * Returns zero if all is well.
+ */
+int
+avr_image_read(
+		const char * filename,
+		elf_firmware_t * firmware);
+/*
+ * Unmaps an image read by avr_image_read(), once nothing uses its flash,
+ * eeprom or symbols anymore. Does nothing if 'firmware' isn't an image.
+ */
+void
+avr_image_release(
+		elf_firmware_t * firmware);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_IMAGE_H__ */
@@ -0,0 +1,270 @@
+/*
+	sim_int_stats.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim_int_stats.h"
+
+static void
+avr_int_hist_add(
+		avr_int_hist_t * h,
+		uint64_t value)
+{
+	int b = value ? 64 - __builtin_clzll(value) : 0;
+	if (b >= AVR_INT_STATS_BUCKETS)
+		b = AVR_INT_STATS_BUCKETS - 1;
+	h->bucket[b]++;
+	if (!h->count || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->sum += value;
+}
+
+// upper bound of the bucket that contains the 'pc' percentile
+static uint64_t
+avr_int_hist_percentile(
+		avr_int_hist_t * h,
+		int pc)
+{
+	if (!h->count)
+		return 0;
+	uint64_t want = (h->count * pc + 99) / 100, total = 0;
+	for (int b = 0; b < AVR_INT_STATS_BUCKETS; b++) {
+		total += h->bucket[b];
+		if (total >= want) {
+			uint64_t top = b ? (1ULL << b) - 1 : 0;
+			return top > h->max ? h->max : top;
+		}
+	}
+	return h->max;
+}
+
+static void
+avr_int_stats_pending_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_int_vector_stats_t * v = (avr_int_vector_stats_t*)param;
+	avr_t * avr = v->stats->avr;
+
+	if (value) {
+		/*
+		 * irq->value still holds the previous value here; a vector that
+		 * is not enabled is raised again without ever being pending.
+		 */
+		if (irq->value && v->armed) {
+			v->coalesced++;
+			return;
+		}
+		v->raised++;
+		v->armed = 1;
+		v->raised_cycle = avr->cycle;
+	} else if (v->armed) {
+		// cleared by the firmware (or disabled) before being serviced
+		v->armed = 0;
+		v->missed++;
+	}
+}
+
+static void
+avr_int_stats_coalesced_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_int_vector_stats_t * v = (avr_int_vector_stats_t*)param;
+	v->coalesced++;
+}
+
+static void
+avr_int_stats_running_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_int_vector_stats_t * v = (avr_int_vector_stats_t*)param;
+	avr_int_stats_t * s = v->stats;
+	avr_t * avr = s->avr;
+
+	if (value) {
+		v->entered++;
+		if (v->armed)
+			avr_int_hist_add(&v->latency, avr->cycle - v->raised_cycle);
+		v->armed = 0;
+		if (s->depth == ARRAY_SIZE(s->stack))
+			return;
+		s->stack[s->depth].v = v;
+		s->stack[s->depth].entry = avr->cycle;
+		s->stack[s->depth].nested = 0;
+		s->depth++;
+		if (s->depth > v->max_depth)
+			v->max_depth = s->depth;
+		if (s->depth > s->max_depth)
+			s->max_depth = s->depth;
+		return;
+	}
+	// RETI; the stack can be empty if the stats were started mid-ISR
+	if (!s->depth || s->stack[s->depth - 1].v != v)
+		return;
+	s->depth--;
+	avr_cycle_count_t duration = avr->cycle - s->stack[s->depth].entry;
+	avr_int_hist_add(&v->duration, duration);
+	v->self += duration - s->stack[s->depth].nested;
+	if (s->depth)
+		s->stack[s->depth - 1].nested += duration;
+}
+
+void
+avr_int_stats_init(
+		struct avr_t * avr,
+		avr_int_stats_t * stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->avr = avr;
+	stats->start = avr->cycle;
+
+	avr_int_table_p table = &avr->interrupts;
+	for (int i = 0; i < table->vector_count; i++) {
+		avr_int_vector_t * vector = table->vector[i];
+		if (vector->vector >= AVR_INT_MAX_VECTORS)
+			continue;
+		avr_int_vector_stats_t * v = &stats->vector[vector->vector];
+		v->stats = stats;
+		v->vector = vector;
+		avr_irq_register_notify(vector->irq + AVR_INT_IRQ_PENDING,
+				avr_int_stats_pending_hook, v);
+		avr_irq_register_notify(vector->irq + AVR_INT_IRQ_RUNNING,
+				avr_int_stats_running_hook, v);
+		avr_irq_register_notify(vector->irq + AVR_INT_IRQ_COALESCED,
+				avr_int_stats_coalesced_hook, v);
+	}
+	avr->int_stats = stats;
+}
+
+void
+avr_int_stats_reset(
+		avr_int_stats_t * stats)
+{
+	stats->start = stats->avr->cycle;
+	stats->max_depth = stats->depth = 0;
+	for (int i = 0; i < AVR_INT_MAX_VECTORS; i++) {
+		avr_int_vector_stats_t * v = &stats->vector[i];
+		avr_int_vector_stats_t keep = {
+			.stats = v->stats, .vector = v->vector };
+		*v = keep;
+	}
+}
+
+void
+avr_int_stats_report(
+		avr_int_stats_t * stats,
+		FILE * out)
+{
+	avr_cycle_count_t total = stats->avr->cycle - stats->start;
+
+	fprintf(out, "Interrupt statistics, %llu cycles, max nesting %d\n",
+			(unsigned long long)total, stats->max_depth);
+	fprintf(out, " vec   raised coalesc   missed  entered |"
+			"  lat min    avg    p99    max |"
+			"  isr min    avg    p99    max |  cpu%% nest\n");
+	for (int i = 0; i < AVR_INT_MAX_VECTORS; i++) {
+		avr_int_vector_stats_t * v = &stats->vector[i];
+		if (!v->vector || (!v->raised && !v->entered))
+			continue;
+		fprintf(out, " %3d %8llu %7llu %8llu %8llu |"
+				" %8llu %6llu %6llu %6llu |"
+				" %8llu %6llu %6llu %6llu | %5.2f %4d\n",
+				i,
+				(unsigned long long)v->raised,
+				(unsigned long long)v->coalesced,
+				(unsigned long long)v->missed,
+				(unsigned long long)v->entered,
+				(unsigned long long)v->latency.min,
+				(unsigned long long)(v->latency.count ?
+						v->latency.sum / v->latency.count : 0),
+				(unsigned long long)avr_int_hist_percentile(&v->latency, 99),
+				(unsigned long long)v->latency.max,
+				(unsigned long long)v->duration.min,
+				(unsigned long long)(v->duration.count ?
+						v->duration.sum / v->duration.count : 0),
+				(unsigned long long)avr_int_hist_percentile(&v->duration, 99),
+				(unsigned long long)v->duration.max,
+				total ? 100.0 * v->self / total : 0.0,
+				v->max_depth);
+	}
+}
+
+int
+avr_int_stats_write_csv(
+		avr_int_stats_t * stats,
+		const char * filename)
+{
+	FILE * o = fopen(filename, "w");
+	if (!o) {
+		AVR_LOG(stats->avr, LOG_ERROR, "%s: %s: %s\n", __func__,
+				filename, strerror(errno));
+		return -1;
+	}
+	avr_cycle_count_t total = stats->avr->cycle - stats->start;
+
+	fprintf(o, "vector,raised,coalesced,missed,entered,max_depth,"
+			"self_cycles,cpu_share,"
+			"lat_min,lat_sum,lat_max,isr_min,isr_sum,isr_max");
+	for (int b = 0; b < AVR_INT_STATS_BUCKETS; b++)
+		fprintf(o, ",lat_le_%llu", b ? (1ULL << b) - 1 : 0ULL);
+	for (int b = 0; b < AVR_INT_STATS_BUCKETS; b++)
+		fprintf(o, ",isr_le_%llu", b ? (1ULL << b) - 1 : 0ULL);
+	fprintf(o, "\n");
+
+	for (int i = 0; i < AVR_INT_MAX_VECTORS; i++) {
+		avr_int_vector_stats_t * v = &stats->vector[i];
+		if (!v->vector)
+			continue;
+		fprintf(o, "%d,%llu,%llu,%llu,%llu,%d,%llu,%f,"
+				"%llu,%llu,%llu,%llu,%llu,%llu",
+				i,
+				(unsigned long long)v->raised,
+				(unsigned long long)v->coalesced,
+				(unsigned long long)v->missed,
+				(unsigned long long)v->entered,
+				v->max_depth,
+				(unsigned long long)v->self,
+				total ? (double)v->self / total : 0.0,
+				(unsigned long long)v->latency.min,
+				(unsigned long long)v->latency.sum,
+				(unsigned long long)v->latency.max,
+				(unsigned long long)v->duration.min,
+				(unsigned long long)v->duration.sum,
+				(unsigned long long)v->duration.max);
+		for (int b = 0; b < AVR_INT_STATS_BUCKETS; b++)
+			fprintf(o, ",%llu", (unsigned long long)v->latency.bucket[b]);
+		for (int b = 0; b < AVR_INT_STATS_BUCKETS; b++)
+			fprintf(o, ",%llu", (unsigned long long)v->duration.bucket[b]);
+		fprintf(o, "\n");
+	}
+	fclose(o);
+	return 0;
+}
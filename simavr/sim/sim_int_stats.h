@@ -0,0 +1,111 @@
+/*
+	sim_int_stats.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Interrupt statistics. Hooks the 'pending' and 'running' IRQs of every
+ * registered vector and accumulates, per vector:
+ * + raise to ISR entry latency, in cycles
+ * + ISR duration, from entry to the matching RETI (nested ISRs included)
+ * + 'self' cycles, ie the duration minus the time spent in nested ISRs
+ * + number of raises, raises that were coalesced into an already pending
+ *   one (from the 'coalesced' IRQ), and raises that were cleared before
+ *   the ISR could run
+ * + maximum nesting depth the vector was entered at
+ *
+ * Latency and duration are kept as log2 histograms, and can be printed as
+ * a report or written as a CSV file.
+ */
+#ifndef __SIM_INT_STATS_H__
+#define __SIM_INT_STATS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bucket 0 is for 0 cycles, bucket n for [2^(n-1) .. 2^n-1] cycles
+#define AVR_INT_STATS_BUCKETS	32
+
+typedef struct avr_int_hist_t {
+	uint64_t	bucket[AVR_INT_STATS_BUCKETS];
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min, max;
+} avr_int_hist_t;
+
+typedef struct avr_int_vector_stats_t {
+	struct avr_int_stats_t * stats;
+	avr_int_vector_t *	vector;		// NULL if this vector number is not used
+	avr_cycle_count_t	raised_cycle;
+	uint8_t				armed;		// raised, and not serviced yet
+	uint8_t				max_depth;	// deepest nesting level it was entered at
+	uint64_t			raised;
+	uint64_t			coalesced;	// raised while already pending
+	uint64_t			missed;		// cleared before the ISR was entered
+	uint64_t			entered;
+	uint64_t			self;		// cycles spent in this ISR, minus nested ones
+	avr_int_hist_t		latency;
+	avr_int_hist_t		duration;
+} avr_int_vector_stats_t;
+
+typedef struct avr_int_stats_t {
+	struct avr_t *		avr;
+	avr_cycle_count_t	start;		// cycle the stats were started at
+	uint8_t				max_depth;
+	uint8_t				depth;
+	struct {
+		avr_int_vector_stats_t * v;
+		avr_cycle_count_t	entry;
+		avr_cycle_count_t	nested;	// cycles spent in nested ISRs
+	} stack[64];
+	avr_int_vector_stats_t vector[AVR_INT_MAX_VECTORS];
+} avr_int_stats_t;
+
+/*
+ * Start collecting statistics for all the vectors registered so far; call
+ * after the AVR has been initialized.
+ */
+void
+avr_int_stats_init(
+		struct avr_t * avr,
+		avr_int_stats_t * stats);
+// Clears the counters, called by avr_reset()
+void
+avr_int_stats_reset(
+		avr_int_stats_t * stats);
+// print a human readable summary
+void
+avr_int_stats_report(
+		avr_int_stats_t * stats,
+		FILE * out);
+// write one line per vector, summary then histograms. Returns 0 on success
+int
+avr_int_stats_write_csv(
+		avr_int_stats_t * stats,
+		const char * filename);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_INT_STATS_H__ */
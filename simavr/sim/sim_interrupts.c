@@ -28,8 +28,6 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 
-DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
-
 void
 avr_interrupt_init(
 		avr_t * avr )
@@ -37,7 +35,8 @@ avr_interrupt_init(
 	avr_int_table_p table = &avr->interrupts;
 	memset(table, 0, sizeof(*table));
 
-	static const char *names[] = { ">avr.int.pending", ">avr.int.running" };
+	static const char *names[] = { ">avr.int.pending", ">avr.int.running",
+			">avr.int.coalesced" };
 	avr_init_irq(&avr->irq_pool, table->irq,
 			0, // base number
 			AVR_INT_IRQ_COUNT, names);
@@ -50,7 +49,7 @@ avr_interrupt_reset(
 	avr_int_table_p table = &avr->interrupts;
 
 	table->running_ptr = 0;
-	avr_int_pending_reset(&table->pending);
+	table->pending = 0;
 	avr->interrupt_state = 0;
 	for (int i = 0; i < table->vector_count; i++)
 		table->vector[i]->pending = 0;
@@ -66,10 +65,11 @@ avr_register_vector(
 
 	avr_int_table_p table = &avr->interrupts;
 
-	char name0[48], name1[48];
+	char name0[48], name1[48], name2[48];
 	sprintf(name0, ">avr.int.%02x.pending", vector->vector);
 	sprintf(name1, ">avr.int.%02x.running", vector->vector);
-	const char *names[2] = { name0, name1 };
+	sprintf(name2, ">avr.int.%02x.coalesced", vector->vector);
+	const char *names[3] = { name0, name1, name2 };
 	avr_init_irq(&avr->irq_pool, vector->irq,
 			vector->vector * 256, // base number
 			AVR_INT_IRQ_COUNT, names);
@@ -88,7 +88,15 @@ avr_has_pending_interrupts(
 		avr_t * avr)
 {
 	avr_int_table_p table = &avr->interrupts;
-	return !avr_int_pending_isempty(&table->pending);
+	return table->pending != 0;
+}
+
+// return the highest priority pending vector number, or zero if none
+static inline uint8_t
+avr_int_pending_first(
+		avr_int_table_p table)
+{
+	return table->pending ? __builtin_ctzll(table->pending) : 0;
 }
 
 int
@@ -114,11 +122,19 @@ avr_raise_interrupt(
 {
 	if (!vector || !vector->vector)
 		return 0;
+	if (vector->vector >= AVR_INT_MAX_VECTORS) {
+		AVR_LOG(avr, LOG_ERROR, "IRQ%d out of range!\n", vector->vector);
+		return 0;
+	}
 	if (vector->pending) {
 		if (vector->trace)
 			printf("IRQ%d:I=%d already raised (enabled %d) (cycle %lld pc 0x%x)\n",
 				vector->vector, !!avr->sreg[S_I], avr_regbit_get(avr, vector->enable),
 				(long long int)avr->cycle, avr->pc);
+		// let observers know this raise was coalesced into the pending one
+		avr_raise_irq(vector->irq + AVR_INT_IRQ_COALESCED, 1);
+		avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_COALESCED,
+				vector->vector);
 		return 0;
 	}
 	if (vector->trace)
@@ -140,7 +156,8 @@ avr_raise_interrupt(
 
 		avr_int_table_p table = &avr->interrupts;
 
-		avr_int_pending_write(&table->pending, vector);
+		table->pending_vector[vector->vector] = vector;
+		table->pending |= (uint64_t)1 << vector->vector;
 
 		if (avr->sreg[S_I] && avr->interrupt_state == 0)
 			avr->interrupt_state = 1;
@@ -165,13 +182,13 @@ avr_clear_interrupt(
 	if (vector->trace)
 		printf("IRQ%d cleared\n", vector->vector);
 	vector->pending = 0;
+	if (vector->vector < AVR_INT_MAX_VECTORS)
+		avr->interrupts.pending &= ~((uint64_t)1 << vector->vector);
 
 	avr_raise_irq(vector->irq + AVR_INT_IRQ_PENDING, 0);
 	avr_raise_irq_float(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr) ?
-					avr_int_pending_read_at(
-							&avr->interrupts.pending, 0)->vector : 0,
-							!avr_has_pending_interrupts(avr));
+			avr_int_pending_first(&avr->interrupts),
+			!avr_has_pending_interrupts(avr));
 
 	if (vector->raised.reg && !vector->raise_sticky)
 		avr_regbit_clear(avr, vector->raised);
@@ -244,31 +261,21 @@ avr_service_interrupts(
 
 	avr_int_table_p table = &avr->interrupts;
 
-	// how many are pending...
-	int cnt = avr_int_pending_get_read_size(&table->pending);
-	// locate the highest priority one
-	int min = 0xff;
-	int mini = 0;
-	for (int ii = 0; ii < cnt; ii++) {
-		avr_int_vector_t * v = avr_int_pending_read_at(&table->pending, ii);
-		if (v->vector < min) {
-			min = v->vector;
-			mini = ii;
-		}
+	// locate the highest priority one, ie the lowest vector number
+	avr_int_vector_t * vector =
+			table->pending_vector[avr_int_pending_first(table)];
+	if (!vector) {
+		avr->interrupt_state = 0;
+		return;
 	}
-	avr_int_vector_t * vector = avr_int_pending_read_at(&table->pending, mini);
-
-	// now move the one at the front of the fifo in the slot of
-	// the one we service
-	table->pending.buffer[(table->pending.read + mini) % avr_int_pending_fifo_size] =
-			avr_int_pending_read(&table->pending);
-	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr));
 
 	// if that single interrupt is masked, ignore it and continue
 	// could also have been disabled, or cleared
 	if (!avr_regbit_get(avr, vector->enable) || !vector->pending) {
 		vector->pending = 0;
+		table->pending &= ~((uint64_t)1 << vector->vector);
+		avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
+				avr_has_pending_interrupts(avr));
 		avr->interrupt_state = avr_has_pending_interrupts(avr);
 	} else {
 		if (vector && vector->trace)
@@ -24,7 +24,6 @@
 
 #include "sim_avr_types.h"
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +32,7 @@ extern "C" {
 enum {
 	AVR_INT_IRQ_PENDING = 0,
 	AVR_INT_IRQ_RUNNING,
+	AVR_INT_IRQ_COALESCED,	// raised again while already pending
 	AVR_INT_IRQ_COUNT,
 	AVR_INT_ANY		= 0xff,	// for avr_get_interrupt_irq()
 };
@@ -44,20 +44,23 @@ typedef struct avr_int_vector_t {
 
 	// 'pending' IRQ, and 'running' status as signaled here
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
-	uint8_t			pending : 1,	// 1 while scheduled in the fifo
+	uint8_t			pending : 1,	// 1 while set in the pending bitmap
 					trace : 1,		// only for debug of a vector
 					raise_sticky : 1;	// 1 if the interrupt flag (= the raised regbit) is not cleared
 										// by the hardware when executing the interrupt routine (see TWINT)
 } avr_int_vector_t, *avr_int_vector_p;
 
-// Size needs to be >= max number of vectors, and a power of two
-DECLARE_FIFO(avr_int_vector_p, avr_int_pending, 64);
+// Needs to be >= max number of vectors, pending bitmap is 64 bits
+#define AVR_INT_MAX_VECTORS	64
 
 // interrupt vectors, and their enable/clear registers
 typedef struct  avr_int_table_t {
-	avr_int_vector_t * vector[64];
+	avr_int_vector_t * vector[AVR_INT_MAX_VECTORS];
 	uint8_t			vector_count;
-	avr_int_pending_t pending;
+	// one bit per vector number, the lowest bit set has the highest priority
+	uint64_t		pending;
+	// pending vectors, indexed by vector number
+	avr_int_vector_t * pending_vector[AVR_INT_MAX_VECTORS];
 	uint8_t			running_ptr;
 	avr_int_vector_t *running[64]; // stack of nested interrupts
 	// global status for pending + running in interrupt context
@@ -119,7 +122,7 @@ void
 avr_interrupt_init(
 		struct avr_t * avr );
 
-// reset the interrupt table and the fifo
+// reset the interrupt table and the pending bitmap
 void
 avr_interrupt_reset(
 		struct avr_t * avr );
@@ -27,22 +27,103 @@
 #include <stdint.h>
 #include "sim_io.h"
 
-int
-avr_ioctl(
+/*
+ * Lookup index for the io modules. IRQ ioctls are known when the modules
+ * call avr_io_setirqs(), so they are indexed there. The other ioctls are
+ * only known by the modules themselves, so we remember which module
+ * answered to a given ioctl last, and try it first next time.
+ * Both are small open addressed hash tables; if they fill up, we just
+ * fall back to walking the module list.
+ */
+#define AVR_IO_INDEX_SIZE	128	// power of two
+
+typedef struct avr_io_index_entry_t {
+	uint32_t	ctl;
+	avr_io_t *	io;
+} avr_io_index_entry_t;
+
+typedef struct avr_io_index_t {
+	avr_io_index_entry_t irq[AVR_IO_INDEX_SIZE];
+	avr_io_index_entry_t ioctl[AVR_IO_INDEX_SIZE];
+} avr_io_index_t;
+
+static inline uint32_t
+avr_io_index_hash(
+		uint32_t ctl)
+{
+	return (ctl * 2654435761u) >> 25;
+}
+
+static avr_io_index_entry_t *
+avr_io_index_find(
+		avr_io_index_entry_t * table,
+		uint32_t ctl,
+		int create)
+{
+	uint32_t h = avr_io_index_hash(ctl);
+	for (int i = 0; i < AVR_IO_INDEX_SIZE; i++) {
+		avr_io_index_entry_t * e = &table[(h + i) & (AVR_IO_INDEX_SIZE - 1)];
+		if (e->io && e->ctl == ctl)
+			return e;
+		if (!e->io)
+			return create ? e : NULL;
+	}
+	return NULL;
+}
+
+static avr_io_index_t *
+avr_io_get_index(
+		avr_t * avr)
+{
+	if (!avr->io_index)
+		avr->io_index = calloc(1, sizeof(*avr->io_index));
+	return avr->io_index;
+}
+
+static int
+avr_ioctl_walk(
 		avr_t *avr,
 		uint32_t ctl,
-		void * io_param)
+		void * io_param,
+		avr_io_t ** responder)
 {
 	avr_io_t * port = avr->io_port;
 	int res = -1;
 	while (port && res == -1) {
 		if (port->ioctl)
 			res = port->ioctl(port, ctl, io_param);
+		if (res != -1)
+			*responder = port;
 		port = port->next;
 	}
 	return res;
 }
 
+int
+avr_ioctl(
+		avr_t *avr,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_io_index_t * index = avr_io_get_index(avr);
+	avr_io_index_entry_t * e = NULL;
+	if (index) {
+		e = avr_io_index_find(index->ioctl, ctl, 1);
+		if (e && e->io) {
+			int res = e->io->ioctl(e->io, ctl, io_param);
+			if (res != -1)
+				return res;
+		}
+	}
+	avr_io_t * responder = NULL;
+	int res = avr_ioctl_walk(avr, ctl, io_param, &responder);
+	if (e && responder) {
+		e->ctl = ctl;
+		e->io = responder;
+	}
+	return res;
+}
+
 void
 avr_register_io(
 		avr_t *avr,
@@ -51,6 +132,9 @@ avr_register_io(
 	io->next = avr->io_port;
 	io->avr = avr;
 	avr->io_port = io;
+	// the new module might answer ioctls first, forget what we learnt
+	if (avr->io_index)
+		memset(avr->io_index->ioctl, 0, sizeof(avr->io_index->ioctl));
 }
 
 void
@@ -61,6 +145,13 @@ avr_register_io_read(
 		void * param)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (a >= avr->io_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+				__func__, a, avr->io_count);
+		abort();
+	}
 	if (avr->io[a].r.param || avr->io[a].r.c) {
 		if (avr->io[a].r.param != param || avr->io[a].r.c != readp) {
 			AVR_LOG(avr, LOG_ERROR,
@@ -84,27 +175,49 @@ _avr_io_mux_write(
 		uint8_t v,
 		void * param)
 {
-	int io = (intptr_t)param;
-	for (int i = 0; i < avr->io_shared_io[io].used; i++) {
-		avr_io_write_t c = avr->io_shared_io[io].io[i].c;
-		if (c)
-			c(avr, addr, v, avr->io_shared_io[io].io[i].param);
+	avr_io_mux_t * mux = &avr->io_shared_io[(intptr_t)param];
+	/*
+	 * Masked callbacks own 'write one to clear' flags, so writing zero to
+	 * them is a no-op, even if they were set. Callbacks that own the whole
+	 * register are always called, as before.
+	 */
+	for (int i = 0; i < mux->used; i++)
+		if (mux->io[i].mask == 0xff || (v & mux->io[i].mask))
+			mux->io[i].c(avr, addr, v, mux->io[i].param);
+}
+
+static void
+_avr_io_mux_add(
+		avr_t * avr,
+		avr_io_mux_t * mux,
+		avr_io_write_t writep,
+		void * param,
+		uint8_t mask)
+{
+	if (mux->used == mux->size) {
+		mux->size = mux->size ? mux->size * 2 : 4;
+		mux->io = realloc(mux->io, mux->size * sizeof(mux->io[0]));
 	}
+	mux->io[mux->used].c = writep;
+	mux->io[mux->used].param = param;
+	mux->io[mux->used].mask = mask;
+	mux->used++;
 }
 
 void
-avr_register_io_write(
+avr_register_io_write_masked(
 		avr_t *avr,
 		avr_io_addr_t addr,
 		avr_io_write_t writep,
-		void * param)
+		void * param,
+		uint8_t mask)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
 
-	if (a >= MAX_IOs) {
+	if (a >= avr->io_count) {
 		AVR_LOG(avr, LOG_ERROR,
 				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
-				__func__, a, MAX_IOs);
+				__func__, a, avr->io_count);
 		abort();
 	}
 	/*
@@ -117,36 +230,66 @@ avr_register_io_write(
 			// if the muxer not already installed, allocate a new slot
 			if (avr->io[a].w.c != _avr_io_mux_write) {
 				int no = avr->io_shared_io_count++;
-				if (avr->io_shared_io_count > ARRAY_SIZE(avr->io_shared_io)) {
-					AVR_LOG(avr, LOG_ERROR,
-							"IO: %s(): Too many shared IO registers.\n", __func__);
-					abort();
-				}
+				avr->io_shared_io = realloc(avr->io_shared_io,
+						avr->io_shared_io_count * sizeof(avr->io_shared_io[0]));
 				AVR_LOG(avr, LOG_TRACE,
 						"IO: %s(%04x): Installing muxer on register.\n",
 						__func__, addr);
-				avr->io_shared_io[no].used = 1;
-				avr->io_shared_io[no].io[0].param = avr->io[a].w.param;
-				avr->io_shared_io[no].io[0].c = avr->io[a].w.c;
+				memset(&avr->io_shared_io[no], 0, sizeof(avr->io_shared_io[0]));
+				_avr_io_mux_add(avr, &avr->io_shared_io[no],
+						avr->io[a].w.c, avr->io[a].w.param, avr->io[a].w_mask);
 				avr->io[a].w.param = (void*)(intptr_t)no;
 				avr->io[a].w.c = _avr_io_mux_write;
 			}
 			int no = (intptr_t)avr->io[a].w.param;
-			int d = avr->io_shared_io[no].used++;
-			if (avr->io_shared_io[no].used > ARRAY_SIZE(avr->io_shared_io[0].io)) {
-				AVR_LOG(avr, LOG_ERROR,
-						"IO: %s(): Too many callbacks on %04x.\n",
-						__func__, addr);
-				abort();
-			}
-			avr->io_shared_io[no].io[d].param = param;
-			avr->io_shared_io[no].io[d].c = writep;
+			_avr_io_mux_add(avr, &avr->io_shared_io[no], writep, param, mask);
 			return;
 		}
 	}
 
 	avr->io[a].w.param = param;
 	avr->io[a].w.c = writep;
+	avr->io[a].w_mask = mask;
+}
+
+void
+avr_register_io_write(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t writep,
+		void * param)
+{
+	avr_register_io_write_masked(avr, addr, writep, param, 0xff);
+}
+
+void
+avr_unregister_io_write(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t writep,
+		void * param)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (a >= avr->io_count)
+		return;
+	if (avr->io[a].w.c == _avr_io_mux_write) {
+		avr_io_mux_t * mux = &avr->io_shared_io[(intptr_t)avr->io[a].w.param];
+		for (int i = 0; i < mux->used; i++) {
+			if (mux->io[i].c != writep || mux->io[i].param != param)
+				continue;
+			memmove(&mux->io[i], &mux->io[i + 1],
+					(mux->used - i - 1) * sizeof(mux->io[0]));
+			mux->used--;
+			return;
+		}
+		return;
+	}
+	if (avr->io[a].w.c == writep && avr->io[a].w.param == param) {
+		avr->io[a].w.c = NULL;
+		avr->io[a].w.param = NULL;
+		avr->io[a].w_mask = 0;
+	}
 }
 
 avr_irq_t *
@@ -155,6 +298,11 @@ avr_io_getirq(
 		uint32_t ctl,
 		int index)
 {
+	if (avr->io_index) {
+		avr_io_index_entry_t * e = avr_io_index_find(avr->io_index->irq, ctl, 0);
+		if (e && e->io->irq && e->io->irq_count > index)
+			return e->io->irq + index;
+	}
 	avr_io_t * port = avr->io_port;
 	while (port) {
 		if (port->irq && port->irq_ioctl_get == ctl && port->irq_count > index)
@@ -174,6 +322,12 @@ avr_iomem_getirq(
 	if (index > 8)
 		return NULL;
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	if (a >= avr->io_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+				__func__, a, avr->io_count);
+		return NULL;
+	}
 	if (avr->io[a].irq == NULL) {
 		/*
 		 * Prepare an array of names for the io IRQs. Ideally we'd love to have
@@ -268,6 +422,15 @@ avr_io_setirqs(
 
 	io->irq = irqs;
 	io->irq_ioctl_get = ctl;
+	if (io->avr) {
+		avr_io_index_t * index = avr_io_get_index(io->avr);
+		avr_io_index_entry_t * e = index ?
+				avr_io_index_find(index->irq, ctl, 1) : NULL;
+		if (e) {
+			e->ctl = ctl;
+			e->io = io;
+		}
+	}
 	return io->irq;
 }
 
@@ -295,4 +458,12 @@ avr_deallocate_ios(
 		port = next;
 	}
 	avr->io_port = NULL;
+	free(avr->io_index);
+	avr->io_index = NULL;
+
+	for (int i = 0; i < avr->io_shared_io_count; i++)
+		free(avr->io_shared_io[i].io);
+	free(avr->io_shared_io);
+	avr->io_shared_io = NULL;
+	avr->io_shared_io_count = 0;
 }
@@ -92,6 +92,26 @@ avr_register_io_write(
 		avr_io_addr_t addr,
 		avr_io_write_t write,
 		void * param);
+/*
+ * Same as avr_register_io_write(), but for modules that only own some
+ * 'write one to clear' flag bits of the register, like the timers in a
+ * shared TIFR. If the register is shared, the callback is only called when
+ * one of the 'mask' bits is written to one.
+ */
+void
+avr_register_io_write_masked(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t write,
+		void * param,
+		uint8_t mask);
+// removes a callback registered with avr_register_io_write(), if it is
+void
+avr_unregister_io_write(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t write,
+		void * param);
 // call every IO modules until one responds to this
 int
 avr_ioctl(
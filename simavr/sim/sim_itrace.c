@@ -0,0 +1,215 @@
+/*
+	sim_itrace.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_itrace.h"
+#include "sim_writer.h"
+
+#define LOG_PREFIX		"ITRACE: "
+
+// used when the trace is started without having been set up first
+#define AVR_ITRACE_DEFAULT_FILE	"simavr.itrace"
+
+static void
+_avr_itrace_header(
+		avr_itrace_t * t,
+		avr_itrace_header_t * h)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, AVR_ITRACE_MAGIC, sizeof(h->magic));
+	h->version = AVR_ITRACE_VERSION;
+	h->rec_size = sizeof(avr_itrace_rec_t);
+	h->endian = 0x01020304;
+	h->frequency = t->avr->frequency;
+	if (t->avr->mmcu)
+		strncpy(h->mmcu, t->avr->mmcu, sizeof(h->mmcu) - 1);
+}
+
+// writes the records [t->saved, t->count) that are still in the ring
+static void
+_avr_itrace_write(
+		avr_itrace_t * t)
+{
+	uint64_t from = t->saved;
+	if (t->count - from > t->size)
+		from = t->count - t->size;	// overwritten
+	while (from < t->count) {
+		uint32_t index = from & (t->size - 1);
+		uint64_t n = t->size - index;
+		if (n > t->count - from)
+			n = t->count - from;
+		avr_writer_write(t->output, &t->ring[index], n * sizeof(t->ring[0]));
+		from += n;
+	}
+	t->saved = t->count;
+}
+
+int
+avr_itrace_init(
+		avr_t * avr,
+		const char * filename,
+		uint32_t ring_size,
+		int stream)
+{
+	if (avr->itrace)
+		avr_itrace_dispose(avr);
+
+	avr_itrace_t * t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->avr = avr;
+	t->stream = stream;
+	t->size = 1;
+	while (t->size < (ring_size ? ring_size : AVR_ITRACE_RING_SIZE))
+		t->size <<= 1;
+	t->filename = strdup(filename);
+	t->ring = malloc(t->size * sizeof(t->ring[0]));
+	if (!t->filename || !t->ring)
+		goto error;
+	if (stream) {
+		t->output = avr_writer_open(filename);
+		if (!t->output) {
+			perror(filename);
+			goto error;
+		}
+		avr_itrace_header_t h;
+		_avr_itrace_header(t, &h);
+		avr_writer_write(t->output, &h, sizeof(h));
+	}
+	avr->itrace = t;
+	AVR_LOG(avr, LOG_TRACE, LOG_PREFIX "%s: %u records, %s\n",
+			filename, t->size, stream ? "streaming" : "ring");
+	return 0;
+error:
+	free(t->filename);
+	free(t->ring);
+	free(t);
+	return -1;
+}
+
+void
+avr_itrace_enable(
+		avr_t * avr,
+		int on)
+{
+	if (on && !avr->itrace) {
+		AVR_LOG(avr, LOG_WARNING,
+				LOG_PREFIX "no trace file set, using " AVR_ITRACE_DEFAULT_FILE "\n");
+		if (avr_itrace_init(avr, AVR_ITRACE_DEFAULT_FILE, 0, 1))
+			return;
+	}
+	avr->itrace_on = on && avr->itrace;
+}
+
+int
+avr_itrace_save(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace;
+	if (!t)
+		return -1;
+	if (t->stream) {
+		_avr_itrace_write(t);
+		avr_writer_flush(t->output);
+		return t->output->error ? -1 : 0;
+	}
+	// the ring is all there is, rewrite the whole file
+	t->output = avr_writer_open(t->filename);
+	if (!t->output) {
+		perror(t->filename);
+		return -1;
+	}
+	avr_itrace_header_t h;
+	_avr_itrace_header(t, &h);
+	avr_writer_write(t->output, &h, sizeof(h));
+	t->saved = 0;
+	_avr_itrace_write(t);
+	int res = t->output->error ? -1 : 0;
+	avr_writer_close(t->output);
+	t->output = NULL;
+	return res;
+}
+
+void
+avr_itrace_dispose(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace;
+	if (!t)
+		return;
+	avr_itrace_save(avr);
+	if (t->output)
+		avr_writer_close(t->output);
+	AVR_LOG(avr, LOG_TRACE, LOG_PREFIX "%s: %llu instructions traced\n",
+			t->filename, (unsigned long long)t->count);
+	avr->itrace_on = 0;
+	avr->itrace = NULL;
+	free(t->filename);
+	free(t->ring);
+	free(t);
+}
+
+avr_flashaddr_t
+avr_itrace_run_one(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace;
+	avr_itrace_rec_t * r = &t->ring[t->count & (t->size - 1)];
+	uint8_t regs[32];
+
+	memcpy(regs, avr->data, sizeof(regs));
+	r->cycle = avr->cycle;
+	r->pc = avr->pc;
+	r->opcode = avr->pc + 1 <= avr->flashend ?
+			avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8) : 0;
+
+	avr_flashaddr_t new_pc = avr_run_one(avr);
+	/* the instruction might have disposed of the trace, via a command */
+	if (avr->itrace != t)
+		return new_pc;
+
+	uint32_t touched = 0;
+	int vi = 0;
+	for (int i = 0; i < 32; i++) {
+		if (regs[i] == avr->data[i])
+			continue;
+		touched |= 1u << i;
+		if (vi < 3)
+			r->value[vi++] = avr->data[i];
+	}
+	while (vi < 3)
+		r->value[vi++] = 0;
+	r->touched = touched;
+	r->sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+	uint8_t sreg = 0;
+	for (int i = 0; i < 8; i++)
+		sreg |= !!avr->sreg[i] << i;
+	r->sreg = sreg;
+
+	t->count++;
+	if (t->stream && t->count - t->saved == t->size)
+		_avr_itrace_write(t);
+	return new_pc;
+}
@@ -0,0 +1,124 @@
+/*
+	sim_itrace.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary instruction trace.
+ *
+ * Unlike the CONFIG_SIMAVR_TRACE printf() trace, this one is always compiled
+ * in and can be switched on and off at runtime: from run_avr (--itrace), from
+ * gdb ("monitor itrace on|off|save") or from the firmware, using the
+ * SIMAVR_CMD_ITRACE_START/STOP commands. When off, the only cost is a test of
+ * avr->itrace_on per instruction.
+ *
+ * Each instruction executed is recorded as a fixed size avr_itrace_rec_t in
+ * a ring buffer. Registers are compared before and after the instruction,
+ * so one written with the value it already had doesn't show.
+ *
+ * In 'stream' mode the ring is appended to the file every time it fills
+ * up, otherwise it only keeps the last instructions, like a flight
+ * recorder, and these are written when the trace is saved or the AVR is
+ * terminated.
+ *
+ * The file is a avr_itrace_header_t followed by the records, in host byte
+ * order; trace_avr decodes it and symbolizes it with the firmware's ELF.
+ */
+#ifndef __SIM_ITRACE_H__
+#define __SIM_ITRACE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_ITRACE_MAGIC		"SIMAVRIT"
+#define AVR_ITRACE_VERSION		1
+#define AVR_ITRACE_RING_SIZE	(64 * 1024)	// default, in records
+
+typedef struct avr_itrace_header_t {
+	char		magic[8];	// AVR_ITRACE_MAGIC
+	uint16_t	version;
+	uint16_t	rec_size;	// sizeof(avr_itrace_rec_t)
+	uint32_t	endian;		// 0x01020304, in the writer's byte order
+	uint32_t	frequency;
+	uint32_t	reserved;
+	char		mmcu[32];
+} avr_itrace_header_t;
+
+typedef struct avr_itrace_rec_t {
+	uint64_t	cycle;		// when the instruction started
+	uint32_t	pc;			// byte address
+	uint32_t	touched;	// one bit per general purpose register changed
+	uint16_t	opcode;		// first word of the instruction
+	uint16_t	sp;			// after the instruction
+	uint8_t		sreg;		// after the instruction
+	uint8_t		value[3];	// new value of the first three changed registers
+} avr_itrace_rec_t;
+
+typedef struct avr_itrace_t {
+	struct avr_t *		avr;
+	char *				filename;
+	int					stream;		// append the ring to the file when full
+	uint32_t			size;		// records in 'ring', power of two
+	uint64_t			count;		// records written to 'ring' so far
+	uint64_t			saved;		// records written to the file so far
+	avr_itrace_rec_t *	ring;
+	struct avr_writer_t * output;	// open while streaming
+} avr_itrace_t;
+
+/*
+ * Allocates the trace for 'avr', trace is not started. 'ring_size' is
+ * rounded to a power of two, zero picks AVR_ITRACE_RING_SIZE. Returns
+ * zero if all is well.
+ */
+int
+avr_itrace_init(
+		struct avr_t * avr,
+		const char * filename,
+		uint32_t ring_size,
+		int stream);
+// Starts, or stops, recording instructions. Initializes a default trace if needed
+void
+avr_itrace_enable(
+		struct avr_t * avr,
+		int on);
+/*
+ * Writes the records to the file; in stream mode, this flushes what is
+ * in the ring, otherwise the file is rewritten with the ring's content.
+ */
+int
+avr_itrace_save(
+		struct avr_t * avr);
+// Saves the trace, and frees it. Called by avr_terminate()
+void
+avr_itrace_dispose(
+		struct avr_t * avr);
+
+// private, called by the run loops in place of avr_run_one() when tracing
+avr_flashaddr_t
+avr_itrace_run_one(
+		struct avr_t * avr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ITRACE_H__ */
@@ -0,0 +1,462 @@
+/*
+	sim_log_async.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_log_async.h"
+
+enum {
+	ARG_NONE = 0,	// %%
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_DOUBLE,
+	ARG_LDOUBLE,
+	ARG_PTR,
+	ARG_STR,
+	ARG_BAD,		// anything else, the poster formats the message itself
+};
+
+typedef struct avr_log_spec_t {
+	const char *	start;	// the '%'
+	int				len;
+	int				stars;	// '*' width and/or precision
+	int				prec;	// -1 if none, -2 if it's the last star
+	int				type;
+} avr_log_spec_t;
+
+/*
+ * Parses the conversion at 'f' (a '%'), returns what follows it.
+ */
+static const char *
+_avr_log_spec(
+		const char * f,
+		avr_log_spec_t * s)
+{
+	char length = 0;
+
+	s->start = f++;
+	s->stars = 0;
+	s->prec = -1;
+	while (*f && strchr("-+ #0'", *f))
+		f++;
+	if (*f == '*') {
+		s->stars++;
+		f++;
+	} else while (*f >= '0' && *f <= '9')
+		f++;
+	if (*f == '.') {
+		f++;
+		if (*f == '*') {
+			s->stars++;
+			s->prec = -2;
+			f++;
+		} else for (s->prec = 0; *f >= '0' && *f <= '9'; f++)
+			s->prec = s->prec * 10 + *f - '0';
+	}
+	switch (*f) {
+		case 'h':
+			f += f[1] == 'h' ? 2 : 1;
+			break;
+		case 'l':
+			if (f[1] == 'l') {
+				length = 'q';
+				f += 2;
+			} else
+				length = *f++;
+			break;
+		case 'q': case 'L': case 'z':
+		case 'j': case 't':
+			length = *f++;
+			break;
+	}
+	char conv = *f;
+	if (conv)
+		f++;
+	s->len = f - s->start;
+
+	switch (conv) {
+		case '%':
+			s->type = ARG_NONE;
+			break;
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			s->type = length == 'l' ? ARG_LONG :
+						length == 'q' ? ARG_LLONG :
+						length == 'z' ? ARG_SIZE :
+						length == 0 ? ARG_INT : ARG_BAD;
+			break;
+		case 'c':
+			s->type = length == 0 ? ARG_INT : ARG_BAD;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			s->type = length == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+			break;
+		case 'p':
+			s->type = ARG_PTR;
+			break;
+		case 's':
+			s->type = length == 0 ? ARG_STR : ARG_BAD;
+			break;
+		default:	// %n, wide chars, unterminated...
+			s->type = ARG_BAD;
+	}
+	return f;
+}
+
+/*
+ * Copies the arguments of 'format' into 'm', returns zero if the message
+ * can't be deferred and needs to be formatted now.
+ */
+static int
+_avr_log_capture(
+		avr_log_msg_t * m,
+		const char * format,
+		va_list ap)
+{
+	avr_log_spec_t s;
+
+	m->count = m->len = 0;
+	for (const char * f = format; (f = strchr(f, '%')); ) {
+		f = _avr_log_spec(f, &s);
+		if (s.type == ARG_BAD)
+			return 0;
+		if (s.type == ARG_NONE)
+			continue;
+		if (m->count + s.stars >= AVR_LOG_ASYNC_ARGS)
+			return 0;
+		int prec = s.prec;
+		for (int i = 0; i < s.stars; i++)
+			prec = m->arg[m->count++].i = va_arg(ap, int);
+		if (s.prec != -2)
+			prec = s.prec;
+		avr_log_arg_t * a = &m->arg[m->count++];
+		switch (s.type) {
+			case ARG_INT: a->i = va_arg(ap, int); break;
+			case ARG_LONG: a->l = va_arg(ap, long); break;
+			case ARG_LLONG: a->ll = va_arg(ap, long long); break;
+			case ARG_SIZE: a->z = va_arg(ap, size_t); break;
+			case ARG_DOUBLE: a->d = va_arg(ap, double); break;
+			case ARG_LDOUBLE: a->ld = va_arg(ap, long double); break;
+			case ARG_PTR: a->p = va_arg(ap, void *); break;
+			case ARG_STR: {
+				const char * str = va_arg(ap, const char *);
+				if (!str)
+					str = "(null)";
+				// with a precision, the string doesn't need a terminator
+				size_t l = prec >= 0 ? strnlen(str, prec) : strlen(str);
+				if (m->len + l + 1 > AVR_LOG_ASYNC_STRINGS)
+					return 0;
+				memcpy(m->strings + m->len, str, l);
+				m->strings[m->len + l] = 0;
+				a->s = m->len;
+				m->len += l + 1;
+			}	break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Formats a captured message in 'out', the inverse of _avr_log_capture().
+ * Returns non zero if it didn't fit in 'size' bytes, and was cut.
+ */
+static int
+_avr_log_format(
+		avr_log_msg_t * m,
+		char * out,
+		size_t size)
+{
+	avr_log_spec_t s;
+	char spec[32];
+	size_t pos = 0;
+	int ai = 0, cut = 0;
+	const char * f = m->format;
+
+	while (*f && !cut) {
+		if (pos == size - 1) {
+			cut = 1;
+			break;
+		}
+		const char * next = strchr(f, '%');
+		size_t l = next ? (size_t)(next - f) : strlen(f);
+		if (l) {
+			if (l > size - 1 - pos) {
+				l = size - 1 - pos;
+				cut = 1;
+			}
+			memcpy(out + pos, f, l);
+			pos += l;
+			f += l;
+			continue;
+		}
+		f = _avr_log_spec(f, &s);
+		if (s.type == ARG_NONE) {
+			out[pos++] = '%';
+			continue;
+		}
+		if (s.len >= (int)sizeof(spec))
+			break;
+		memcpy(spec, s.start, s.len);
+		spec[s.len] = 0;
+		int star[2] = { 0, 0 };
+		for (int i = 0; i < s.stars; i++)
+			star[i] = m->arg[ai++].i;
+		avr_log_arg_t * a = &m->arg[ai++];
+		char * dst = out + pos;
+		size_t room = size - pos;
+		int n = 0;
+#define _EMIT(_v) \
+		switch (s.stars) { \
+			case 0: n = snprintf(dst, room, spec, _v); break; \
+			case 1: n = snprintf(dst, room, spec, star[0], _v); break; \
+			default: n = snprintf(dst, room, spec, star[0], star[1], _v); break; \
+		}
+		switch (s.type) {
+			case ARG_INT: _EMIT(a->i); break;
+			case ARG_LONG: _EMIT(a->l); break;
+			case ARG_LLONG: _EMIT(a->ll); break;
+			case ARG_SIZE: _EMIT(a->z); break;
+			case ARG_DOUBLE: _EMIT(a->d); break;
+			case ARG_LDOUBLE: _EMIT(a->ld); break;
+			case ARG_PTR: _EMIT(a->p); break;
+			case ARG_STR: _EMIT(m->strings + a->s); break;
+		}
+#undef _EMIT
+		if (n < 0)
+			break;
+		if ((size_t)n >= room) {
+			n = room - 1;
+			cut = 1;
+		}
+		pos += n;
+	}
+	out[pos] = 0;
+	return cut;
+}
+
+static void *
+avr_log_async_thread(
+		void * param)
+{
+	avr_log_queue_t * q = param;
+	char buf[1024];
+	// grows for the long messages, so none gets cut
+	char * out = buf;
+	size_t size = sizeof(buf);
+
+	for (;;) {
+		int written = 0;
+		for (;;) {
+			avr_log_msg_t * m = &q->msg[q->read & (q->size - 1)];
+			if (__atomic_load_n(&m->seq, __ATOMIC_ACQUIRE) != q->read + 1)
+				break;
+			while (m->format && _avr_log_format(m, out, size)) {
+				char * o = malloc(size * 2);
+				if (!o)
+					break;	// out of memory, keep what fit
+				if (out != buf)
+					free(out);
+				out = o;
+				size *= 2;
+			}
+			fputs(m->format ? out : m->heap ? m->heap : m->strings,
+					m->level > LOG_ERROR ? stdout : stderr);
+			free(m->heap);
+			m->heap = NULL;
+			// give the slot back to the producers
+			__atomic_store_n(&m->seq, q->read + q->size, __ATOMIC_RELEASE);
+			__atomic_store_n(&q->read, q->read + 1, __ATOMIC_RELEASE);
+			written++;
+		}
+		if (written) {
+			uint32_t dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+			if (dropped != q->reported) {
+				fprintf(stderr, "simavr: %u log messages dropped\n",
+						dropped - q->reported);
+				q->reported = dropped;
+			}
+			fflush(stdout);
+			fflush(stderr);
+		}
+		pthread_mutex_lock(&q->lock);
+		__atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int idle = __atomic_load_n(&q->msg[q->read & (q->size - 1)].seq,
+				__ATOMIC_ACQUIRE) != q->read + 1;
+		if (idle && __atomic_load_n(&q->quit, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		if (idle)
+			pthread_cond_wait(&q->cond, &q->lock);
+		__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->lock);
+	}
+	if (out != buf)
+		free(out);
+	return NULL;
+}
+
+/*
+ * Same bounded MPSC ring as sim_async.c, other threads than the simulation
+ * one are allowed to log.
+ */
+void
+avr_log_async_post(
+		avr_log_queue_t * q,
+		int level,
+		const char * format,
+		va_list ap)
+{
+	avr_log_msg_t * m;
+	uint32_t pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+	for (;;) {
+		m = &q->msg[pos & (q->size - 1)];
+		uint32_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->write, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {	// full
+			__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else
+			pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+	}
+	va_list cp;
+	va_copy(cp, ap);
+	m->level = level;
+	m->format = format;
+	m->heap = NULL;
+	if (!_avr_log_capture(m, format, cp)) {
+		va_end(cp);
+		va_copy(cp, ap);
+		m->format = NULL;
+		int n = vsnprintf(m->strings, sizeof(m->strings), format, ap);
+		// too long for the slot; if out of memory, keep what fit
+		if (n >= (int)sizeof(m->strings)) {
+			m->heap = malloc(n + 1);
+			if (m->heap)
+				vsnprintf(m->heap, n + 1, format, cp);
+		}
+	}
+	va_end(cp);
+	__atomic_store_n(&m->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in the logging thread */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int
+avr_log_async_init(
+		avr_t * avr,
+		uint32_t size)
+{
+	if (avr->log_queue)
+		return 0;
+	if (!size)
+		size = AVR_LOG_ASYNC_SIZE;
+	uint32_t s = 1;
+	while (s < size)
+		s <<= 1;
+
+	avr_log_queue_t * q = calloc(1, sizeof(*q));
+	if (!q)
+		return -1;
+	q->size = s;
+	q->msg = malloc(s * sizeof(q->msg[0]));
+	if (!q->msg) {
+		free(q);
+		return -1;
+	}
+	for (uint32_t i = 0; i < s; i++) {
+		q->msg[i].seq = i;
+		q->msg[i].heap = NULL;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	if (pthread_create(&q->thread, NULL, avr_log_async_thread, q)) {
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->cond);
+		free(q->msg);
+		free(q);
+		return -1;
+	}
+	avr->log_queue = q;
+	return 0;
+}
+
+void
+avr_log_async_flush(
+		avr_t * avr)
+{
+	avr_log_queue_t * q = avr->log_queue;
+	if (!q)
+		return;
+	uint32_t target = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+	while ((int32_t)(__atomic_load_n(&q->read, __ATOMIC_ACQUIRE) - target) < 0)
+		usleep(100);
+	fflush(stdout);
+	fflush(stderr);
+}
+
+void
+avr_log_async_release(
+		avr_t * avr)
+{
+	avr_log_queue_t * q = avr->log_queue;
+	if (!q)
+		return;
+	pthread_mutex_lock(&q->lock);
+	__atomic_store_n(&q->quit, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+	// back to synchronous, for whatever gets logged from now on
+	avr->log_queue = NULL;
+
+	if (q->dropped != q->reported)
+		fprintf(stderr, "simavr: %u log messages dropped\n",
+				q->dropped - q->reported);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->msg);
+	free(q);
+}
+
+uint32_t
+avr_log_async_dropped(
+		avr_t * avr)
+{
+	avr_log_queue_t * q = avr->log_queue;
+	return q ? __atomic_load_n(&q->dropped, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,134 @@
+/*
+	sim_log_async.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous backend for the default logger.
+ *
+ * When enabled on an AVR instance, AVR_LOG() no longer formats anything:
+ * the format pointer and the raw arguments are copied into a per-instance
+ * ring, and a background thread does the formatting and the stdio calls.
+ * String arguments are copied too, up to their precision if they have one
+ * ("%.*s" of a buffer that isn't terminated); when they don't fit in the
+ * message, it is formatted by the poster instead, in heap storage if it's
+ * too long for the slot. Nothing is truncated. The format itself is only
+ * kept as a pointer, so it must outlive the message, until the background
+ * thread has written it -- AVR_LOG() formats are all literals, don't pass
+ * a format that was built in a buffer.
+ *
+ * Posting is lock free and never blocks; when the ring is full, messages
+ * are dropped and counted, and the count is reported on stderr once the
+ * backlog is written.
+ *
+ * Custom loggers (see avr_global_logger_set()) are not affected, they
+ * still get called synchronously.
+ */
+#ifndef __SIM_LOG_ASYNC_H__
+#define __SIM_LOG_ASYNC_H__
+
+#include <stdarg.h>
+#include <pthread.h>
+#include "sim_avr_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_LOG_ASYNC_SIZE		1024	// default number of messages
+#define AVR_LOG_ASYNC_ARGS		12
+#define AVR_LOG_ASYNC_STRINGS	192		// bytes, for all the %s of a message
+
+typedef union avr_log_arg_t {
+	int					i;
+	long				l;
+	long long			ll;
+	size_t				z;
+	double				d;
+	long double			ld;
+	const void *		p;
+	uint16_t			s;		// offset of a string in 'strings'
+} avr_log_arg_t;
+
+typedef struct avr_log_msg_t {
+	uint32_t			seq;	// slot sequence, used for synchronization
+	uint8_t				level;
+	uint8_t				count;	// arguments
+	uint16_t			len;	// bytes used in 'strings'
+	// NULL if the message was formatted by the poster, in 'strings', or
+	// in 'heap' if it didn't fit there
+	const char *		format;
+	char *				heap;
+	avr_log_arg_t		arg[AVR_LOG_ASYNC_ARGS];
+	char				strings[AVR_LOG_ASYNC_STRINGS];
+} avr_log_msg_t;
+
+typedef struct avr_log_queue_t {
+	avr_log_msg_t *		msg;	// ring
+	uint32_t			size;	// power of two
+	uint32_t			write;	// producers cursor
+	uint32_t			read;	// consumer cursor
+	uint32_t			dropped;	// messages lost, ring was full
+	uint32_t			reported;	// dropped count already reported
+
+	int					quit;
+	int					sleeping;	// thread waits on 'cond'
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} avr_log_queue_t;
+
+/*
+ * Starts the logging thread for 'avr', with a ring of 'size' messages
+ * (rounded up to a power of two, zero means AVR_LOG_ASYNC_SIZE).
+ * Returns zero if all is well; logging stays synchronous otherwise.
+ */
+int
+avr_log_async_init(
+		struct avr_t * avr,
+		uint32_t size);
+// Waits for all the messages posted so far to be written
+void
+avr_log_async_flush(
+		struct avr_t * avr);
+// Writes the backlog, and stops the thread. Called by avr_terminate()
+void
+avr_log_async_release(
+		struct avr_t * avr);
+// Returns the number of messages dropped so far
+uint32_t
+avr_log_async_dropped(
+		struct avr_t * avr);
+
+/*
+ * private, called by the default logger. 'format' is captured as a
+ * pointer, and used later by the background thread.
+ */
+void
+avr_log_async_post(
+		avr_log_queue_t * q,
+		int level,
+		const char * format,
+		va_list ap);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LOG_ASYNC_H__ */
@@ -0,0 +1,513 @@
+/*
+	sim_profile.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+
+#define LOG_PREFIX		"PROFILE: "
+
+static inline uint16_t
+_avr_profile_sp(
+		avr_t * avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static inline uint32_t
+_avr_profile_hash(
+		uint32_t site,
+		uint32_t callee)
+{
+	return (site * 2654435761u) ^ (callee * 40503u);
+}
+
+// returns the edge for site/callee, or the empty slot for it
+static avr_profile_edge_t *
+_avr_profile_find(
+		avr_profile_t * p,
+		uint32_t site,
+		uint32_t callee)
+{
+	uint32_t mask = p->edge_size - 1;
+	for (uint32_t h = _avr_profile_hash(site, callee); ; h++) {
+		avr_profile_edge_t * e = &p->edge[h & mask];
+		if (!e->calls || (e->site == site && e->callee == callee))
+			return e;
+	}
+}
+
+static avr_profile_edge_t *
+_avr_profile_get(
+		avr_profile_t * p,
+		uint32_t site,
+		uint32_t callee)
+{
+	if (2 * (p->edge_count + 1) > p->edge_size) {
+		avr_profile_t n = { .edge_size = p->edge_size * 2 };
+		n.edge = calloc(n.edge_size, sizeof(n.edge[0]));
+		if (!n.edge)
+			return NULL;
+		for (uint32_t i = 0; i < p->edge_size; i++)
+			if (p->edge[i].calls)
+				*_avr_profile_find(&n, p->edge[i].site, p->edge[i].callee) =
+						p->edge[i];
+		free(p->edge);
+		p->edge = n.edge;
+		p->edge_size = n.edge_size;
+	}
+	avr_profile_edge_t * e = _avr_profile_find(p, site, callee);
+	if (!e->calls) {
+		e->site = site;
+		e->callee = callee;
+		p->edge_count++;
+	}
+	return e;
+}
+
+static void
+_avr_profile_call(
+		avr_profile_t * p,
+		uint32_t site,
+		uint32_t callee,
+		int interrupt)
+{
+	avr_profile_edge_t * e = _avr_profile_get(p, site, callee);
+	if (!e)
+		return;
+	e->calls++;
+	e->interrupt = interrupt;
+	if (p->depth == AVR_PROFILE_MAX_DEPTH) {
+		p->overflow++;
+		return;
+	}
+	p->stack[p->depth].site = site;
+	p->stack[p->depth].callee = callee;
+	p->stack[p->depth].sp = _avr_profile_sp(p->avr);
+	p->stack[p->depth].entry = p->avr->cycle;
+	p->depth++;
+}
+
+// closes all the frames the stack pointer has gone past
+static void
+_avr_profile_return(
+		avr_profile_t * p)
+{
+	uint16_t sp = _avr_profile_sp(p->avr);
+
+	while (p->depth && p->stack[p->depth - 1].sp < sp) {
+		p->depth--;
+		avr_profile_edge_t * e = _avr_profile_find(p,
+				p->stack[p->depth].site, p->stack[p->depth].callee);
+		e->inclusive += p->avr->cycle - p->stack[p->depth].entry;
+	}
+}
+
+/*
+ * The pc is not where the last instruction said it would go; if the
+ * address it was supposed to go to has just been pushed, this is an
+ * interrupt. Otherwise it's a reset or a debugger, and the call stack
+ * is dropped when going back to the reset vector.
+ */
+static void
+_avr_profile_jump(
+		avr_profile_t * p,
+		avr_flashaddr_t pc)
+{
+	avr_t * avr = p->avr;
+	uint16_t sp = _avr_profile_sp(avr);
+	avr_flashaddr_t ret = 0;
+
+	if (sp + avr->address_size <= avr->ramend) {
+		for (int i = 1; i <= avr->address_size; i++)
+			ret = (ret << 8) | avr->data[sp + i];
+		if ((ret << 1) == p->next_pc) {
+			_avr_profile_call(p, p->last_pc, pc, 1);
+			return;
+		}
+	}
+	if (pc == avr->reset_pc)
+		p->depth = 0;
+}
+
+static void
+_avr_profile_flow(
+		avr_profile_t * p,
+		avr_flashaddr_t pc,
+		avr_flashaddr_t new_pc)
+{
+	avr_t * avr = p->avr;
+	uint16_t opcode = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+
+	if ((opcode & 0xfe0e) == 0x940e ||	// CALL
+			(opcode & 0xf000) == 0xd000 ||	// RCALL
+			opcode == 0x9509 || opcode == 0x9519)	// ICALL, EICALL
+		_avr_profile_call(p, pc, new_pc, 0);
+	else if (opcode == 0x9508 || opcode == 0x9518)	// RET, RETI
+		_avr_profile_return(p);
+}
+
+avr_flashaddr_t
+avr_profile_run_one(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	avr_flashaddr_t pc = avr->pc;
+	avr_cycle_count_t start = avr->cycle;
+
+	if (unlikely(pc >= avr->flashend))	// will crash
+		return avr_run_one(avr);
+	// sleeping and interrupt entry, charged to the previous instruction
+	p->self[p->last_pc >> 1] += start - p->last_cycle;
+	if (unlikely(pc != p->next_pc))
+		_avr_profile_jump(p, pc);
+
+	avr_flashaddr_t new_pc = avr->itrace_on ?
+			avr_itrace_run_one(avr) : avr_run_one(avr);
+	if (avr->profile != p)
+		return new_pc;
+
+	p->self[pc >> 1] += avr->cycle - start;
+	if (new_pc != pc + 2)
+		_avr_profile_flow(p, pc, new_pc);
+	p->last_pc = pc;
+	p->next_pc = new_pc;
+	p->last_cycle = avr->cycle;
+	return new_pc;
+}
+
+int
+avr_profile_init(
+		avr_t * avr,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount)
+{
+	avr_profile_dispose(avr);
+
+	avr_profile_t * p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
+	p->avr = avr;
+	p->size = (avr->flashend + 1) / 2;
+	p->self = calloc(p->size, sizeof(p->self[0]));
+	p->edge_size = 256;
+	p->edge = calloc(p->edge_size, sizeof(p->edge[0]));
+	if (!p->self || !p->edge) {
+		free(p->self);
+		free(p->edge);
+		free(p);
+		return -1;
+	}
+	p->symbol = symbol;
+	p->symbolcount = symbolcount;
+	avr->profile = p;
+	avr_profile_enable(avr, 1);
+	return 0;
+}
+
+void
+avr_profile_enable(
+		avr_t * avr,
+		int on)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	if (on && !avr->profile_on) {
+		p->last_pc = p->next_pc = avr->pc;
+		p->last_cycle = avr->cycle;
+	}
+	avr->profile_on = on;
+}
+
+void
+avr_profile_dispose(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	avr->profile_on = 0;
+	avr->profile = NULL;
+	free(p->self);
+	free(p->edge);
+	free(p);
+}
+
+/*
+ * Report helpers; functions are built from the symbols, the call targets,
+ * and address zero so every pc belongs to one.
+ */
+typedef struct avr_profile_fn_t {
+	uint32_t		addr;
+	const char *	name;	// NULL for unnamed ones
+	uint8_t			vector;	// interrupt target, named after its vector
+	uint64_t		self, inclusive, calls;
+} avr_profile_fn_t;
+
+static int
+_avr_profile_fn_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_fn_t * fa = a, * fb = b;
+	if (fa->addr != fb->addr)
+		return fa->addr < fb->addr ? -1 : 1;
+	return (fb->name != NULL) - (fa->name != NULL);	// named first
+}
+
+static int
+_avr_profile_edge_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_edge_t * ea = a, * eb = b;
+	if (ea->site != eb->site)
+		return ea->site < eb->site ? -1 : 1;
+	return ea->callee < eb->callee ? -1 : ea->callee > eb->callee;
+}
+
+static int
+_avr_profile_fn_find(
+		avr_profile_fn_t * fn,
+		int count,
+		uint32_t addr)
+{
+	int lo = 0, hi = count - 1, res = 0;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (fn[mid].addr <= addr) {
+			res = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return res;
+}
+
+static const char *
+_avr_profile_fn_name(
+		avr_profile_t * p,
+		avr_profile_fn_t * f,
+		char * buf,
+		size_t size)
+{
+	if (f->name)
+		return f->name;
+	if (f->vector && p->avr->vector_size)
+		snprintf(buf, size, "vector_%d", f->addr / p->avr->vector_size);
+	else
+		snprintf(buf, size, "0x%05x", f->addr);
+	return buf;
+}
+
+/*
+ * Collects the functions and the call edges (sorted by call site) into
+ * newly allocated arrays; frames still open are accounted for as if they
+ * returned now.
+ */
+static int
+_avr_profile_collect(
+		avr_profile_t * p,
+		avr_profile_fn_t ** out_fn,
+		int * out_fn_count,
+		avr_profile_edge_t ** out_edge)
+{
+	int max = 1 + p->symbolcount + p->edge_count;
+	avr_profile_fn_t * fn = calloc(max, sizeof(fn[0]));
+	avr_profile_edge_t * edge = malloc((p->edge_count + 1) * sizeof(edge[0]));
+	if (!fn || !edge) {
+		free(fn);
+		free(edge);
+		return -1;
+	}
+	int count = 0, ec = 0;
+	fn[count++].addr = 0;
+	for (uint32_t i = 0; i < p->symbolcount; i++)
+		if (p->symbol[i]->addr < p->size * 2) {
+			fn[count].addr = p->symbol[i]->addr;
+			fn[count++].name = p->symbol[i]->symbol;
+		}
+	for (uint32_t i = 0; i < p->edge_size; i++) {
+		if (!p->edge[i].calls)
+			continue;
+		edge[ec++] = p->edge[i];
+		fn[count].addr = p->edge[i].callee;
+		fn[count++].vector = p->edge[i].interrupt;
+	}
+	// the open frames
+	for (int i = 0; i < p->depth; i++)
+		for (int ei = 0; ei < ec; ei++)
+			if (edge[ei].site == p->stack[i].site &&
+					edge[ei].callee == p->stack[i].callee)
+				edge[ei].inclusive += p->avr->cycle - p->stack[i].entry;
+
+	qsort(fn, count, sizeof(fn[0]), _avr_profile_fn_cmp);
+	int u = 0;
+	for (int i = 0; i < count; i++) {
+		if (u && fn[u - 1].addr == fn[i].addr) {
+			fn[u - 1].vector |= fn[i].vector;
+			continue;
+		}
+		fn[u++] = fn[i];
+	}
+	count = u;
+	qsort(edge, ec, sizeof(edge[0]), _avr_profile_edge_cmp);
+
+	for (uint32_t w = 0; w < p->size; w++)
+		if (p->self[w])
+			fn[_avr_profile_fn_find(fn, count, w * 2)].self += p->self[w];
+	for (int ei = 0; ei < ec; ei++) {
+		avr_profile_fn_t * f = &fn[_avr_profile_fn_find(fn, count, edge[ei].callee)];
+		f->calls += edge[ei].calls;
+		f->inclusive += edge[ei].inclusive;
+	}
+	*out_fn = fn;
+	*out_fn_count = count;
+	*out_edge = edge;
+	return ec;
+}
+
+int
+avr_profile_write_callgrind(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return -1;
+	avr_profile_fn_t * fn;
+	avr_profile_edge_t * edge;
+	int fn_count;
+	int ec = _avr_profile_collect(p, &fn, &fn_count, &edge);
+	if (ec < 0)
+		return -1;
+	FILE * o = fopen(filename, "w");
+	if (!o) {
+		perror(filename);
+		free(fn);
+		free(edge);
+		return -1;
+	}
+	uint64_t total = 0;
+	for (int i = 0; i < fn_count; i++)
+		total += fn[i].self;
+	fprintf(o, "# callgrind format\n"
+			"version: 1\n"
+			"creator: simavr\n"
+			"cmd: %s\n"
+			"positions: instr\n"
+			"events: Cycles\n"
+			"summary: %" PRIu64 "\n\n",
+			avr->mmcu, total);
+
+	/* function names are compressed, "(id) name" the first time, then "(id)" */
+	uint8_t * named = calloc(fn_count, 1);
+	char buf[32];
+	int cur = -1, ei = 0;
+	for (uint32_t w = 0; w < p->size; w++) {
+		uint32_t addr = w * 2;
+		if (!p->self[w] && !(ei < ec && edge[ei].site == addr))
+			continue;
+		int fi = _avr_profile_fn_find(fn, fn_count, addr);
+		if (fi != cur) {
+			cur = fi;
+			if (named && named[fi])
+				fprintf(o, "fn=(%d)\n", fi + 1);
+			else
+				fprintf(o, "fn=(%d) %s\n", fi + 1,
+						_avr_profile_fn_name(p, &fn[fi], buf, sizeof(buf)));
+			if (named)
+				named[fi] = 1;
+		}
+		if (p->self[w])
+			fprintf(o, "0x%x %" PRIu64 "\n", addr, p->self[w]);
+		for (; ei < ec && edge[ei].site == addr; ei++) {
+			int ci = _avr_profile_fn_find(fn, fn_count, edge[ei].callee);
+			if (named && named[ci])
+				fprintf(o, "cfn=(%d)\n", ci + 1);
+			else
+				fprintf(o, "cfn=(%d) %s\n", ci + 1,
+						_avr_profile_fn_name(p, &fn[ci], buf, sizeof(buf)));
+			if (named)
+				named[ci] = 1;
+			fprintf(o, "calls=%" PRIu64 " 0x%x\n"
+					"0x%x %" PRIu64 "\n",
+					edge[ei].calls, edge[ei].callee,
+					addr, edge[ei].inclusive);
+		}
+	}
+	int res = ferror(o) ? -1 : 0;
+	fclose(o);
+	free(named);
+	free(fn);
+	free(edge);
+	return res;
+}
+
+static int
+_avr_profile_self_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_fn_t * fa = a, * fb = b;
+	return fa->self < fb->self ? 1 : fa->self > fb->self ? -1 : 0;
+}
+
+void
+avr_profile_report(
+		avr_t * avr,
+		FILE * out,
+		int count)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	avr_profile_fn_t * fn;
+	avr_profile_edge_t * edge;
+	int fn_count;
+	if (_avr_profile_collect(p, &fn, &fn_count, &edge) < 0)
+		return;
+	uint64_t total = 0;
+	for (int i = 0; i < fn_count; i++)
+		total += fn[i].self;
+	qsort(fn, fn_count, sizeof(fn[0]), _avr_profile_self_cmp);
+
+	fprintf(out, "Profile: %" PRIu64 " cycles\n", total);
+	fprintf(out, "%14s %6s %14s %10s  %s\n",
+			"self", "%", "inclusive", "calls", "function");
+	char buf[32];
+	for (int i = 0; i < fn_count && i < count && fn[i].self; i++)
+		fprintf(out, "%14" PRIu64 " %5.1f%% %14" PRIu64 " %10" PRIu64 "  %s\n",
+				fn[i].self, total ? 100.0 * fn[i].self / total : 0.0,
+				fn[i].inclusive, fn[i].calls,
+				_avr_profile_fn_name(p, &fn[i], buf, sizeof(buf)));
+	if (p->overflow)
+		fprintf(out, "%" PRIu64 " calls were too deep to be tracked\n",
+				p->overflow);
+	free(fn);
+	free(edge);
+}
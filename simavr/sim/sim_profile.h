@@ -0,0 +1,124 @@
+/*
+	sim_profile.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cycle profiler.
+ *
+ * Accumulates the cycles spent on each flash word, and follows calls,
+ * returns and interrupts to count calls and inclusive cycles for every
+ * call site. Cycles spent outside of instructions (sleeping, interrupt
+ * entry) are charged to the instruction that preceded them.
+ *
+ * Calls are matched to returns using the stack pointer, so frames that are
+ * unwound without a RET (longjmp, task switches) are closed by the next
+ * return that goes past them.
+ *
+ * The result can be written in callgrind format, for KCachegrind, or as a
+ * flat report of the top functions. Functions are the code symbols of the
+ * firmware, if any, plus all the call and interrupt targets seen.
+ */
+#ifndef __SIM_PROFILE_H__
+#define __SIM_PROFILE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_PROFILE_MAX_DEPTH	256
+
+typedef struct avr_profile_edge_t {
+	uint32_t			site;		// address of the call, or interrupted pc
+	uint32_t			callee;		// address called, or vector
+	uint8_t				interrupt;	// callee is an interrupt vector
+	uint64_t			calls;
+	uint64_t			inclusive;	// cycles, for the calls that returned
+} avr_profile_edge_t;
+
+typedef struct avr_profile_t {
+	struct avr_t *		avr;
+	uint32_t			size;		// flash words in 'self'
+	uint64_t *			self;		// cycles per flash word
+
+	avr_flashaddr_t		next_pc;	// where the last instruction went
+	avr_flashaddr_t		last_pc;
+	avr_cycle_count_t	last_cycle;	// when the last instruction ended
+
+	uint32_t			edge_size;	// power of two
+	uint32_t			edge_count;
+	avr_profile_edge_t *	edge;		// hash table, on site and callee
+
+	int					depth;
+	uint64_t			overflow;	// calls not tracked, stack was too deep
+	struct {
+		uint32_t			site, callee;
+		uint16_t			sp;		// after the return address was pushed
+		avr_cycle_count_t	entry;
+	} stack[AVR_PROFILE_MAX_DEPTH];
+
+	// sorted code symbols, to name functions
+	avr_symbol_t **		symbol;
+	uint32_t			symbolcount;
+} avr_profile_t;
+
+/*
+ * Allocates the profiler for 'avr', and starts it. 'symbol' is the
+ * address sorted symbol table of the firmware (see elf_firmware_t), or
+ * NULL. Returns zero if all is well.
+ */
+int
+avr_profile_init(
+		struct avr_t * avr,
+		avr_symbol_t ** symbol,
+		uint32_t symbolcount);
+// Pauses, or resumes, profiling
+void
+avr_profile_enable(
+		struct avr_t * avr,
+		int on);
+// Writes the profile in callgrind format, returns zero if all is well
+int
+avr_profile_write_callgrind(
+		struct avr_t * avr,
+		const char * filename);
+// Prints the 'count' functions with the most self cycles
+void
+avr_profile_report(
+		struct avr_t * avr,
+		FILE * out,
+		int count);
+// Frees the profiler, called by avr_terminate()
+void
+avr_profile_dispose(
+		struct avr_t * avr);
+
+// private, called by the run loops in place of avr_run_one() when profiling
+avr_flashaddr_t
+avr_profile_run_one(
+		struct avr_t * avr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PROFILE_H__ */
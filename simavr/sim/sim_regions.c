@@ -0,0 +1,128 @@
+/*
+	sim_regions.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_regions.h"
+#include "avr/avr_mcu_section.h"
+
+#define LOG_PREFIX		"REGIONS: "
+
+static avr_regions_t *
+_avr_regions_get(
+		avr_t * avr)
+{
+	if (!avr->regions)
+		avr->regions = calloc(1, sizeof(*avr->regions));
+	return avr->regions;
+}
+
+void
+avr_regions_set_name(
+		avr_t * avr,
+		uint8_t id,
+		const char * name)
+{
+	avr_regions_t * r = _avr_regions_get(avr);
+	if (!r)
+		return;
+	strncpy(r->region[id].name, name, sizeof(r->region[id].name) - 1);
+}
+
+int
+avr_regions_command(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_regions_t * r = _avr_regions_get(avr);
+	if (!r)
+		return 0;
+	// first byte is the command code, wait for the region number
+	if (!r->command) {
+		r->command = v;
+		r->command_cycle = avr->cycle;
+		return 1;
+	}
+	avr_region_t * g = &r->region[v];
+	r->used = 1;
+	if (r->command == SIMAVR_CMD_REGION_START) {
+		if (!g->depth++)
+			g->start = avr->cycle;
+	} else if (!g->depth) {
+		AVR_LOG(avr, LOG_WARNING, LOG_PREFIX
+				"%s: region %d stopped at %04x, but not started\n",
+				__func__, v, avr->pc);
+	} else if (!--g->depth) {
+		uint64_t c = r->command_cycle - g->start;
+		if (!g->hits || c < g->min)
+			g->min = c;
+		if (c > g->max)
+			g->max = c;
+		g->total += c;
+		g->hits++;
+	}
+	r->command = 0;
+	return 0;
+}
+
+void
+avr_regions_report(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_regions_t * r = avr->regions;
+	if (!r)
+		return;
+	fprintf(out, "Regions, in cycles\n");
+	fprintf(out, " id name                                 hits"
+			"          min          avg          max        total   avg usec\n");
+	for (int i = 0; i < AVR_REGIONS_MAX; i++) {
+		avr_region_t * g = &r->region[i];
+		if (!g->hits && !g->depth)
+			continue;
+		uint64_t avg = g->hits ? g->total / g->hits : 0;
+		fprintf(out, "%3d %-32s %8llu %12llu %12llu %12llu %12llu %10.3f%s\n",
+				i, g->name,
+				(unsigned long long)g->hits,
+				(unsigned long long)g->min,
+				(unsigned long long)avg,
+				(unsigned long long)g->max,
+				(unsigned long long)g->total,
+				avr->frequency ? avg * 1e6 / avr->frequency : 0.0,
+				g->depth ? " (open)" : "");
+	}
+}
+
+void
+avr_regions_dispose(
+		avr_t * avr)
+{
+	avr_regions_t * r = avr->regions;
+	if (!r)
+		return;
+	if (r->used && avr->log >= LOG_OUTPUT)
+		avr_regions_report(avr, stdout);
+	free(r);
+	avr->regions = NULL;
+}
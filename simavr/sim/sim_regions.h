@@ -0,0 +1,93 @@
+/*
+	sim_regions.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Firmware measurement regions.
+ *
+ * The firmware opens and closes numbered regions with the
+ * SIMAVR_CMD_REGION_START and SIMAVR_CMD_REGION_STOP commands, followed by
+ * the region number, and simavr accumulates hits and min/max/average
+ * cycles for each region. Regions can be named in the .mmcu section with
+ * AVR_MCU_REGION_NAME().
+ *
+ * A region is measured from the write of its number in the 'start'
+ * command, to the write of the 'stop' command code, so the overhead is
+ * just the instruction loading the region number. Nested starts of the
+ * same region are counted, only the outermost pair is measured.
+ *
+ * The table is printed by avr_terminate(), if any region was used.
+ */
+#ifndef __SIM_REGIONS_H__
+#define __SIM_REGIONS_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_REGIONS_MAX		256		// region numbers are a byte
+
+typedef struct avr_region_t {
+	char				name[32];
+	uint32_t			depth;		// nested starts
+	avr_cycle_count_t	start;
+	uint64_t			hits;
+	uint64_t			total;
+	uint64_t			min, max;
+} avr_region_t;
+
+typedef struct avr_regions_t {
+	uint8_t				command;	// pending command, waiting for its region
+	avr_cycle_count_t	command_cycle;
+	int					used;
+	avr_region_t		region[AVR_REGIONS_MAX];
+} avr_regions_t;
+
+// Names region 'id', for the report
+void
+avr_regions_set_name(
+		struct avr_t * avr,
+		uint8_t id,
+		const char * name);
+// Prints hits and cycles for every region that was used
+void
+avr_regions_report(
+		struct avr_t * avr,
+		FILE * out);
+// Prints the report if any region was used, and frees everything
+void
+avr_regions_dispose(
+		struct avr_t * avr);
+
+// private, the SIMAVR_CMD_REGION_START/STOP handler, see sim_cmds.c
+int
+avr_regions_command(
+		struct avr_t * avr,
+		uint8_t v,
+		void * param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_REGIONS_H__ */
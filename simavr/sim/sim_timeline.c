@@ -0,0 +1,394 @@
+/*
+	sim_timeline.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_time.h"
+#include "sim_writer.h"
+#include "sim_timeline.h"
+#include "avr_uart.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+#include "avr_adc.h"
+
+enum {
+	TRACK_CPU = 1,
+	TRACK_INTERRUPTS,
+	TRACK_MODULES,	// first IO module track
+};
+
+/*
+ * Starts an event: the common fields, up to the timestamp. The caller
+ * adds its own fields and closes it with "}".
+ */
+static void
+_avr_timeline_begin(
+		avr_timeline_t * t,
+		char ph,
+		int tid,
+		avr_cycle_count_t when,
+		const char * name)
+{
+	uint64_t ns = avr_cycles_to_nsec(t->avr, when);
+	// timestamps are in microseconds
+	avr_writer_printf(t->output,
+			"%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64 ".%03u,"
+			"\"name\":\"%s\"",
+			t->events++ ? ",\n" : "", ph, tid,
+			ns / 1000, (unsigned)(ns % 1000), name);
+}
+
+static void
+_avr_timeline_event(
+		avr_timeline_t * t,
+		char ph,
+		int tid,
+		const char * name)
+{
+	_avr_timeline_begin(t, ph, tid, t->avr->cycle, name);
+	if (ph == 'i')
+		avr_writer_printf(t->output, ",\"s\":\"t\"}");
+	else
+		avr_writer_printf(t->output, "}");
+}
+
+// an instant event, with a byte value as argument
+static void
+_avr_timeline_byte(
+		avr_timeline_t * t,
+		int tid,
+		const char * name,
+		uint8_t v)
+{
+	char c[3] = { v, 0, 0 };
+	if (v == '"' || v == '\\') {
+		c[0] = '\\';
+		c[1] = v;
+	} else if (!isprint(v))
+		c[0] = 0;
+	_avr_timeline_begin(t, 'i', tid, t->avr->cycle, name);
+	avr_writer_printf(t->output,
+			",\"s\":\"t\",\"args\":{\"value\":\"0x%02x\",\"char\":\"%s\"}}",
+			v, c);
+}
+
+static void
+_avr_timeline_flush_sleep(
+		avr_timeline_t * t)
+{
+	if (t->sleep_end == t->sleep_start)
+		return;
+	uint64_t dur = avr_cycles_to_nsec(t->avr, t->sleep_end - t->sleep_start);
+	_avr_timeline_begin(t, 'X', TRACK_CPU, t->sleep_start, "sleep");
+	avr_writer_printf(t->output, ",\"dur\":%" PRIu64 ".%03u}",
+			dur / 1000, (unsigned)(dur % 1000));
+	t->sleep_start = t->sleep_end = 0;
+}
+
+/*
+ * Chained to the avr 'sleep' callback. The run loop sleeps from one timer
+ * to the next, so these periods are merged as long as they are contiguous.
+ */
+static void
+_avr_timeline_sleep(
+		avr_t * avr,
+		avr_cycle_count_t howLong)
+{
+	avr_timeline_t * t = avr->timeline;
+
+	if (t->sleep_end != avr->cycle) {
+		_avr_timeline_flush_sleep(t);
+		t->sleep_start = avr->cycle;
+	}
+	t->sleep_end = avr->cycle + 1 + howLong;
+	t->sleep(avr, howLong);
+}
+
+static void
+_avr_timeline_isr_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_timeline_hook_t * h = param;
+	avr_timeline_t * t = h->t;
+	char name[16];
+
+	if (value) {
+		_avr_timeline_flush_sleep(t);
+		snprintf(name, sizeof(name), "vector %d", h->vector);
+		_avr_timeline_event(t, 'B', TRACK_INTERRUPTS, name);
+		t->isr_depth++;
+	} else if (t->isr_depth) {	// could have started mid-ISR
+		t->isr_depth--;
+		_avr_timeline_event(t, 'E', TRACK_INTERRUPTS, "");
+	}
+}
+
+static void
+_avr_timeline_uart_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_timeline_hook_t * h = param;
+	_avr_timeline_byte(h->t, h->tid,
+			h->vector == UART_IRQ_OUTPUT ? "tx" : "rx", value);
+}
+
+static void
+_avr_timeline_spi_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_timeline_hook_t * h = param;
+	_avr_timeline_byte(h->t, h->tid,
+			h->vector == SPI_IRQ_OUTPUT ? "out" : "in", value);
+}
+
+static void
+_avr_timeline_twi_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_timeline_hook_t * h = param;
+	avr_timeline_t * t = h->t;
+	avr_twi_msg_irq_t v = { .u.v = value };
+	uint8_t msg = v.u.twi.msg;
+
+	if (h->vector == TWI_IRQ_OUTPUT) {
+		if (msg & TWI_COND_START) {
+			if (h->open)	// repeated start
+				_avr_timeline_event(t, 'E', h->tid, "");
+			_avr_timeline_event(t, 'B', h->tid, "transaction");
+			h->open = 1;
+		}
+		if (msg & TWI_COND_ADDR) {
+			_avr_timeline_begin(t, 'i', h->tid, t->avr->cycle,
+					v.u.twi.addr & 1 ? "addr read" : "addr write");
+			avr_writer_printf(t->output,
+					",\"s\":\"t\",\"args\":{\"addr\":\"0x%02x\"}}",
+					v.u.twi.addr >> 1);
+		} else if (msg & TWI_COND_WRITE)
+			_avr_timeline_byte(t, h->tid, "write", v.u.twi.data);
+		if ((msg & TWI_COND_STOP) && h->open) {
+			_avr_timeline_event(t, 'E', h->tid, "");
+			h->open = 0;
+		}
+	} else {
+		if (msg & TWI_COND_READ)
+			_avr_timeline_byte(t, h->tid, "read", v.u.twi.data);
+		else if (msg & TWI_COND_ACK)
+			_avr_timeline_event(t, 'i', h->tid, "ack");
+	}
+}
+
+static void
+_avr_timeline_adc_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_timeline_hook_t * h = param;
+	avr_timeline_t * t = h->t;
+
+	if (h->vector < 0) {	// ADC_IRQ_OUT_TRIGGER, conversion starts
+		union {
+			avr_adc_mux_t mux;
+			uint32_t v;
+		} e = { .v = value };
+		if (h->open)
+			_avr_timeline_event(t, 'E', h->tid, "");
+		_avr_timeline_begin(t, 'B', h->tid, t->avr->cycle, "conversion");
+		avr_writer_printf(t->output,
+				",\"args\":{\"kind\":%d,\"src\":%d,\"diff\":%d}}",
+				e.mux.kind, e.mux.src, e.mux.diff);
+		h->open = 1;
+	} else {	// ADC vector raised, conversion done
+		avr_timeline_hook_t * start = h->t->hook[h->vector];
+		if (value && start->open) {
+			_avr_timeline_event(t, 'E', h->tid, "");
+			start->open = 0;
+		}
+	}
+}
+
+static avr_timeline_hook_t *
+_avr_timeline_hook(
+		avr_timeline_t * t,
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		int tid,
+		int vector)
+{
+	avr_timeline_hook_t ** n = realloc(t->hook,
+			(t->hook_count + 1) * sizeof(t->hook[0]));
+	if (!n)
+		return NULL;
+	t->hook = n;
+	avr_timeline_hook_t * h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	h->t = t;
+	h->irq = irq;
+	h->notify = notify;
+	h->tid = tid;
+	h->vector = vector;
+	t->hook[t->hook_count++] = h;
+	avr_irq_register_notify(irq, notify, h);
+	return h;
+}
+
+static void
+_avr_timeline_track(
+		avr_timeline_t * t,
+		int tid,
+		const char * name)
+{
+	avr_writer_printf(t->output,
+			"%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+			"\"args\":{\"name\":\"%s\"}},\n"
+			"{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_sort_index\","
+			"\"args\":{\"sort_index\":%d}}",
+			t->events++ ? ",\n" : "", tid, name, tid, tid);
+}
+
+// hooks the IRQs of one IO module, if it's one we know about
+static void
+_avr_timeline_module(
+		avr_timeline_t * t,
+		avr_io_t * io)
+{
+	char name[32];
+	char c = io->irq_ioctl_get & 0xff;
+	snprintf(name, sizeof(name), "%s%c", io->kind, c > ' ' ? tolower(c) : 0);
+
+	int tid = TRACK_MODULES + t->tracks;
+	if (!strcmp(io->kind, "uart")) {
+		_avr_timeline_hook(t, io->irq + UART_IRQ_OUTPUT,
+				_avr_timeline_uart_hook, tid, UART_IRQ_OUTPUT);
+		_avr_timeline_hook(t, io->irq + UART_IRQ_INPUT,
+				_avr_timeline_uart_hook, tid, UART_IRQ_INPUT);
+	} else if (!strcmp(io->kind, "spi")) {
+		_avr_timeline_hook(t, io->irq + SPI_IRQ_OUTPUT,
+				_avr_timeline_spi_hook, tid, SPI_IRQ_OUTPUT);
+		_avr_timeline_hook(t, io->irq + SPI_IRQ_INPUT,
+				_avr_timeline_spi_hook, tid, SPI_IRQ_INPUT);
+	} else if (!strcmp(io->kind, "twi")) {
+		_avr_timeline_hook(t, io->irq + TWI_IRQ_OUTPUT,
+				_avr_timeline_twi_hook, tid, TWI_IRQ_OUTPUT);
+		_avr_timeline_hook(t, io->irq + TWI_IRQ_INPUT,
+				_avr_timeline_twi_hook, tid, TWI_IRQ_INPUT);
+	} else if (!strcmp(io->kind, "adc")) {
+		int start = t->hook_count;
+		if (!_avr_timeline_hook(t, io->irq + ADC_IRQ_OUT_TRIGGER,
+				_avr_timeline_adc_hook, tid, -1))
+			return;
+		// completion is the ADC vector being raised, its hook points to the start one
+		avr_adc_t * adc = (avr_adc_t *)io;
+		_avr_timeline_hook(t, adc->adc.irq + AVR_INT_IRQ_PENDING,
+				_avr_timeline_adc_hook, tid, start);
+	} else
+		return;
+	_avr_timeline_track(t, tid, name);
+	t->tracks++;
+}
+
+int
+avr_timeline_init(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_timeline_close(avr);
+
+	avr_timeline_t * t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->avr = avr;
+	t->output = avr_writer_open(filename);
+	if (!t->output) {
+		perror(filename);
+		free(t);
+		return -1;
+	}
+	avr_writer_printf(t->output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+			"{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+			"\"args\":{\"name\":\"%s\"}}", avr->mmcu ? avr->mmcu : "avr");
+	t->events++;
+	_avr_timeline_track(t, TRACK_CPU, "cpu");
+	_avr_timeline_track(t, TRACK_INTERRUPTS, "interrupts");
+
+	avr_int_table_p table = &avr->interrupts;
+	for (int i = 0; i < table->vector_count; i++)
+		_avr_timeline_hook(t, table->vector[i]->irq + AVR_INT_IRQ_RUNNING,
+				_avr_timeline_isr_hook, TRACK_INTERRUPTS,
+				table->vector[i]->vector);
+	// the list is in reverse order of registration
+	int count = 0;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		count++;
+	for (int i = count - 1; i >= 0; i--) {
+		avr_io_t * io = avr->io_port;
+		for (int j = 0; j < i; j++)
+			io = io->next;
+		if (io->irq)
+			_avr_timeline_module(t, io);
+	}
+	t->sleep = avr->sleep;
+	avr->sleep = _avr_timeline_sleep;
+	avr->timeline = t;
+	return 0;
+}
+
+void
+avr_timeline_close(
+		avr_t * avr)
+{
+	avr_timeline_t * t = avr->timeline;
+	if (!t)
+		return;
+	_avr_timeline_flush_sleep(t);
+	// close what is still open, so the viewers show it
+	for (; t->isr_depth; t->isr_depth--)
+		_avr_timeline_event(t, 'E', TRACK_INTERRUPTS, "");
+	for (int i = 0; i < t->hook_count; i++) {
+		avr_timeline_hook_t * h = t->hook[i];
+		if (h->open)
+			_avr_timeline_event(t, 'E', h->tid, "");
+		avr_irq_unregister_notify(h->irq, h->notify, h);
+		free(h);
+	}
+	free(t->hook);
+	avr_writer_printf(t->output, "\n]}\n");
+	avr_writer_close(t->output);
+	// gdb might have replaced it since
+	if (avr->sleep == _avr_timeline_sleep)
+		avr->sleep = t->sleep;
+	avr->timeline = NULL;
+	free(t);
+}
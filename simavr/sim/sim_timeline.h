@@ -0,0 +1,88 @@
+/*
+	sim_timeline.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Firmware timeline, in the Chrome trace event JSON format that Perfetto
+ * (ui.perfetto.dev) and chrome://tracing load.
+ *
+ * Events are timestamped from avr->cycle and come from the IRQs the core
+ * and the IO modules already expose; each gets its own track:
+ * + "cpu": sleep periods
+ * + "interrupts": ISR entry to RETI, per vector, nested ones included
+ * + one per UART, SPI and TWI: bytes sent and received, TWI transactions
+ *   from START to STOP
+ * + "adc": conversions, from start to completion
+ *
+ * The JSON is formatted in the buffers of a sim_writer, the file itself is
+ * written by a background thread.
+ */
+#ifndef __SIM_TIMELINE_H__
+#define __SIM_TIMELINE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct avr_timeline_t;
+
+typedef struct avr_timeline_hook_t {
+	struct avr_timeline_t *	t;
+	avr_irq_t *		irq;
+	avr_irq_notify_t notify;
+	int				tid;		// track
+	int				vector;		// for interrupt hooks
+	int				open;		// an event is started on this track
+} avr_timeline_hook_t;
+
+typedef struct avr_timeline_t {
+	struct avr_t *	avr;
+	struct avr_writer_t * output;
+	int				events;		// written so far
+	int				tracks;
+	int				isr_depth;
+	// pending sleep period, contiguous sleeps are merged
+	avr_cycle_count_t sleep_start, sleep_end;
+	void (*sleep)(struct avr_t * avr, avr_cycle_count_t howLong);
+
+	int				hook_count;
+	avr_timeline_hook_t ** hook;
+} avr_timeline_t;
+
+/*
+ * Creates 'filename', and hooks the core and all the supported IO modules
+ * registered so far. Returns zero if all is well.
+ */
+int
+avr_timeline_init(
+		struct avr_t * avr,
+		const char * filename);
+// Unhooks everything and closes the file. Called by avr_terminate()
+void
+avr_timeline_close(
+		struct avr_t * avr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TIMELINE_H__ */
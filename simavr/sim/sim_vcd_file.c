@@ -24,15 +24,105 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
 #include "sim_vcd_file.h"
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_utils.h"
+#include "sim_writer.h"
+#include "sim_fst_file.h"
 
-DEFINE_FIFO(avr_vcd_log_t, avr_vcd_fifo);
+static int
+avr_vcd_log_write(
+		avr_vcd_logbuf_t * lb,
+		avr_vcd_log_t e)
+{
+	avr_vcd_log_chunk_t * c = lb->tail;
+
+	if (!c || c->write == AVR_VCD_LOG_CHUNK_SIZE) {
+		if (lb->spare) {
+			c = lb->spare;
+			lb->spare = c->next;
+		} else if (!(c = malloc(sizeof(*c))))
+			return -1;
+		c->next = NULL;
+		c->read = c->write = 0;
+		if (lb->tail)
+			lb->tail->next = c;
+		else
+			lb->head = c;
+		lb->tail = c;
+	}
+	c->log[c->write++] = e;
+	lb->count++;
+	return 0;
+}
+
+// returns the oldest entry, or NULL if the log is empty
+static inline avr_vcd_log_t *
+avr_vcd_log_peek(
+		avr_vcd_logbuf_t * lb)
+{
+	return lb->count ? &lb->head->log[lb->head->read] : NULL;
+}
+
+// drops the oldest entry
+static void
+avr_vcd_log_pop(
+		avr_vcd_logbuf_t * lb)
+{
+	avr_vcd_log_chunk_t * c = lb->head;
+
+	if (!lb->count)
+		return;
+	lb->count--;
+	if (++c->read < c->write)
+		return;
+	// consumed; the last chunk is kept in place, just rewound
+	if (c == lb->tail) {
+		c->read = c->write = 0;
+		return;
+	}
+	lb->head = c->next;
+	c->next = lb->spare;
+	lb->spare = c;
+}
+
+static void
+avr_vcd_log_reset(
+		avr_vcd_logbuf_t * lb)
+{
+	while (lb->head) {
+		avr_vcd_log_chunk_t * c = lb->head;
+		lb->head = c->next;
+		c->next = lb->spare;
+		lb->spare = c;
+	}
+	lb->tail = NULL;
+	lb->count = 0;
+}
+
+static void
+avr_vcd_log_free(
+		avr_vcd_logbuf_t * lb)
+{
+	avr_vcd_log_reset(lb);
+	while (lb->spare) {
+		avr_vcd_log_chunk_t * c = lb->spare;
+		lb->spare = c->next;
+		free(c);
+	}
+}
 
 #define strdupa(__s) strcpy(alloca(strlen(__s)+1), __s)
 
@@ -42,6 +132,68 @@ _avr_vcd_notify(
 		uint32_t value,
 		void * param);
 
+/*
+ * Signals are allocated one by one, as their IRQ address must not change
+ * once it has been connected.
+ */
+static avr_vcd_signal_t *
+_avr_vcd_new_signal(
+		avr_vcd_t * vcd)
+{
+	if (vcd->signal_count == vcd->signal_size) {
+		int size = vcd->signal_size ? vcd->signal_size * 2 : 32;
+		avr_vcd_signal_t ** n = realloc(vcd->signal, size * sizeof(*n));
+		if (!n)
+			return NULL;
+		vcd->signal = n;
+		vcd->signal_size = size;
+	}
+	avr_vcd_signal_t * s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	int index = vcd->signal_count++;
+	vcd->signal[index] = s;
+	/*
+	 * VCD identifiers are made of any printable characters, so the index
+	 * is written in base 94; the first 94 signals get a single character.
+	 */
+	char * dst = s->alias;
+	do {
+		*dst++ = '!' + (index % 94);
+		index /= 94;
+	} while (index);
+	*dst = 0;
+	return s;
+}
+
+/*
+ * IRQs belonging to IO modules are named "<flags>avr.<module>.<irq>", for
+ * example "=avr.portb.3"; that module is used as the signal's VCD scope.
+ */
+static char *
+_avr_vcd_get_scope(
+		avr_irq_t * irq)
+{
+	const char * n = irq ? irq->name : NULL;
+
+	if (!n)
+		return NULL;
+	while (*n && !isalpha(*n))
+		n++;
+	if (strncmp(n, "avr.", 4))
+		return NULL;
+	n += 4;
+	const char * e = strchr(n, '.');
+	if (!e || e == n)
+		return NULL;
+	char * scope = malloc(e - n + 1);
+	if (scope) {
+		memcpy(scope, n, e - n);
+		scope[e - n] = 0;
+	}
+	return scope;
+}
+
 int
 avr_vcd_init(
 		struct avr_t * avr,
@@ -54,127 +206,308 @@ avr_vcd_init(
 	vcd->filename = strdup(filename);
 	vcd->period = avr_usec_to_cycles(vcd->avr, period);
 
+	const char * ext = strrchr(filename, '.');
+	if (ext && !strcasecmp(ext, ".fst"))
+		vcd->format = AVR_VCD_FORMAT_FST;
 	return 0;
 }
 
 /*
- * Parse a VCD 'timing' line. The lines are assumed to be:
- * #<absolute timestamp>[\n][<value x/0/1><signal alias character>|
- * 		b[x/0/1]?<space><signal alias character]+
- * For example:
- * #1234 1' 0$
- * Or:
- * #1234
- * b1101x1 '
- * 0$
- *
- * This function tries to handle this transparently, and pushes the
- * signal/values into the FIFO for processing by the timer when
- * convenient.
- * NOTE: Add 'floating' support here. Also, FIX THE TIMING.
+ * VCD input. The whole file is mapped, and a first pass indexes all the
+ * timestamps with their offset in the file; the value changes that follow
+ * them are only parsed, in place, when their time comes.
+ * A single cycle timer walks the index, optionally looping back to the
+ * start once the last timestamp has been replayed.
  */
-static avr_cycle_count_t
-avr_vcd_input_parse_line(
+typedef struct avr_vcd_input_index_t {
+	uint64_t		when;		// in file time units
+	size_t			offset;		// of the '#' of that timestamp
+} avr_vcd_input_index_t;
+
+typedef struct avr_vcd_input_id_t {
+	const char *	id;			// points into the mapped file
+	uint32_t		len;
+	int				sigindex;
+} avr_vcd_input_id_t;
+
+typedef struct avr_vcd_input_t {
+	const char *	base;		// mapped file
+	size_t			size;
+	int				mapped;		// otherwise 'base' was malloced
+	avr_vcd_input_index_t * index;
+	uint32_t		count;		// timestamps in 'index'
+	uint32_t		current;	// next one to replay
+	double			to_cycles;	// file time unit to cycles
+	avr_cycle_count_t origin;	// cycle of time zero, for the current loop
+	uint32_t		id_size;	// power of two
+	uint32_t		id_count;
+	avr_vcd_input_id_t * id;	// identifier hash table
+} avr_vcd_input_t;
+
+static int
+_avr_vcd_input_map(
+		avr_vcd_input_t * in,
+		const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	struct stat st = { 0 };
+	if (fstat(fd, &st) || st.st_size == 0) {
+		int err = st.st_size ? errno : EINVAL;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	in->size = st.st_size;
+#ifndef __MINGW32__
+	void * m = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		madvise(m, in->size, MADV_SEQUENTIAL);
+#endif
+		close(fd);
+		in->base = m;
+		in->mapped = 1;
+		return 0;
+	}
+#endif
+	// no mmap, read it all
+	char * b = malloc(in->size);
+	size_t got = 0;
+	while (b && got < in->size) {
+		ssize_t r = read(fd, b + got, in->size - got);
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	close(fd);
+	if (!b || got != in->size) {
+		free(b);
+		return -1;
+	}
+	in->base = b;
+	return 0;
+}
+
+static void
+_avr_vcd_input_free(
+		avr_vcd_input_t * in)
+{
+	if (!in)
+		return;
+#ifndef __MINGW32__
+	if (in->mapped)
+		munmap((void*)in->base, in->size);
+	else
+#endif
+		free((void*)in->base);
+	free(in->index);
+	free(in->id);
+	free(in);
+}
+
+static inline uint32_t
+_avr_vcd_input_hash(
+		const char * id,
+		uint32_t len)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (len--)
+		h = (h ^ (uint8_t)*id++) * 16777619u;
+	return h;
+}
+
+static avr_vcd_input_id_t *
+_avr_vcd_input_find(
+		avr_vcd_input_t * in,
+		const char * id,
+		uint32_t len)
+{
+	uint32_t mask = in->id_size - 1;
+	for (uint32_t h = _avr_vcd_input_hash(id, len); ; h++) {
+		avr_vcd_input_id_t * e = &in->id[h & mask];
+		if (!e->id || (e->len == len && !memcmp(e->id, id, len)))
+			return e;
+	}
+}
+
+// adds 'id' to the identifier table, growing it as needed
+static int
+_avr_vcd_input_add(
+		avr_vcd_input_t * in,
+		const char * id,
+		uint32_t len,
+		int sigindex)
+{
+	if (2 * (in->id_count + 1) > in->id_size) {
+		avr_vcd_input_t n = { .id_size = in->id_size ? 2 * in->id_size : 64 };
+		n.id = calloc(n.id_size, sizeof(n.id[0]));
+		if (!n.id)
+			return -1;
+		for (uint32_t i = 0; i < in->id_size; i++)
+			if (in->id[i].id)
+				*_avr_vcd_input_find(&n, in->id[i].id, in->id[i].len) =
+						in->id[i];
+		free(in->id);
+		in->id = n.id;
+		in->id_size = n.id_size;
+	}
+	avr_vcd_input_id_t * e = _avr_vcd_input_find(in, id, len);
+	if (!e->id)
+		in->id_count++;
+	// a duplicate id is an alias of the same signal, keep the last one
+	*e = (avr_vcd_input_id_t) { .id = id, .len = len, .sigindex = sigindex };
+	return 0;
+}
+
+/*
+ * Returns the next whitespace separated word in [*p, end), and its length
+ * in 'len'; NULL at the end of the buffer.
+ */
+static const char *
+_avr_vcd_input_word(
+		const char ** p,
+		const char * end,
+		uint32_t * len)
+{
+	const char * s = *p;
+	while (s < end && isspace((uint8_t)*s))
+		s++;
+	if (s == end)
+		return NULL;
+	const char * e = s;
+	while (e < end && !isspace((uint8_t)*e))
+		e++;
+	*p = e;
+	*len = e - s;
+	return s;
+}
+
+static inline int
+_avr_vcd_input_is(
+		const char * w,
+		uint32_t len,
+		const char * keyword)
+{
+	return len == strlen(keyword) && !memcmp(w, keyword, len);
+}
+
+// skips words up to, and including, the next "$end"
+static void
+_avr_vcd_input_skip(
+		const char ** p,
+		const char * end)
+{
+	const char * w;
+	uint32_t len;
+	while ((w = _avr_vcd_input_word(p, end, &len)) != NULL)
+		if (_avr_vcd_input_is(w, len, "$end"))
+			break;
+}
+
+/*
+ * Parses "$timescale <n><unit> $end", or with a space before the unit, and
+ * returns the duration of one file time unit, in seconds.
+ */
+static double
+_avr_vcd_input_timescale(
+		const char ** p,
+		const char * end)
+{
+	char ts[32] = "";
+	const char * w;
+	uint32_t len;
+
+	while ((w = _avr_vcd_input_word(p, end, &len)) != NULL &&
+			!_avr_vcd_input_is(w, len, "$end"))
+		if (strlen(ts) + len < sizeof(ts))
+			strncat(ts, w, len);
+	char * unit = ts;
+	double n = strtod(ts, &unit);
+	if (unit == ts)
+		n = 1;
+	static const struct { const char * u; double s; } units[] = {
+		{ "s", 1 }, { "ms", 1e-3 }, { "us", 1e-6 },
+		{ "ns", 1e-9 }, { "ps", 1e-12 }, { "fs", 1e-15 },
+	};
+	for (int i = 0; i < (int)(sizeof(units) / sizeof(units[0])); i++)
+		if (!strcmp(unit, units[i].u))
+			return n * units[i].s;
+	return n * 1e-6;	// no unit, assume usec
+}
+
+static void
+_avr_vcd_input_apply(
 		avr_vcd_t * vcd,
-		argv_p v )
-{
-	avr_cycle_count_t res = 0;
-	int vi = 0;
-
-	if (v->argc == 0)
-		return res;
-
-	if (v->argv[0][0] == '#') {
-		res = atoll(v->argv[0] + 1) * vcd->vcd_to_us;
-		vcd->start = vcd->period;
-		vcd->period = res;
-		vi++;
-	}
-	for (int i = vi; i < v->argc; i++) {
-		char * a = v->argv[i];
-		uint32_t val = 0;
-		int floating = 0;
-		char name = 0;
-		int sigindex = -1;
-
-		if (*a == 'b')
-			a++;
-		while (*a) {
-			if (*a == 'x') {
-				val <<= 1;
-				floating |= (floating << 1) | 1;
-			} else if (*a == '0' || *a == '1') {
-				val = (val << 1) | (*a - '0');
-				floating <<= 1;
-			} else {
-				name = *a;
+		const char * p,
+		const char * end)
+{
+	avr_vcd_input_t * in = vcd->input;
+	const char * w;
+	uint32_t len;
+
+	while ((w = _avr_vcd_input_word(&p, end, &len)) != NULL) {
+		const char * id = w + 1;
+		uint32_t id_len = len - 1;
+		const char * v = w;
+		uint32_t v_len = 1;
+
+		switch (*w) {
+			case '#':	// the timestamp itself, already indexed
+				continue;
+			case '$':	// $dumpvars, $end etc
+				if (_avr_vcd_input_is(w, len, "$comment"))
+					_avr_vcd_input_skip(&p, end);
+				continue;
+			case 'b': case 'B':
+			case 'r': case 'R':
+				v = w + 1;
+				v_len = len - 1;
+				if (!(id = _avr_vcd_input_word(&p, end, &id_len)))
+					return;
+				if (*w == 'r' || *w == 'R')
+					continue;	// real values are not supported
 				break;
-			}
-			a++;
 		}
-		if (!name && (i < v->argc - 1)) {
-			const char *n = v->argv[i+1];
-			if (strlen(n) == 1) {
-				// we've got a name, it was not attached
-				name = *n;
-				i++;	// skip that one
+		uint32_t val = 0, floating = 0;
+		for (uint32_t i = 0; i < v_len; i++) {
+			switch (v[i]) {
+				case '0': case '1':
+					val = (val << 1) | (v[i] - '0');
+					floating <<= 1;
+					break;
+				default:	// x, z etc
+					val <<= 1;
+					floating = (floating << 1) | 1;
+					break;
 			}
 		}
-		if (name) {
-			for (int si = 0;
-						si < vcd->signal_count &&
-						sigindex == -1; si++) {
-				if (vcd->signal[si].alias == name)
-					sigindex = si;
-			}
-		}
-		if (sigindex == -1) {
-			printf("Signal name '%c' value %x not found\n",
-					name? name : '?', val);
+		avr_vcd_input_id_t * e = in->id_size ?
+				_avr_vcd_input_find(in, id, id_len) : NULL;
+		if (!e || !e->id) {
+			AVR_LOG(vcd->avr, LOG_WARNING,
+					"VCD: %s: signal '%.*s' value %x not found\n",
+					vcd->filename, (int)id_len, id, val);
 			continue;
 		}
-		avr_vcd_log_t e = {
-				.when = vcd->period,
-				.sigindex = sigindex,
-				.floating = !!floating,
-				.value = val,
-		};
-	//	printf("%10u %d\n", e.when, e.value);
-		avr_vcd_fifo_write(&vcd->log, e);
+		avr_vcd_signal_p signal = vcd->signal[e->sigindex];
+		avr_raise_irq_float(&signal->irq, val, !!floating);
 	}
-	return res;
 }
 
-/*
- * Read some signals from the file and fill the FIFO with it, we read
- * a completely arbitrary amount of stuff to fill the FIFO reasonably well
- */
-static int
-avr_vcd_input_read(
-		avr_vcd_t * vcd )
+static inline avr_cycle_count_t
+_avr_vcd_input_cycle(
+		avr_vcd_input_t * in,
+		uint64_t when)
 {
-	char line[1024];
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-	//	printf("%s", line);
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		vcd->input_line = argv_parse(vcd->input_line, line);
-		avr_vcd_input_parse_line(vcd, vcd->input_line);
-		/* stop once the fifo is full enough */
-		if (avr_vcd_fifo_get_read_size(&vcd->log) >= 128)
-			break;
-	}
-	return avr_vcd_fifo_isempty(&vcd->log);
+	return in->origin + (avr_cycle_count_t)(when * in->to_cycles + 0.5);
 }
 
 /*
- * This is called when we need to change the state of one or more IRQ,
- * so look in the FIFO to know 'our' stamp time, read as much as we can
- * that is still on that same timestamp.
- * When when the FIFO content has too far in the future, re-schedule the
- * timer for that time and shoot of.
- * Also try to top up the FIFO with new read stuff when it's drained
+ * Replays all the timestamps that are due, and returns the cycle of the
+ * next one. At the end of the file, either loop back to the start, or
+ * stop the simulation.
  */
 static avr_cycle_count_t
 _avr_vcd_input_timer(
@@ -183,40 +516,38 @@ _avr_vcd_input_timer(
 		void * param)
 {
 	avr_vcd_t * vcd = param;
+	avr_vcd_input_t * in = vcd->input;
+	avr_cycle_count_t next;
+
+	do {
+		avr_vcd_input_index_t * e = &in->index[in->current++];
+		const char * end = in->current < in->count ?
+				in->base + in->index[in->current].offset :
+				in->base + in->size;
+		_avr_vcd_input_apply(vcd, in->base + e->offset, end);
+
+		if (in->current == in->count) {
+			if (!vcd->loop) {
+				AVR_LOG(vcd->avr, LOG_TRACE,
+						"%s Finished reading, ending simavr\n",
+						vcd->filename);
+				avr->state = cpu_Done;
+				return 0;
+			}
+			/*
+			 * The capture lasts from time zero to its last timestamp; the
+			 * next pass starts one time unit later, so the last values
+			 * are held for as long as any other.
+			 */
+			avr_cycle_count_t step = in->to_cycles + 0.5;
+			in->origin = _avr_vcd_input_cycle(in, e->when) +
+					(step ? step : 1);
+			in->current = 0;
+		}
+		next = _avr_vcd_input_cycle(in, in->index[in->current].when);
+	} while (next <= when);
 
-	// get some more if needed
-	if (avr_vcd_fifo_get_read_size(&vcd->log) < (vcd->signal_count * 16))
-		avr_vcd_input_read(vcd);
-
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		printf("%s DONE but why are we here?\n", __func__);
-		return 0;
-	}
-
-	avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
-	uint64_t stamp = log.when;
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		log = avr_vcd_fifo_read_at(&vcd->log, 0);
-		if (log.when != stamp)	// leave those in the FIFO
-			break;
-		// we already have it
-		avr_vcd_fifo_read_offset(&vcd->log, 1);
-		avr_vcd_signal_p signal = &vcd->signal[log.sigindex];
-		avr_raise_irq_float(&signal->irq, log.value, log.floating);
-	}
-
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_TRACE,
-				"%s Finished reading, ending simavr\n",
-				vcd->filename);
-		avr->state = cpu_Done;
-		return 0;
-	}
-	log = avr_vcd_fifo_read_at(&vcd->log, 0);
-
-	when += avr_usec_to_cycles(avr, log.when - stamp);
-
-	return when;
+	return next;
 }
 
 int
@@ -229,75 +560,110 @@ avr_vcd_init_input(
 	vcd->avr = avr;
 	vcd->filename = strdup(filename);
 
-	vcd->input = fopen(vcd->filename, "r");
-	if (!vcd->input) {
+	avr_vcd_input_t * in = calloc(1, sizeof(*in));
+	if (!in || _avr_vcd_input_map(in, filename)) {
 		perror(filename);
+		free(in);
 		return -1;
 	}
-	char line[1024];
-	argv_p v = NULL;
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		v = argv_parse(v, line);
-
-		// we are done reading headers, got our first timestamp
-		if (v->line[0] == '#') {
-			vcd->start = 0;
-			avr_vcd_input_parse_line(vcd, v);
-			avr_cycle_timer_register_usec(vcd->avr,
-						vcd->period, _avr_vcd_input_timer, vcd);
+	vcd->input = in;
+	double unit = 1e-6;
+
+	/* header, up to $enddefinitions */
+	const char * p = in->base, * end = in->base + in->size;
+	const char * w;
+	uint32_t len;
+	while ((w = _avr_vcd_input_word(&p, end, &len)) != NULL) {
+		if (*w == '#') {	// no $enddefinitions ?
+			p = w;
 			break;
 		}
-		// ignore multiline stuff
-		if (v->line[0] != '$')
-			continue;
-
-		const char * end = !strcmp(v->argv[v->argc - 1], "$end") ?
-								v->argv[v->argc - 1] : NULL;
-		const char *keyword = v->argv[0];
-
-		if (keyword == end)
-			keyword = NULL;
-		if (!keyword)
+		if (*w != '$')
 			continue;
-
-		if (!strcmp(keyword, "$timescale")) {
-			double cnt = 0;
-			vcd->vcd_to_us = 1;
-			char *si = v->argv[1];
-			while (si && *si && isdigit(*si))
-				cnt = (cnt * 10) + (*si++ - '0');
-			while (*si == ' ')
-				si++;
-			if (!*si)
-				si = v->argv[2];
-		//	if (!strcmp(si, "ns")) // TODO: Check that,
-		//		vcd->vcd_to_us = cnt;
-		//	printf("cnt %dus; unit %s\n", (int)cnt, si);
-		} else if (!strcmp(keyword, "$var")) {
-			const char *name = v->argv[4];
-
-			vcd->signal[vcd->signal_count].alias = v->argv[3][0];
-			vcd->signal[vcd->signal_count].size = atoi(v->argv[2]);
-			strncpy(vcd->signal[vcd->signal_count].name, name,
-						sizeof(vcd->signal[0].name));
-
-			vcd->signal_count++;
+		if (_avr_vcd_input_is(w, len, "$enddefinitions")) {
+			_avr_vcd_input_skip(&p, end);
+			break;
+		} else if (_avr_vcd_input_is(w, len, "$timescale")) {
+			unit = _avr_vcd_input_timescale(&p, end);
+		} else if (_avr_vcd_input_is(w, len, "$var")) {
+			// $var <type> <size> <id> <name> [range] $end
+			const char * v[4];
+			uint32_t l[4];
+			int vi;
+			for (vi = 0; vi < 4; vi++)
+				if (!(v[vi] = _avr_vcd_input_word(&p, end, &l[vi])) ||
+						_avr_vcd_input_is(v[vi], l[vi], "$end"))
+					break;
+			if (vi == 4) {
+				avr_vcd_signal_t * s = _avr_vcd_new_signal(vcd);
+				if (!s)
+					break;
+				s->size = atoi(v[1]);
+				s->name = malloc(l[3] + 1);
+				if (s->name)
+					sprintf(s->name, "%.*s", (int)l[3], v[3]);
+				snprintf(s->alias, sizeof(s->alias), "%.*s", (int)l[2], v[2]);
+				if (_avr_vcd_input_add(in, v[2], l[2], vcd->signal_count - 1))
+					break;
+				_avr_vcd_input_skip(&p, end);
+			}
+		} else if (!_avr_vcd_input_is(w, len, "$end"))
+			_avr_vcd_input_skip(&p, end);	// $scope, $date, $comment...
+	}
+	in->to_cycles = unit * avr->frequency;
+
+	/*
+	 * Timestamp index. Anything before the first timestamp (a $dumpvars
+	 * without #0 for example) is replayed at time zero.
+	 */
+	uint32_t index_size = 1024;
+	in->index = malloc(index_size * sizeof(in->index[0]));
+	if (!in->index) {
+		avr_vcd_close(vcd);
+		return -1;
+	}
+	in->index[in->count].when = 0;
+	in->index[in->count++].offset = p - in->base;
+	uint64_t last = 0;
+	const char * l = p;
+	while (l < end) {
+		while (l < end && isspace((uint8_t)*l))
+			l++;
+		if (l < end && *l == '#') {
+			uint64_t t = strtoull(l + 1, NULL, 10);
+			if (t < last)
+				AVR_LOG(avr, LOG_WARNING, "VCD: %s: time goes backward "
+						"at offset %ld\n", filename, (long)(l - in->base));
+			else
+				last = t;
+			if (in->count == index_size) {
+				avr_vcd_input_index_t * n = realloc(in->index,
+						2 * index_size * sizeof(in->index[0]));
+				if (!n) {
+					avr_vcd_close(vcd);
+					return -1;
+				}
+				in->index = n;
+				index_size *= 2;
+			}
+			in->index[in->count].when = last;
+			in->index[in->count++].offset = l - in->base;
 		}
+		l = memchr(l, '\n', end - l);
+		if (!l)
+			break;
 	}
-	// reuse this one
-	vcd->input_line = v;
+	AVR_LOG(avr, LOG_TRACE, "%s: %d signals, %u timestamps, unit %gs\n",
+			filename, vcd->signal_count, in->count - 1, unit);
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%c' %s : size %d\n",
+		avr_vcd_signal_t * s = vcd->signal[i];
+		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%s' %s : size %d\n",
 				__func__, i,
-				vcd->signal[i].alias, vcd->signal[i].name,
-				vcd->signal[i].size);
+				s->alias, s->name, s->size);
 		/* format is <four-character ioctl>[_<IRQ index>] */
-		if (strlen(vcd->signal[i].name) >= 4) {
-			char *dup = strdupa(vcd->signal[i].name);
+		if (s->name && strlen(s->name) >= 4) {
+			char *dup = strdupa(s->name);
 			char *ioctl = strsep(&dup, "_");
 			int index = 0;
 			if (dup)
@@ -307,19 +673,21 @@ avr_vcd_init_input(
 									ioctl[0], ioctl[1], ioctl[2], ioctl[3]);
 				avr_irq_t * irq = avr_io_getirq(vcd->avr, ioc, index);
 				if (irq) {
-					vcd->signal[i].irq.flags = IRQ_FLAG_INIT;
-					avr_connect_irq(&vcd->signal[i].irq, irq);
+					s->irq.flags = IRQ_FLAG_INIT;
+					avr_connect_irq(&s->irq, irq);
 				} else
 					AVR_LOG(vcd->avr, LOG_WARNING,
 							"%s IRQ was not found\n",
-							vcd->signal[i].name);
+							s->name);
 				continue;
 			}
 			AVR_LOG(vcd->avr, LOG_WARNING,
 					"%s is an invalid IRQ format\n",
-					vcd->signal[i].name);
+					s->name);
 		}
 	}
+	in->origin = avr->cycle;
+	avr_cycle_timer_register(vcd->avr, 0, _avr_vcd_input_timer, vcd);
 	return 0;
 }
 
@@ -331,10 +699,17 @@ avr_vcd_close(
 
 	/* dispose of any link and hooks */
 	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
+		avr_vcd_signal_t * s = vcd->signal[i];
 
 		avr_free_irq(&s->irq, 1);
+		free(s->name);
+		free(s->scope);
+		free(s);
 	}
+	free(vcd->signal);
+	vcd->signal = NULL;
+	vcd->signal_count = vcd->signal_size = 0;
+	avr_vcd_log_free(&vcd->log);
 
 	if (vcd->filename) {
 		free(vcd->filename);
@@ -342,62 +717,112 @@ avr_vcd_close(
 	}
 }
 
+/*
+ * The output is formatted straight into the writer buffers; the binary
+ * values are expanded a byte at a time from this table, which is much
+ * cheaper than going bit by bit, or thru printf.
+ */
+static char _avr_vcd_bits[256][8];
+
+static void
+_avr_vcd_bits_init(void)
+{
+	if (_avr_vcd_bits[0][0])
+		return;
+	for (int b = 0; b < 256; b++)
+		for (int i = 0; i < 8; i++)
+			_avr_vcd_bits[b][i] = b & (0x80 >> i) ? '1' : '0';
+}
+
+// worst case size of a signal line, 'b' + 32 bits + ' ' + alias + '\n'
+#define VCD_LINE_MAX	48
+
+static inline char *
+_avr_vcd_get_alias_text(
+		avr_vcd_signal_t * s,
+		char * dst)
+{
+	for (const char * a = s->alias; *a; )
+		*dst++ = *a++;
+	*dst++ = '\n';
+	return dst;
+}
+
 static char *
 _avr_vcd_get_float_signal_text(
 		avr_vcd_signal_t * s,
-		char * out)
+		char * dst)
 {
-	char * dst = out;
-
 	if (s->size > 1)
 		*dst++ = 'b';
-
-	for (int i = s->size; i > 0; i--)
-		*dst++ = 'x';
+	memset(dst, 'x', s->size);
+	dst += s->size;
 	if (s->size > 1)
 		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+	return _avr_vcd_get_alias_text(s, dst);
 }
 
 static char *
 _avr_vcd_get_signal_text(
 		avr_vcd_signal_t * s,
-		char * out,
+		char * dst,
 		uint32_t value)
 {
-	char * dst = out;
-
-	if (s->size > 1)
-		*dst++ = 'b';
+	if (s->size == 1) {
+		*dst++ = '0' + (value & 1);
+		return _avr_vcd_get_alias_text(s, dst);
+	}
+	*dst++ = 'b';
+	int bits = s->size;
+	// leading partial byte, if any
+	if (bits & 7) {
+		int n = bits & 7;
+		memcpy(dst, _avr_vcd_bits[(value >> (bits - n)) & 0xff] + 8 - n, n);
+		dst += n;
+		bits -= n;
+	}
+	while (bits) {
+		bits -= 8;
+		memcpy(dst, _avr_vcd_bits[(value >> bits) & 0xff], 8);
+		dst += 8;
+	}
+	*dst++ = ' ';
+	return _avr_vcd_get_alias_text(s, dst);
+}
 
-	for (int i = s->size; i > 0; i--)
-		*dst++ = value & (1 << (i-1)) ? '1' : '0';
-	if (s->size > 1)
-		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+static char *
+_avr_vcd_get_timestamp_text(
+		uint64_t base,
+		char * dst)
+{
+	char tmp[20];
+	int l = 0;
+
+	do {
+		tmp[l++] = '0' + (base % 10);
+		base /= 10;
+	} while (base);
+	*dst++ = '#';
+	while (l)
+		*dst++ = tmp[--l];
+	*dst++ = '\n';
+	return dst;
 }
 
 static void
 avr_vcd_flush_log(
 		avr_vcd_t * vcd)
 {
-#if AVR_VCD_MAX_SIGNALS > 32
-	uint64_t seen = 0;
-#else
-	uint32_t seen = 0;
-#endif
-	uint64_t oldbase = 0;	// make sure it's different
-	char out[48];
+	uint64_t oldbase = 0;
+	int first = 1;			// always start with a timestamp
 
-	if (avr_vcd_fifo_isempty(&vcd->log) || !vcd->output)
+	if (!vcd->log.count || !vcd->output)
 		return;
 
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		avr_vcd_log_t l = avr_vcd_fifo_read(&vcd->log);
+	avr_vcd_log_t * e;
+	while ((e = avr_vcd_log_peek(&vcd->log)) != NULL) {
+		avr_vcd_log_t l = *e;
+		avr_vcd_log_pop(&vcd->log);
 		// 10ns base -- 100MHz should be enough
 		uint64_t base = avr_cycles_to_nsec(vcd->avr, l.when - vcd->start) / 10;
 
@@ -409,26 +834,33 @@ avr_vcd_flush_log(
 		 * This is a bit of a fudge, but it is the only way to represent
 		 * very short "pulses" that are still visible on the waveform.
 		 */
-		if (base == oldbase &&
-				(seen & (1 << l.sigindex)))
+		avr_vcd_signal_t * s = vcd->signal[l.sigindex];
+		if (!first && base == oldbase && s->stamp == vcd->stamp)
 			base++;	// this forces a new timestamp
 
-		if (base > oldbase || !seen) {
-			seen = 0;
-			fprintf(vcd->output, "#%" PRIu64  "\n", base);
+		int stamp = base > oldbase || first;
+		if (stamp) {
+			first = 0;
+			vcd->stamp++;
 			oldbase = base;
 		}
 		// mark this trace as seen for this timestamp
-		seen |= (1 << l.sigindex);
-		fprintf(vcd->output, "%s\n",
-				l.floating ?
-					_avr_vcd_get_float_signal_text(
-							&vcd->signal[l.sigindex],
-							out) :
-					_avr_vcd_get_signal_text(
-							&vcd->signal[l.sigindex],
-							out, l.value));
+		s->stamp = vcd->stamp;
+		if (vcd->fst) {
+			avr_fst_change(vcd, oldbase, l.sigindex, l.value, l.floating);
+			continue;
+		}
+		char * start = avr_writer_reserve(vcd->output, 2 * VCD_LINE_MAX);
+		char * dst = start;
+		if (stamp)
+			dst = _avr_vcd_get_timestamp_text(base, dst);
+		dst = l.floating ?
+				_avr_vcd_get_float_signal_text(s, dst) :
+				_avr_vcd_get_signal_text(s, dst, l.value);
+		avr_writer_commit(vcd->output, dst - start);
 	}
+	if (vcd->fst)
+		avr_fst_flush(vcd);
 }
 
 static avr_cycle_count_t
@@ -438,6 +870,7 @@ _avr_vcd_timer(
 		void * param)
 {
 	avr_vcd_t * vcd = param;
+	vcd->flush_pending = 0;
 	avr_vcd_flush_log(vcd);
 	return when + vcd->period;
 }
@@ -460,15 +893,20 @@ _avr_vcd_notify(
 		.value = value,
 		.floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING),
 	};
-	if (avr_vcd_fifo_isfull(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_WARNING,
-				"%s FIFO Overload, flushing!\n",
+	if (avr_vcd_log_write(&vcd->log, l)) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "%s: out of memory, change lost\n",
 				__func__);
-		/* Decrease period by a quarter, for next time */
-		vcd->period -= vcd->period >> 2;
-		avr_vcd_flush_log(vcd);
+		return;
+	}
+	/*
+	 * A big burst; rather than letting the log grow for the whole period,
+	 * have the timer flush it as soon as we are out of the IRQ hook. The
+	 * period itself is left alone.
+	 */
+	if (vcd->log.count >= AVR_VCD_LOG_FLUSH_HINT && !vcd->flush_pending) {
+		vcd->flush_pending = 1;
+		avr_cycle_timer_register(vcd->avr, 1, _avr_vcd_timer, vcd);
 	}
-	avr_vcd_fifo_write(&vcd->log, l);
 }
 
 int
@@ -478,13 +916,13 @@ avr_vcd_add_signal(
 		int signal_bit_size,
 		const char * name )
 {
-	if (vcd->signal_count == AVR_VCD_MAX_SIGNALS)
+	int index = vcd->signal_count;
+	avr_vcd_signal_t * s = _avr_vcd_new_signal(vcd);
+	if (!s)
 		return -1;
-	int index = vcd->signal_count++;
-	avr_vcd_signal_t * s = &vcd->signal[index];
-	strncpy(s->name, name, sizeof(s->name));
+	s->name = strdup(name);
 	s->size = signal_bit_size;
-	s->alias = ' ' + vcd->signal_count ;
+	s->scope = _avr_vcd_get_scope(signal_irq);
 
 	/* manufacture a nice IRQ name */
 	int l = strlen(name);
@@ -503,12 +941,47 @@ avr_vcd_add_signal(
 }
 
 
+/*
+ * Returns the signal indexes in declaration order: signals that don't
+ * belong to an IO module first, then one group per module, in the order
+ * they were first seen.
+ */
+static int *
+_avr_vcd_get_order(
+		avr_vcd_t * vcd)
+{
+	int * order = malloc((vcd->signal_count + 1) * sizeof(int));
+	int count = 0;
+
+	if (!order)
+		return NULL;
+	for (int i = 0; i < vcd->signal_count; i++)
+		if (!vcd->signal[i]->scope)
+			order[count++] = i;
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[i];
+		int done = !s->scope;
+		for (int j = 0; j < i && !done; j++)
+			done = vcd->signal[j]->scope &&
+					!strcmp(vcd->signal[j]->scope, s->scope);
+		if (done)
+			continue;
+		for (int j = i; j < vcd->signal_count; j++) {
+			avr_vcd_signal_t * o = vcd->signal[j];
+			if (o->scope && !strcmp(o->scope, s->scope))
+				order[count++] = j;
+		}
+	}
+	return order;
+}
+
 int
 avr_vcd_start(
 		avr_vcd_t * vcd)
 {
 	vcd->start = vcd->avr->cycle;
-	avr_vcd_fifo_reset(&vcd->log);
+	avr_vcd_log_reset(&vcd->log);
+	vcd->flush_pending = 0;
 
 	if (vcd->input) {
 		/*
@@ -519,31 +992,61 @@ avr_vcd_start(
 	}
 	if (vcd->output)
 		avr_vcd_stop(vcd);
-	vcd->output = fopen(vcd->filename, "w");
+	vcd->output = avr_writer_open(vcd->filename);
 	if (vcd->output == NULL) {
 		perror(vcd->filename);
 		return -1;
 	}
+	_avr_vcd_bits_init();
 
-	fprintf(vcd->output, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
-	fprintf(vcd->output, "$scope module logic $end\n");
+	int * order = _avr_vcd_get_order(vcd);
+	if (!order) {
+		avr_vcd_stop(vcd);
+		return -1;
+	}
+	if (vcd->format == AVR_VCD_FORMAT_FST) {
+		int res = avr_fst_start(vcd, order);
+		free(order);
+		if (res) {
+			avr_vcd_stop(vcd);
+			return -1;
+		}
+		avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
+		return 0;
+	}
+	avr_writer_printf(vcd->output, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
+	avr_writer_printf(vcd->output, "$scope module logic $end\n");
 
+	const char * scope = NULL;
 	for (int i = 0; i < vcd->signal_count; i++) {
-		fprintf(vcd->output, "$var wire %d %c %s $end\n",
-			vcd->signal[i].size, vcd->signal[i].alias, vcd->signal[i].name);
+		avr_vcd_signal_t * s = vcd->signal[order[i]];
+		if (s->scope != scope && (!s->scope || !scope ||
+				strcmp(s->scope, scope))) {
+			if (scope)
+				avr_writer_printf(vcd->output, "$upscope $end\n");
+			if (s->scope)
+				avr_writer_printf(vcd->output, "$scope module %s $end\n",
+						s->scope);
+			scope = s->scope;
+		}
+		avr_writer_printf(vcd->output, "$var wire %d %s %s $end\n",
+			s->size, s->alias, s->name);
 	}
+	if (scope)
+		avr_writer_printf(vcd->output, "$upscope $end\n");
+	free(order);
 
-	fprintf(vcd->output, "$upscope $end\n");
-	fprintf(vcd->output, "$enddefinitions $end\n");
+	avr_writer_printf(vcd->output, "$upscope $end\n");
+	avr_writer_printf(vcd->output, "$enddefinitions $end\n");
 
-	fprintf(vcd->output, "$dumpvars\n");
+	avr_writer_printf(vcd->output, "$dumpvars\n");
 	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
-		char out[48];
-		fprintf(vcd->output, "%s\n",
-				_avr_vcd_get_float_signal_text(s, out));
+		avr_vcd_signal_t * s = vcd->signal[i];
+		char * start = avr_writer_reserve(vcd->output, VCD_LINE_MAX);
+		avr_writer_commit(vcd->output,
+				_avr_vcd_get_float_signal_text(s, start) - start);
 	}
-	fprintf(vcd->output, "$end\n");
+	avr_writer_printf(vcd->output, "$end\n");
 	avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
 	return 0;
 }
@@ -556,15 +1059,16 @@ avr_vcd_stop(
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_input_timer, vcd);
 
 	avr_vcd_flush_log(vcd);
+	// input leftovers, if any
+	avr_vcd_log_reset(&vcd->log);
+	vcd->flush_pending = 0;
 
-	if (vcd->input_line)
-		free(vcd->input_line);
-	vcd->input_line = NULL;
-	if (vcd->input)
-		fclose(vcd->input);
+	_avr_vcd_input_free(vcd->input);
 	vcd->input = NULL;
+	if (vcd->fst)
+		avr_fst_stop(vcd);
 	if (vcd->output)
-		fclose(vcd->output);
+		avr_writer_close(vcd->output);
 	vcd->output = NULL;
 	return 0;
 }
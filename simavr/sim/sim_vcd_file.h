@@ -27,7 +27,6 @@
 
 #include <stdio.h>
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,52 +41,82 @@ extern "C" {
  *
  * It can also do the reverse, load a VCD file generated by for example
  * sigrock signal analyzer, and 'replay' digital input with the proper
- * timing.
- *
- * TODO: Add support for 'looping' a VCD input.
+ * timing. The input file is memory mapped and indexed by timestamp when
+ * loaded, and can be replayed in a loop.
  */
 
-#define AVR_VCD_MAX_SIGNALS 64
-
 typedef struct avr_vcd_signal_t {
 	/*
 	 * For VCD output this is the IRQ we receive new values from.
 	 * For VCD input, this is the IRQ we broadcast the values to
 	 */
 	avr_irq_t 		irq;
-	char 			alias;			// vcd one character alias
+	char 			alias[8];		// vcd identifier
 	uint8_t			size;			// in bits
-	char 			name[32];		// full human name
+	char *			name;			// full human name
+	char *			scope;			// IO module, NULL for the top scope
+	uint64_t		stamp;			// last timestamp it was dumped at
 } avr_vcd_signal_t, *avr_vcd_signal_p;
 
 typedef struct avr_vcd_log_t {
 	uint64_t 		when;
-	uint64_t			sigindex : 8,			// index in signal table
+	uint64_t			sigindex : 31,			// index in signal table
 					floating : 1,
 					value : 32;
 } avr_vcd_log_t, *avr_vcd_log_p;
 
-DECLARE_FIFO(avr_vcd_log_t, avr_vcd_fifo, 256);
-
-struct argv_t;
+/*
+ * The change log is a list of fixed size chunks; it grows as needed to
+ * absorb bursts of changes between two flushes, and the chunks are
+ * recycled once they have been consumed.
+ */
+#define AVR_VCD_LOG_CHUNK_SIZE	1024
+/* past that many entries, the output is flushed at the next cycle timer */
+#define AVR_VCD_LOG_FLUSH_HINT	(64 * AVR_VCD_LOG_CHUNK_SIZE)
+
+typedef struct avr_vcd_log_chunk_t {
+	struct avr_vcd_log_chunk_t * next;
+	uint32_t		read, write;
+	avr_vcd_log_t	log[AVR_VCD_LOG_CHUNK_SIZE];
+} avr_vcd_log_chunk_t;
+
+typedef struct avr_vcd_logbuf_t {
+	avr_vcd_log_chunk_t * head;		// oldest chunk, read from
+	avr_vcd_log_chunk_t * tail;		// newest chunk, appended to
+	avr_vcd_log_chunk_t * spare;	// consumed chunks, for reuse
+	uint32_t		count;			// number of entries in the log
+} avr_vcd_logbuf_t;
+
+struct avr_vcd_input_t;
+struct avr_writer_t;
+struct avr_fst_t;
+
+enum {
+	AVR_VCD_FORMAT_VCD = 0,
+	AVR_VCD_FORMAT_FST,		// GTKWave's compressed format, see sim_fst_file.h
+};
 
 typedef struct avr_vcd_t {
 	struct avr_t *	avr;	// AVR we are attaching timers to..
 
-	char *			filename;		// .vcd filename
+	char *			filename;		// .vcd (or .fst) filename
+	int				format;			// AVR_VCD_FORMAT_*, from the extension
+	struct avr_fst_t * fst;			// FST output state
 	/* can be input OR output, not both */
-	FILE * 			output;
-	FILE * 			input;
-	struct argv_t	* input_line;
+	struct avr_writer_t * output;	// buffered, written by a background thread
+	struct avr_vcd_input_t * input;	// mapped input file, and its index
+	int				loop;			// replay the input indefinitely
 
 	int 				signal_count;
-	avr_vcd_signal_t	signal[AVR_VCD_MAX_SIGNALS];
+	int 				signal_size;	// allocated entries in 'signal'
+	avr_vcd_signal_t **	signal;
+	uint64_t			stamp;		// timestamp counter, for 'pulse' detection
 
 	uint64_t 		start;
 	uint64_t 		period;		// for output cycles
-	uint64_t 		vcd_to_us;	// for input unit mapping
 
-	avr_vcd_fifo_t	log;
+	avr_vcd_logbuf_t log;
+	uint8_t			flush_pending;	// early flush already scheduled
 } avr_vcd_t;
 
 // initializes a new VCD trace file, and returns zero if all is well
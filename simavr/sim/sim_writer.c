@@ -0,0 +1,308 @@
+/*
+	sim_writer.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "sim_writer.h"
+
+#define RING_MASK	(AVR_WRITER_BUFFERS - 1)
+
+static void
+avr_writer_write_fd(
+		avr_writer_t * w,
+		const char * data,
+		size_t len)
+{
+	while (len && !w->error) {
+		ssize_t r = write(w->fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			w->error = errno;
+			break;
+		}
+		data += r;
+		len -= r;
+	}
+}
+
+static void
+avr_writer_run_job(
+		avr_writer_t * w,
+		int b)
+{
+	if (!w->job[b])
+		return;
+	w->job[b](w, w->job_param[b]);
+	w->job[b] = NULL;
+}
+
+static void *
+avr_writer_thread(
+		void * param)
+{
+	avr_writer_t * w = (avr_writer_t*)param;
+
+	for (;;) {
+		uint32_t write = __atomic_load_n(&w->full_write, __ATOMIC_ACQUIRE);
+		while (w->full_read != write) {
+			int b = w->full[w->full_read & RING_MASK];
+			avr_writer_write_fd(w, w->buffer[b], w->buffer_len[b]);
+			avr_writer_run_job(w, b);
+			w->full_read++;
+			w->empty[w->empty_write & RING_MASK] = b;
+			__atomic_store_n(&w->empty_write, w->empty_write + 1,
+					__ATOMIC_RELEASE);
+		}
+		pthread_mutex_lock(&w->lock);
+		__atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int idle = __atomic_load_n(&w->full_write, __ATOMIC_ACQUIRE) ==
+				w->full_read;
+		if (idle && __atomic_load_n(&w->quit, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&w->lock);
+#ifndef __MINGW32__
+			fsync(w->fd);
+#endif
+			break;
+		}
+		if (idle)
+			pthread_cond_wait(&w->cond, &w->lock);
+		__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+static void
+avr_writer_kick(
+		avr_writer_t * w)
+{
+	/* pairs with the fence in the writer thread */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+avr_writer_t *
+avr_writer_fdopen(
+		int fd)
+{
+	avr_writer_t * w = malloc(sizeof(*w));
+	if (!w)
+		return NULL;
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	for (int i = 0; i < AVR_WRITER_BUFFERS; i++) {
+		w->buffer[i] = malloc(AVR_WRITER_BUFFER_SIZE);
+		if (!w->buffer[i])
+			goto error;
+	}
+	w->cur_index = 0;
+	w->cur = w->buffer[0];
+	// every other buffer starts on the 'empty' ring
+	for (int i = 1; i < AVR_WRITER_BUFFERS; i++)
+		w->empty[w->empty_write++ & RING_MASK] = i;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	// if there is no thread, we'll just write synchronously
+	w->threaded = pthread_create(&w->thread, NULL, avr_writer_thread, w) == 0;
+	return w;
+error:
+	for (int i = 0; i < AVR_WRITER_BUFFERS; i++)
+		if (w->buffer[i])
+			free(w->buffer[i]);
+	free(w);
+	return NULL;
+}
+
+avr_writer_t *
+avr_writer_open(
+		const char * filename)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return NULL;
+	avr_writer_t * w = avr_writer_fdopen(fd);
+	if (!w)
+		close(fd);
+	return w;
+}
+
+/* Queues the current buffer, even if empty, and gets a new one */
+static char *
+avr_writer_queue(
+		avr_writer_t * w)
+{
+	if (!w->threaded) {
+		avr_writer_write_fd(w, w->cur, w->len);
+		avr_writer_run_job(w, w->cur_index);
+		w->len = 0;
+		return w->cur;
+	}
+	w->buffer_len[w->cur_index] = w->len;
+	w->full[w->full_write & RING_MASK] = w->cur_index;
+	__atomic_store_n(&w->full_write, w->full_write + 1, __ATOMIC_RELEASE);
+	avr_writer_kick(w);
+
+	// all the buffers are in flight, the disk can't keep up; wait for one
+	while (__atomic_load_n(&w->empty_write, __ATOMIC_ACQUIRE) == w->empty_read)
+		usleep(100);
+	w->cur_index = w->empty[w->empty_read & RING_MASK];
+	w->empty_read++;
+	w->cur = w->buffer[w->cur_index];
+	w->len = 0;
+	return w->cur;
+}
+
+char *
+_avr_writer_next(
+		avr_writer_t * w,
+		size_t len)
+{
+	if (!w->len)
+		return w->cur;
+	return avr_writer_queue(w);
+}
+
+void
+avr_writer_defer(
+		avr_writer_t * w,
+		avr_writer_job_t job,
+		void * param)
+{
+	w->job[w->cur_index] = job;
+	w->job_param[w->cur_index] = param;
+	avr_writer_queue(w);
+}
+
+void
+avr_writer_direct(
+		avr_writer_t * w,
+		const void * data,
+		size_t len)
+{
+	avr_writer_write_fd(w, data, len);
+}
+
+void
+avr_writer_flush(
+		avr_writer_t * w)
+{
+	_avr_writer_next(w, 0);
+}
+
+void
+avr_writer_write(
+		avr_writer_t * w,
+		const void * data,
+		size_t len)
+{
+	const char * src = data;
+	while (len) {
+		size_t room = AVR_WRITER_BUFFER_SIZE - w->len;
+		if (!room) {
+			_avr_writer_next(w, len);
+			continue;
+		}
+		size_t n = len < room ? len : room;
+		memcpy(w->cur + w->len, src, n);
+		w->len += n;
+		src += n;
+		len -= n;
+	}
+}
+
+int
+avr_writer_printf(
+		avr_writer_t * w,
+		const char * format,
+		...)
+{
+	va_list ap;
+	size_t room = AVR_WRITER_BUFFER_SIZE - w->len;
+
+	va_start(ap, format);
+	int n = vsnprintf(w->cur + w->len, room, format, ap);
+	va_end(ap);
+	if (n < 0)
+		return n;
+	if ((size_t)n < room) {
+		w->len += n;
+		return n;
+	}
+	if (n < AVR_WRITER_BUFFER_SIZE) {
+		char * dst = _avr_writer_next(w, n + 1);
+		va_start(ap, format);
+		vsnprintf(dst, n + 1, format, ap);
+		va_end(ap);
+		w->len += n;
+		return n;
+	}
+	// larger than a whole buffer, not worth optimizing for
+	char * tmp = malloc(n + 1);
+	if (!tmp)
+		return -1;
+	va_start(ap, format);
+	vsnprintf(tmp, n + 1, format, ap);
+	va_end(ap);
+	avr_writer_write(w, tmp, n);
+	free(tmp);
+	return n;
+}
+
+void
+avr_writer_close(
+		avr_writer_t * w)
+{
+	if (!w)
+		return;
+	avr_writer_flush(w);
+	/* the writer thread syncs the file before it exits */
+	if (w->threaded) {
+		pthread_mutex_lock(&w->lock);
+		__atomic_store_n(&w->quit, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+	}
+#ifndef __MINGW32__
+	else
+		fsync(w->fd);
+#endif
+	if (w->error)
+		fprintf(stderr, "%s: write error: %s\n", __func__, strerror(w->error));
+	close(w->fd);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	for (int i = 0; i < AVR_WRITER_BUFFERS; i++)
+		free(w->buffer[i]);
+	free(w);
+}
@@ -0,0 +1,161 @@
+/*
+	sim_writer.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Buffered file writer, for the trace files and friends.
+ *
+ * The simulation thread formats directly into large buffers; full buffers
+ * are handed to a background thread that does the actual write() calls
+ * (and the final fsync) through a small lock free ring, so the simulation
+ * never waits on the disk unless all the buffers are in flight.
+ *
+ * Work that is too slow for the simulation thread, like compression, can
+ * also be deferred to the writer thread with avr_writer_defer(); it runs
+ * in order with the buffers.
+ *
+ * There is a single producer per writer, so don't share one between
+ * threads.
+ */
+#ifndef __SIM_WRITER_H__
+#define __SIM_WRITER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_WRITER_BUFFER_SIZE	(64 * 1024)
+#define AVR_WRITER_BUFFERS		8	// power of two
+
+struct avr_writer_t;
+typedef void (*avr_writer_job_t)(
+		struct avr_writer_t * w,
+		void * param);
+
+typedef struct avr_writer_t {
+	int			fd;
+	// buffer being filled by the simulation thread
+	char *		cur;
+	uint32_t	len;
+	int			cur_index;
+
+	char *		buffer[AVR_WRITER_BUFFERS];
+	uint32_t	buffer_len[AVR_WRITER_BUFFERS];
+	// deferred job to run once a buffer has been written
+	avr_writer_job_t job[AVR_WRITER_BUFFERS];
+	void *		job_param[AVR_WRITER_BUFFERS];
+	// full buffers, simulation -> writer thread
+	uint8_t		full[AVR_WRITER_BUFFERS];
+	uint32_t	full_write, full_read;
+	// written buffers, writer thread -> simulation
+	uint8_t		empty[AVR_WRITER_BUFFERS];
+	uint32_t	empty_write, empty_read;
+
+	int			threaded;	// zero if the thread could not be started
+	int			quit;
+	int			sleeping;	// writer thread waits on 'cond'
+	int			error;		// a write() failed, errno
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+} avr_writer_t;
+
+// Creates (truncates) 'filename', returns NULL on error
+avr_writer_t *
+avr_writer_open(
+		const char * filename);
+// Same, but for an already open file descriptor, closed by avr_writer_close()
+avr_writer_t *
+avr_writer_fdopen(
+		int fd);
+// Flushes everything, syncs and closes the file, and frees 'w'
+void
+avr_writer_close(
+		avr_writer_t * w);
+// Hands the current buffer to the writer thread, even if not full
+void
+avr_writer_flush(
+		avr_writer_t * w);
+
+/*
+ * Runs 'job' on the writer thread once everything written so far is on
+ * disk, or right away if there is no thread. 'param' is owned by the job
+ * from now on.
+ */
+void
+avr_writer_defer(
+		avr_writer_t * w,
+		avr_writer_job_t job,
+		void * param);
+// For deferred jobs only: writes to the file, bypassing the buffers
+void
+avr_writer_direct(
+		avr_writer_t * w,
+		const void * data,
+		size_t len);
+
+// private, called when the current buffer is full
+char *
+_avr_writer_next(
+		avr_writer_t * w,
+		size_t len);
+
+/*
+ * Returns a pointer to write at least 'len' bytes (len <= buffer size) to,
+ * call avr_writer_commit() with how many were actually used.
+ */
+static inline char *
+avr_writer_reserve(
+		avr_writer_t * w,
+		size_t len)
+{
+	if (w->len + len <= AVR_WRITER_BUFFER_SIZE)
+		return w->cur + w->len;
+	return _avr_writer_next(w, len);
+}
+
+static inline void
+avr_writer_commit(
+		avr_writer_t * w,
+		size_t len)
+{
+	w->len += len;
+}
+
+void
+avr_writer_write(
+		avr_writer_t * w,
+		const void * data,
+		size_t len);
+int
+avr_writer_printf(
+		avr_writer_t * w,
+		const char * format,
+		...) __attribute__ ((format (printf, 2, 3)));
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_WRITER_H__ */
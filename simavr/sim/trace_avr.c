@@ -0,0 +1,181 @@
+/*
+	trace_avr.c
+
+	Decodes the binary instruction traces written by run_avr --itrace,
+	see sim_itrace.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_itrace.h"
+
+static void
+display_usage(
+	const char * app)
+{
+	printf("Usage: %s [...] <trace file>\n", app);
+	printf( "       [--elf|-e <file>]   Firmware to symbolize the trace with\n"
+			"       [--help|-h]         Display this usage message and exit\n");
+	exit(1);
+}
+
+static elf_firmware_t f;
+
+/*
+ * Returns the closest symbol at, or before 'pc'; the symbol table is sorted
+ * by address. Data symbols all live above 0x800000, so they never match.
+ */
+static avr_symbol_t *
+find_symbol(
+		uint32_t pc)
+{
+#if ELF_SYMBOLS
+	int lo = 0, hi = (int)f.symbolcount - 1, res = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (f.symbol[mid]->addr <= pc) {
+			res = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return res == -1 ? NULL : f.symbol[res];
+#else
+	return NULL;
+#endif
+}
+
+static void
+swap_record(
+		avr_itrace_rec_t * r)
+{
+	r->cycle = __builtin_bswap64(r->cycle);
+	r->pc = __builtin_bswap32(r->pc);
+	r->touched = __builtin_bswap32(r->touched);
+	r->opcode = __builtin_bswap16(r->opcode);
+	r->sp = __builtin_bswap16(r->sp);
+}
+
+/*
+ * One line per instruction; registers are listed if the instruction changed
+ * their value, with the new value for the first three.
+ */
+static void
+print_record(
+		avr_itrace_rec_t * r)
+{
+	static const char * sreg_names = "cznvshti";
+	char sym[64] = "";
+	char sreg[9];
+
+	avr_symbol_t * s = find_symbol(r->pc);
+	if (s && r->pc != s->addr)
+		snprintf(sym, sizeof(sym), "%s+0x%x", s->symbol, r->pc - s->addr);
+	else if (s)
+		snprintf(sym, sizeof(sym), "%s", s->symbol);
+	for (int i = 0; i < 8; i++)
+		sreg[i] = (r->sreg & (1 << i)) ? sreg_names[i] - 'a' + 'A' : '.';
+	sreg[8] = 0;
+
+	printf("%12" PRIu64 " %05x: %-28s %04x  %s sp=%04x",
+			r->cycle, r->pc, sym, r->opcode, sreg, r->sp);
+	int vi = 0;
+	for (int i = 0; i < 32; i++) {
+		if (!(r->touched & (1u << i)))
+			continue;
+		if (vi < 3)
+			printf(" r%d=%02x", i, r->value[vi++]);
+		else
+			printf(" r%d", i);
+	}
+	printf("\n");
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	const char * elf = NULL;
+	const char * trace = NULL;
+
+	for (int pi = 1; pi < argc; pi++) {
+		if (!strcmp(argv[pi], "-h") || !strcmp(argv[pi], "--help")) {
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-e") || !strcmp(argv[pi], "--elf")) {
+			if (pi < argc-1)
+				elf = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (argv[pi][0] != '-')
+			trace = argv[pi];
+		else
+			display_usage(basename(argv[0]));
+	}
+	if (!trace)
+		display_usage(basename(argv[0]));
+	if (elf && elf_read_firmware(elf, &f) == -1) {
+		fprintf(stderr, "%s: Unable to load firmware from file %s\n",
+				argv[0], elf);
+		exit(1);
+	}
+
+	FILE * in = fopen(trace, "rb");
+	if (!in) {
+		perror(trace);
+		exit(1);
+	}
+	avr_itrace_header_t h;
+	if (fread(&h, sizeof(h), 1, in) != 1 ||
+			memcmp(h.magic, AVR_ITRACE_MAGIC, sizeof(h.magic))) {
+		fprintf(stderr, "%s: %s is not an instruction trace\n", argv[0], trace);
+		exit(1);
+	}
+	int swap = h.endian != 0x01020304;
+	if (swap) {
+		h.version = __builtin_bswap16(h.version);
+		h.rec_size = __builtin_bswap16(h.rec_size);
+		h.frequency = __builtin_bswap32(h.frequency);
+	}
+	if (h.version != AVR_ITRACE_VERSION || h.rec_size != sizeof(avr_itrace_rec_t)) {
+		fprintf(stderr, "%s: %s: unsupported version %d (record size %d)\n",
+				argv[0], trace, h.version, h.rec_size);
+		exit(1);
+	}
+	h.mmcu[sizeof(h.mmcu) - 1] = 0;
+	printf("# %s at %u Hz\n", h.mmcu, h.frequency);
+
+	avr_itrace_rec_t rec[1024];
+	size_t n;
+	while ((n = fread(rec, sizeof(rec[0]), 1024, in)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (swap)
+				swap_record(&rec[i]);
+			print_record(&rec[i]);
+		}
+	}
+	fclose(in);
+	return 0;
+}
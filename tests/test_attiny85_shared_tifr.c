@@ -0,0 +1,55 @@
+/*
+	test_attiny85_shared_tifr.c
+
+	On the tiny85, both timers have their flags in TIFR. Clearing the flag
+	of one timer, by writing it to one, must leave the flags of the other
+	timer alone, even though they are written as zero.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+// from avr/iotn85.h
+#define TIFR	(0x38 + 0x20)
+#define TOV0	1
+#define OCF1A	6
+
+/*
+ *	ldi r16, 1 << TOV0
+ *	out TIFR, r16
+ *	ldi r16, 1 << OCF1A
+ *	out TIFR, r16
+ */
+static const uint8_t code[] = {
+	0x02, 0xe0, 0x08, 0xbf,
+	0x00, 0xe4, 0x08, 0xbf,
+};
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("attiny85");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	avr_loadcode(avr, (uint8_t *)code, sizeof(code), 0);
+
+	avr->data[TIFR] = (1 << TOV0) | (1 << OCF1A);
+	avr->pc = avr_run_one(avr);
+	avr->pc = avr_run_one(avr);
+	if (avr->data[TIFR] != (1 << OCF1A))
+		fail("Clearing TOV0: TIFR is %02x, expected %02x",
+				avr->data[TIFR], 1 << OCF1A);
+
+	avr->pc = avr_run_one(avr);
+	avr->pc = avr_run_one(avr);
+	if (avr->data[TIFR] != 0)
+		fail("Clearing OCF1A: TIFR is %02x, expected 00", avr->data[TIFR]);
+
+	avr_terminate(avr);
+	free(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+	test_console.c
+
+	Runs code that writes to the console register, captured in memory then
+	streamed to a pipe; '\r' must come out as '\n' and the other control
+	characters must be dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_console.h"
+
+#define GPIOR0	(0x1e + 0x20)
+
+static uint8_t code[256];
+static int code_len;
+
+// ldi r16, c; out GPIOR0, r16
+static void
+emit(
+		const char * s,
+		int len)
+{
+	for (int i = 0; i < len; i++) {
+		uint8_t c = s[i];
+		code[code_len++] = c & 0xf;
+		code[code_len++] = 0xe0 | (c >> 4);
+		code[code_len++] = 0x0e;
+		code[code_len++] = 0xbb;
+	}
+}
+
+static void
+run(
+		avr_t * avr,
+		int len)
+{
+	for (int i = 0; i < len * 2; i++)
+		avr->pc = avr_run_one(avr);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	avr_set_console_register(avr, GPIOR0);
+
+	static const char first[] = "hi\r\x01there\r";
+	static const char second[] = "more\r";
+	emit(first, sizeof(first) - 1);
+	emit(second, sizeof(second) - 1);
+	avr_loadcode(avr, code, code_len, 0);
+
+	if (avr_console_capture(avr))
+		fail("Failed to capture the console");
+	run(avr, sizeof(first) - 1);
+	size_t len;
+	const char * got = avr_console_captured(avr, &len);
+	if (strcmp(got, "hi\nthere\n") || len != strlen(got))
+		fail("Captured '%s' (%d bytes)", got, (int)len);
+	avr_console_capture_clear(avr);
+	got = avr_console_captured(avr, &len);
+	if (len || got[0])
+		fail("The capture was not cleared");
+
+	int fd[2];
+	if (pipe(fd))
+		fail("Failed to create a pipe");
+	if (avr_console_stream(avr, fd[1], 0))
+		fail("Failed to stream the console");
+	run(avr, sizeof(second) - 1);
+	avr_console_flush(avr);
+	char buf[32] = "";
+	ssize_t r = read(fd[0], buf, sizeof(buf) - 1);
+	if (r != 5 || memcmp(buf, "more\n", 5))
+		fail("Streamed '%.*s' (%d bytes)", (int)(r > 0 ? r : 0), buf, (int)r);
+
+	avr_terminate(avr);
+	free(avr);
+	close(fd[0]);
+	close(fd[1]);
+	tests_success();
+	return 0;
+}
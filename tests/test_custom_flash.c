@@ -0,0 +1,77 @@
+/*
+	test_custom_flash.c
+
+	Replaces the flash in a custom.init() hook, as simusb does with a
+	mapped file: the core must run from the new buffer, erase it without
+	dropping its pages, and leave it to custom.deinit() on termination.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+static uint8_t * flash;
+static size_t flash_size;
+static int deinit_called;
+
+static void
+special_init(
+		avr_t * avr,
+		void * data)
+{
+	avr_release_flash(avr);
+	flash_size = avr->flashend + 4;
+	flash = mmap(NULL, flash_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (flash == MAP_FAILED)
+		fail("Failed to map the flash");
+	memset(flash, 0x12, flash_size);
+	avr->flash = flash;
+}
+
+static void
+special_deinit(
+		avr_t * avr,
+		void * data)
+{
+	if (avr->flash != flash)
+		fail("The custom flash was replaced");
+	munmap(avr->flash, flash_size);
+	avr->flash = NULL;
+	deinit_called++;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr->custom.init = special_init;
+	avr->custom.deinit = special_deinit;
+	avr_init(avr);
+	if (avr->flash != flash || avr->mem_flash)
+		fail("The flash was not replaced");
+
+	static uint8_t code[] = { 0x00, 0x00, 0xff, 0xcf };	// nop; rjmp .-2
+	avr_loadcode(avr, code, sizeof(code), 0);
+	for (int i = 0; i < 4; i++)
+		avr->pc = avr_run_one(avr);
+	if (memcmp(flash, code, sizeof(code)))
+		fail("The code was not loaded in the custom flash");
+
+	avr_erase_flash(avr);
+	for (int i = 0; i <= avr->flashend; i++)
+		if (flash[i] != 0xff)
+			fail("Custom flash at %04x is %02x after an erase", i, flash[i]);
+
+	avr_terminate(avr);
+	if (deinit_called != 1)
+		fail("custom.deinit() was not called");
+	free(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+	test_ihex.c
+
+	Parses .hex files with records of every length up to 16 bytes, in upper
+	and lower case, behind extended segment (02) and linear (04) address
+	records, then loads one in a core, flash and eeprom. Broken digits and
+	checksums, and eeprom data past the end, must be refused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_hex.h"
+#include "avr_eeprom.h"
+
+static void
+record(
+		FILE * f,
+		int type,
+		uint16_t addr,
+		const uint8_t * data,
+		int len,
+		int lower)
+{
+	uint8_t chk = len + (addr >> 8) + addr + type;
+	const char * fmt = lower ? "%02x" : "%02X";
+	fprintf(f, ":");
+	fprintf(f, fmt, len);
+	fprintf(f, fmt, addr >> 8);
+	fprintf(f, fmt, addr & 0xff);
+	fprintf(f, fmt, type);
+	for (int i = 0; i < len; i++) {
+		fprintf(f, fmt, data[i]);
+		chk += data[i];
+	}
+	fprintf(f, fmt, (uint8_t)-chk);
+	fprintf(f, "\r\n");
+}
+
+static void
+address(
+		FILE * f,
+		int type,
+		uint16_t value)
+{
+	uint8_t d[2] = { value >> 8, value };
+	record(f, type, 0, d, 2, 0);
+}
+
+static char filename[] = "/tmp/simavr_ihex_XXXXXX";
+
+static FILE *
+create(void)
+{
+	FILE * f = fopen(filename, "w");
+	if (!f)
+		fail("Failed to create %s", filename);
+	return f;
+}
+
+// every byte is its own address, so misplaced data shows
+static uint8_t seen[0x30000];
+static int seen_bytes;
+
+static int
+check_record(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) {
+		if (addr + i >= sizeof(seen) || data[i] != (uint8_t)(addr + i))
+			fail("Byte %d of the record at %05x is %02x",
+					(int)i, (int)addr, data[i]);
+		seen[addr + i]++;
+	}
+	seen_bytes += size;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	int fd = mkstemp(filename);
+	if (fd == -1)
+		fail("Failed to create %s", filename);
+	close(fd);
+
+	/*
+	 * Records of 1 to 16 bytes, so every mix of 8 digits blocks and single
+	 * bytes gets decoded, at 0x100, at 0x10000 + 0x200 using an extended
+	 * segment, and at 0x20000 + 0x300 using an extended linear address.
+	 */
+	uint8_t data[16];
+	FILE * f = create();
+	static const struct { int type; uint16_t value; uint32_t base; } bases[] = {
+		{ 0, 0, 0x100 }, { 2, 0x1000, 0x10200 }, { 4, 0x0002, 0x20300 },
+	};
+	int total = 0;
+	for (int b = 0; b < 3; b++) {
+		if (bases[b].type)
+			address(f, bases[b].type, bases[b].value);
+		uint32_t addr = bases[b].base;
+		for (int len = 1; len <= 16; len++) {
+			for (int i = 0; i < len; i++)
+				data[i] = addr + i;
+			record(f, 0, addr & 0xffff, data, len, len & 1);
+			addr += len;
+			total += len;
+		}
+	}
+	// start addresses are ignored, nothing is read after the end
+	uint8_t start[4] = { 0, 0, 1, 0 };
+	record(f, 3, 0, start, 4, 0);
+	record(f, 5, 0, start, 4, 0);
+	record(f, 1, 0, NULL, 0, 0);
+	record(f, 0, 0, data, 4, 0);
+	fclose(f);
+
+	int res = read_ihex_stream(filename, check_record, NULL);
+	if (res != total || seen_bytes != total)
+		fail("Read %d bytes, %d in records, expected %d",
+				res, seen_bytes, total);
+	for (int b = 0; b < 3; b++)
+		for (int i = 0; i < 136; i++)
+			if (seen[bases[b].base + i] != 1)
+				fail("Byte %05x seen %d times", bases[b].base + i,
+						seen[bases[b].base + i]);
+
+	// a bad digit in the SWAR decoded part, and in the tail
+	static const char * broken[] = {
+		":0400000001020g04F5\n",
+		":05000000010203040g00\n",
+		":0400000001020304F5\n",		// bad checksum
+	};
+	for (int i = 0; i < 3; i++) {
+		f = create();
+		fputs(broken[i], f);
+		fclose(f);
+		if (read_ihex_stream(filename, check_record, NULL) != -1)
+			fail("Broken record %d was accepted", i);
+	}
+
+	// flash and eeprom, loaded in a core
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	f = create();
+	uint8_t code[6] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+	record(f, 0, 0x40, code, sizeof(code), 0);
+	address(f, 4, 0x0081);
+	uint8_t ee[3] = { 0xa5, 0x5a, 0x42 };
+	record(f, 0, 0x10, ee, sizeof(ee), 1);
+	record(f, 1, 0, NULL, 0, 0);
+	fclose(f);
+	uint32_t base = 0;
+	res = avr_load_ihex(avr, filename, 0, &base);
+	if (res != sizeof(code) + sizeof(ee))
+		fail("Loaded %d bytes", res);
+	if (base != 0x40 || memcmp(avr->flash + 0x40, code, sizeof(code)))
+		fail("Flash not loaded at 0x40 (base %x)", base);
+	uint8_t got[3];
+	avr_eeprom_desc_t d = { .ee = got, .offset = 0x10, .size = sizeof(got) };
+	if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d) ||
+			memcmp(got, ee, sizeof(ee)))
+		fail("Eeprom not loaded at 0x10");
+
+	// the atmega88 has 512 bytes of eeprom
+	f = create();
+	address(f, 4, 0x0081);
+	record(f, 0, 0x1ff, ee, sizeof(ee), 0);
+	record(f, 1, 0, NULL, 0, 0);
+	fclose(f);
+	if (avr_load_ihex(avr, filename, 0, NULL) != -1)
+		fail("Eeprom data past the end was accepted");
+
+	avr_terminate(avr);
+	free(avr);
+	unlink(filename);
+	tests_success();
+	return 0;
+}
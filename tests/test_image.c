@@ -0,0 +1,69 @@
+/*
+	test_image.c
+
+	Writes a firmware as a simavr image and reads it back, then checks
+	that an image whose stored flash size doesn't match its flash section
+	is rejected, rather than loaded past the end of the file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_image.h"
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	uint8_t flash[256], eeprom[16];
+	for (int i = 0; i < (int)sizeof(flash); i++)
+		flash[i] = i;
+	memset(eeprom, 0x5a, sizeof(eeprom));
+
+	elf_firmware_t f = {{0}};
+	strcpy(f.mmcu, "atmega88");
+	f.frequency = 8000000;
+	f.flash = flash;
+	f.flashsize = sizeof(flash);
+	f.eeprom = eeprom;
+	f.eesize = sizeof(eeprom);
+
+	char filename[] = "/tmp/simavr_image_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1)
+		fail("Failed to create %s", filename);
+	close(fd);
+	if (avr_image_write(filename, &f))
+		fail("Failed to write %s", filename);
+
+	elf_firmware_t r = {{0}};
+	if (avr_image_read(filename, &r))
+		fail("Failed to read %s back", filename);
+	if (strcmp(r.mmcu, "atmega88") || r.frequency != 8000000 ||
+			r.flashsize != sizeof(flash) || !r.flash ||
+			memcmp(r.flash, flash, sizeof(flash)) ||
+			r.eesize != sizeof(eeprom) || !r.eeprom ||
+			memcmp(r.eeprom, eeprom, sizeof(eeprom)))
+		fail("The image read back differs from the firmware");
+
+	// claim a larger flash than the section holds
+	avr_image_header_t h;
+	fd = open(filename, O_RDWR);
+	if (fd == -1 || pread(fd, &h, sizeof(h), 0) != sizeof(h))
+		fail("Failed to read the header of %s", filename);
+	uint32_t big = 64 * 1024;
+	if (pwrite(fd, &big, sizeof(big), h.firmware.offset +
+			offsetof(elf_firmware_t, flashsize)) != sizeof(big))
+		fail("Failed to patch %s", filename);
+	close(fd);
+	elf_firmware_t bad = {{0}};
+	if (avr_image_read(filename, &bad) == 0)
+		fail("An image with a wrong flash size was accepted");
+
+	unlink(filename);
+	tests_success();
+	return 0;
+}
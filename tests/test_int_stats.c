@@ -0,0 +1,81 @@
+/*
+	test_int_stats.c
+
+	Raises an enabled vector twice before it is serviced: the second raise
+	must only show on the 'coalesced' IRQ, not as another 'pending' edge,
+	and avr_reset() must clear the statistics.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_int_stats.h"
+
+#define GPIOR0	(0x1e + 0x20)
+
+static int pending_edges, coalesced_edges;
+
+static void
+pending_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	if (value)
+		pending_edges++;
+}
+
+static void
+coalesced_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	coalesced_edges++;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+
+	// a made up vector, enabled by GPIOR0 bit 0
+	static avr_int_vector_t vector = {
+		.vector = 40,
+		.enable = AVR_IO_REGBIT(GPIOR0, 0),
+	};
+	avr_register_vector(avr, &vector);
+	static avr_int_stats_t stats;
+	avr_int_stats_init(avr, &stats);
+	avr_irq_register_notify(vector.irq + AVR_INT_IRQ_PENDING,
+			pending_hook, NULL);
+	avr_irq_register_notify(vector.irq + AVR_INT_IRQ_COALESCED,
+			coalesced_hook, NULL);
+
+	avr->data[GPIOR0] = 1;
+	avr_raise_interrupt(avr, &vector);
+	avr_raise_interrupt(avr, &vector);
+	if (pending_edges != 1)
+		fail("Expected 1 pending edge, got %d", pending_edges);
+	if (coalesced_edges != 1)
+		fail("Expected 1 coalesced edge, got %d", coalesced_edges);
+	if (stats.vector[40].raised != 1 || stats.vector[40].coalesced != 1)
+		fail("Expected 1 raise and 1 coalesced, got %d and %d",
+				(int)stats.vector[40].raised,
+				(int)stats.vector[40].coalesced);
+
+	avr_reset(avr);
+	if (stats.vector[40].raised || stats.vector[40].coalesced ||
+			stats.vector[40].armed)
+		fail("avr_reset() did not clear the statistics");
+	if (stats.vector[40].vector != &vector)
+		fail("avr_reset() lost the vector");
+
+	avr_terminate(avr);
+	free(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+	test_log_async.c
+
+	Logs through the asynchronous logger, and checks the output is the
+	same as the synchronous one would be, including "%.*s" of a buffer
+	that isn't terminated, right at the end of a readable page, and
+	messages too long for a slot or for the thread's buffer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_log_async.h"
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char filename[] = "/tmp/simavr_log_async_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1 || !freopen(filename, "w", stdout))
+		fail("Failed to redirect stdout to %s", filename);
+	close(fd);
+
+	// the id is the last 3 bytes of a page, the next one can't be read
+	size_t page = sysconf(_SC_PAGESIZE);
+	char * m = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED || mprotect(m + page, page, PROT_NONE))
+		fail("Failed to map the guard page");
+	char * id = m + page - 3;
+	memcpy(id, "abc", 3);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	avr->log = LOG_TRACE;
+	if (avr_log_async_init(avr, 0))
+		fail("Failed to start the asynchronous logger");
+
+	// warnings and up go to stdout
+	AVR_LOG(avr, LOG_WARNING, "int %d long %ld str '%s' hex %04x\n",
+			-12, 1234567L, "hello", 0xbeef);
+	AVR_LOG(avr, LOG_WARNING, "id '%.*s' and '%.2s' '%-5.1s'\n",
+			3, id, id, id);
+	AVR_LOG(avr, LOG_WARNING, "width '%*s' double %.3f\n", 6, "ab", 1.5);
+	// a console line longer than the strings of a slot
+	char line[301];
+	for (int i = 0; i < 300; i++)
+		line[i] = 'a' + i % 26;
+	line[300] = 0;
+	AVR_LOG(avr, LOG_WARNING, "O:%s\n", line);
+	// captured, but longer than the thread's buffer once formatted
+	AVR_LOG(avr, LOG_WARNING, "%1500d|\n", 7);
+	AVR_LOG(avr, LOG_WARNING, "end\n");
+	avr_log_async_flush(avr);
+	fflush(stdout);
+
+	char expected[4096];
+	snprintf(expected, sizeof(expected),
+		"int -12 long 1234567 str 'hello' hex beef\n"
+		"id 'abc' and 'ab' 'a    '\n"
+		"width '    ab' double 1.500\n"
+		"O:%s\n"
+		"%1500d|\n"
+		"end\n", line, 7);
+	char got[4096] = "";
+	FILE * f = fopen(filename, "r");
+	size_t len = f ? fread(got, 1, sizeof(got) - 1, f) : 0;
+	got[len] = 0;
+	if (f)
+		fclose(f);
+	unlink(filename);
+	if (strcmp(got, expected))
+		fail("Expected:\n%s\nGot:\n%s", expected, got);
+
+	avr_terminate(avr);
+	free(avr);
+	munmap(m, 2 * page);
+	tests_success();
+	return 0;
+}
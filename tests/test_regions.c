@@ -0,0 +1,115 @@
+/*
+	test_regions.c
+
+	Runs code that opens and closes regions through the command register:
+	each pair must be measured from the write of the region number to the
+	write of the 'stop' code, nested starts must only count the outermost
+	pair, and a stop without a start must not count at all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_regions.h"
+#include "avr/avr_mcu_section.h"
+
+#define GPIOR0	(0x1e + 0x20)
+
+static uint8_t code[256];
+static int code_len, code_insn;
+
+// ldi r16, v; out GPIOR0, r16
+static void
+out(
+		uint8_t v)
+{
+	code[code_len++] = v & 0xf;
+	code[code_len++] = 0xe0 | (v >> 4);
+	code[code_len++] = 0x0e;
+	code[code_len++] = 0xbb;
+	code_insn += 2;
+}
+
+static void
+nop(
+		int count)
+{
+	while (count--) {
+		code[code_len++] = 0;
+		code[code_len++] = 0;
+		code_insn++;
+	}
+}
+
+static void
+start(
+		uint8_t id)
+{
+	out(SIMAVR_CMD_REGION_START);
+	out(id);
+}
+
+static void
+stop(
+		uint8_t id)
+{
+	out(SIMAVR_CMD_REGION_STOP);
+	out(id);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	avr_set_command_register(avr, GPIOR0);
+	avr_regions_set_name(avr, 3, "crc16");
+
+	/*
+	 * Region 3 holds 2 then 10 nops; it also pays for the 'out' of its
+	 * number and the 'ldi' of the stop code, so 4 and 12 cycles.
+	 */
+	start(3); nop(2); stop(3);
+	start(3); nop(10); stop(3);
+	start(5); start(5); nop(1); stop(5); nop(3); stop(5);
+	stop(7);
+	avr_loadcode(avr, code, code_len, 0);
+	for (int i = 0; i < code_insn; i++)
+		avr->pc = avr_run_one(avr);
+
+	avr_regions_t * r = avr->regions;
+	if (!r || !r->used)
+		fail("No region was used");
+	avr_region_t * g = &r->region[3];
+	if (g->hits != 2 || g->min != 4 || g->max != 12 || g->total != 16 ||
+			g->depth)
+		fail("Region 3: %d hits, min %d max %d total %d depth %d",
+				(int)g->hits, (int)g->min, (int)g->max, (int)g->total,
+				(int)g->depth);
+	// the inner pair is not measured, the outer one spans it
+	g = &r->region[5];
+	if (g->hits != 1 || g->total != 14 || g->depth)
+		fail("Region 5: %d hits, total %d depth %d",
+				(int)g->hits, (int)g->total, (int)g->depth);
+	g = &r->region[7];
+	if (g->hits || g->depth)
+		fail("Region 7 was stopped without a start, but counted");
+
+	char * report = NULL;
+	size_t size = 0;
+	FILE * o = open_memstream(&report, &size);
+	avr_regions_report(avr, o);
+	fclose(o);
+	if (!strstr(report, "crc16") || strstr(report, "  7 "))
+		fail("Unexpected report:\n%s", report);
+	free(report);
+
+	avr_terminate(avr);
+	free(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+	test_reload_firmware.c
+
+	Reloads a smaller firmware that uses other command and console
+	registers: the flash left over from the first one must read as erased,
+	the old registers must not be handled anymore, and a command the old
+	firmware left half sent must be dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_elf.h"
+
+#define GPIOR0	(0x1e + 0x20)
+#define GPIOR1	(0x2a + 0x20)
+#define GPIOR2	(0x2b + 0x20)
+
+static int
+registered(
+		avr_t * avr,
+		avr_io_addr_t addr)
+{
+	return avr->io[AVR_DATA_TO_IO(addr)].w.c != NULL;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+
+	static uint8_t big[512], small[2] = { 0xff, 0xcf };	// rjmp .-2
+	memset(big, 0x12, sizeof(big));
+	elf_firmware_t a = {{0}};
+	strcpy(a.mmcu, "atmega88");
+	a.flash = big;
+	a.flashsize = sizeof(big);
+	a.command_register_addr = GPIOR0;
+	a.console_register_addr = GPIOR1;
+	avr_load_firmware(avr, &a);
+	if (!registered(avr, GPIOR0) || !registered(avr, GPIOR1))
+		fail("The first firmware registers are not handled");
+
+	// a multi byte command, half sent
+	avr->commands.pending = &avr->commands.table[0];
+
+	elf_firmware_t b = {{0}};
+	strcpy(b.mmcu, "atmega88");
+	b.flash = small;
+	b.flashsize = sizeof(small);
+	b.command_register_addr = GPIOR2;
+	avr_reload_firmware(avr, &b);
+
+	if (avr->flash[0] != 0xff || avr->flash[1] != 0xcf)
+		fail("The new firmware is not loaded");
+	for (int i = sizeof(small); i <= avr->flashend; i++)
+		if (avr->flash[i] != 0xff)
+			fail("Flash at %04x is %02x after the reload", i, avr->flash[i]);
+	uint16_t overflow = avr->flash[avr->flashend + 1] |
+			(avr->flash[avr->flashend + 2] << 8);
+	if (overflow != AVR_OVERFLOW_OPCODE)
+		fail("The flash overflow opcode is gone");
+	if (registered(avr, GPIOR0) || registered(avr, GPIOR1))
+		fail("The old command or console register is still handled");
+	if (!registered(avr, GPIOR2))
+		fail("The new command register is not handled");
+	if (avr->commands.pending)
+		fail("The half sent command survived the reload");
+
+	avr_terminate(avr);
+	free(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+	test_vcd_input.c
+
+	Replays a small VCD file, once and in a loop, and checks that every
+	value change is applied at the right cycle. The identifiers are digits,
+	like the timestamps, so a timestamp mistaken for a value change shows.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_vcd_file.h"
+
+static const char * vcd_text =
+	"$timescale 1us $end\n"
+	"$scope module logic $end\n"
+	"$var wire 1 5 sig $end\n"
+	"$var wire 8 6 bus $end\n"
+	"$upscope $end\n"
+	"$enddefinitions $end\n"
+	"#0\n"
+	"15\n"
+	"b1 6\n"
+	"#5\n"
+	"05\n"
+	"b10 6\n"
+	"#10\n"
+	"15\n";
+
+typedef struct change_t {
+	avr_cycle_count_t cycle;
+	int signal;
+	uint32_t value;
+} change_t;
+
+static avr_t * avr;
+static change_t changes[32];
+static int change_count;
+
+static void
+signal_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	int signal = (intptr_t)param;
+	if (irq->flags & IRQ_FLAG_FLOATING)
+		fail("signal %d went floating at cycle %d",
+				signal, (int)avr->cycle);
+	if (change_count < 32)
+		changes[change_count++] = (change_t) {
+			.cycle = avr->cycle, .signal = signal, .value = value };
+}
+
+/*
+ * Each timestamp is 8 cycles at 8MHz, and a loop restarts one timestamp
+ * after the last one of the previous pass.
+ */
+static const change_t expected[] = {
+	{ 0, 0, 1 }, { 0, 1, 1 },
+	{ 40, 0, 0 }, { 40, 1, 2 },
+	{ 80, 0, 1 },
+	{ 88, 0, 1 }, { 88, 1, 1 },
+	{ 128, 0, 0 }, { 128, 1, 2 },
+	{ 168, 0, 1 },
+};
+
+static void
+replay(
+		const char * filename,
+		int loop,
+		int count)
+{
+	avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	avr->frequency = 8000000;
+	avr->flash[0] = 0xff;	// rjmp .-2
+	avr->flash[1] = 0xcf;
+
+	avr_vcd_t vcd;
+	if (avr_vcd_init_input(avr, filename, &vcd))
+		fail("Failed to read %s", filename);
+	vcd.loop = loop;
+	if (vcd.signal_count != 2)
+		fail("Expected 2 signals, got %d", vcd.signal_count);
+	for (int i = 0; i < vcd.signal_count; i++)
+		avr_irq_register_notify(&vcd.signal[i]->irq, signal_hook,
+				(void *)(intptr_t)i);
+
+	change_count = 0;
+	while (avr->state != cpu_Done && avr->cycle < 170)
+		avr_run(avr);
+	if (!loop && avr->state != cpu_Done)
+		fail("Replay did not end the simulation");
+	if (change_count != count)
+		fail("Expected %d changes, got %d", count, change_count);
+	/*
+	 * Within a timestamp the changes are applied in file order, but the
+	 * cycle is only known to the next instruction boundary.
+	 */
+	for (int i = 0; i < count; i++)
+		if (changes[i].signal != expected[i].signal ||
+				changes[i].value != expected[i].value ||
+				changes[i].cycle < expected[i].cycle ||
+				changes[i].cycle > expected[i].cycle + 2)
+			fail("Change %d: signal %d = %d at cycle %d, expected "
+					"signal %d = %d at cycle %d", i,
+					changes[i].signal, (int)changes[i].value,
+					(int)changes[i].cycle, expected[i].signal,
+					(int)expected[i].value, (int)expected[i].cycle);
+	avr_vcd_close(&vcd);
+	avr_terminate(avr);
+	free(avr);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char filename[] = "/tmp/simavr_vcd_input_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1 || write(fd, vcd_text, strlen(vcd_text)) != (ssize_t)strlen(vcd_text))
+		fail("Failed to write %s", filename);
+	close(fd);
+
+	replay(filename, 0, 5);
+	replay(filename, 1, 10);
+
+	unlink(filename);
+	tests_success();
+	return 0;
+}